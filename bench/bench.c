@@ -0,0 +1,258 @@
+// Microbenchmarks for the parsing hot paths, run over a corpus directory
+// (see corpus.c). Throughput is files/s and GB/s of the bytes each benchmark covers:
+// bytes loaded, tag or frame header bytes walked, text converted, picture bytes or audio indexed/hashed.
+#define MP3_READER_IMPLEMENTATION
+#include "../mp3_reader.h"
+
+
+typedef struct Corpus {
+    char** paths;
+    uint64_t* sizes;
+    int count;
+    uint64_t bytes;
+    MP3Reader** readers; // One loaded reader per file for the in-memory benchmarks
+    MP3Arena* arena;
+} Corpus;
+
+typedef uint64_t (*BenchFn)(Corpus* corpus, int i); // Returns bytes covered
+
+static double min_seconds = 0.5;
+static volatile uint64_t sink; // keeps results alive
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Whole passes over the corpus until min_seconds have passed
+static void run(Corpus* corpus, const char* name, BenchFn fn) {
+    uint64_t files = 0, bytes = 0;
+    double start = now(), elapsed;
+    do {
+        for (int i = 0; i < corpus->count; i++) {
+            bytes += fn(corpus, i);
+            MP3Arena_reset(corpus->arena);
+        }
+        files += corpus->count;
+        elapsed = now() - start;
+    } while (elapsed < min_seconds);
+
+    printf("%-14s %12.0f files/s %8.3f GB/s\n", name, files / elapsed, bytes / elapsed / 1e9);
+}
+
+
+/*
+    Loading
+*/
+
+static MP3Reader* scratch_reader;
+
+static uint64_t bench_fread(Corpus* corpus, int i) {
+    if (MP3Reader_load(scratch_reader, corpus->paths[i]) != 0) return 0;
+    return scratch_reader->size;
+}
+
+// Mapped bytes, only the first page is touched
+static uint64_t bench_mmap(Corpus* corpus, int i) {
+    if (MP3Reader_loadMmap(scratch_reader, corpus->paths[i]) != 0 || scratch_reader->size == 0) return 0;
+    sink += scratch_reader->data[0];
+    return scratch_reader->size;
+}
+
+static uint64_t bench_partial(Corpus* corpus, int i) {
+    if (MP3Reader_loadTags(scratch_reader, corpus->paths[i]) != 0) return 0;
+    return scratch_reader->size;
+}
+
+
+/*
+    In-memory parsing
+*/
+
+// Full scan, covers the whole file
+static uint64_t bench_tags(Corpus* corpus, int i) {
+    vector* tags = MP3Reader_getID3v2Tags(corpus->readers[i]);
+    sink += vector_size(tags);
+    return corpus->readers[i]->size;
+}
+
+static uint64_t bench_frames(Corpus* corpus, int i) {
+    MP3Reader* reader = corpus->readers[i];
+    uint64_t bytes = 0;
+    ID3v2TagIter tags;
+    ID3v2TagIter_init(&tags, reader, MP3_TAGSCAN_SPEC);
+    ID3v2TagHeader* tag;
+    while ((tag = ID3v2TagIter_next(&tags)) != NULL) {
+        bytes += sizeof(ID3v2TagHeader);
+        uint32_t header_size = ID3v2Tag_getFrameHeaderSize(tag);
+        ID3v2FrameIter frames;
+        ID3v2FrameIter_init(&frames, reader, tag);
+        ID3v2TagFrameHeader* frame;
+        while ((frame = ID3v2FrameIter_next(&frames)) != NULL) {
+            sink += ID3v2Tag_getFrameSize(tag, frame);
+            bytes += header_size; // the walk only touches headers, never the payloads it skips
+        }
+    }
+    return bytes;
+}
+
+static uint64_t bench_text(Corpus* corpus, int i) {
+    static const int ids[] = { MP3_FRAME_TIT2, MP3_FRAME_TPE1, MP3_FRAME_TALB, MP3_FRAME_TRCK };
+    MP3Reader* reader = corpus->readers[i];
+    ID3v2TagIter tags;
+    ID3v2TagIter_init(&tags, reader, MP3_TAGSCAN_SPEC);
+    ID3v2TagHeader* tag = ID3v2TagIter_next(&tags);
+    if (tag == NULL) return 0;
+
+    uint64_t bytes = 0;
+    char utf8[256];
+    for (int j = 0; j < 4; j++) {
+        ID3v2TagFrameHeader* frame = MP3Reader_findFrame(reader, tag, ids[j]);
+        if (frame != NULL && MP3Reader_readFrameTextUTF8(reader, tag, frame, utf8, sizeof(utf8)) > 0) {
+            sink += (uint8_t) utf8[0];
+            bytes += ID3v2Tag_getFrameSize(tag, frame);
+        }
+    }
+    return bytes;
+}
+
+static uint8_t* picture_copy;
+
+static uint64_t bench_picture(Corpus* corpus, int i) {
+    MP3Reader* reader = corpus->readers[i];
+    ID3v2TagIter tags;
+    ID3v2TagIter_init(&tags, reader, MP3_TAGSCAN_SPEC);
+    ID3v2TagHeader* tag = ID3v2TagIter_next(&tags);
+    if (tag == NULL) return 0;
+
+    ID3v2TagFrameHeader* frame = MP3Reader_findFrame(reader, tag, MP3_FRAME_APIC);
+    MP3_Picture picture;
+    if (frame != NULL && MP3Reader_readFramePicture(reader, tag, frame, &picture) == 0 && picture.size <= MP3_READER_MAX_FRAME_SIZE) {
+        memcpy(picture_copy, picture.data, picture.size);
+        sink += picture_copy[0];
+        return picture.size;
+    }
+    return 0;
+}
+
+static uint64_t bench_index(Corpus* corpus, int i) {
+    MP3Reader* reader = corpus->readers[i];
+    uint32_t start, end;
+    MP3FrameIndex index;
+    if (MP3Reader_getAudioRange(reader, &start, &end) != 0 || MP3Reader_buildFrameIndex(reader, &index) != 0) return 0;
+    sink += index.count;
+    MP3FrameIndex_free(&index);
+    return end - start;
+}
+
+static uint64_t bench_index_parallel(Corpus* corpus, int i) {
+    MP3Reader* reader = corpus->readers[i];
+    uint32_t start, end;
+    MP3FrameIndex index;
+    if (MP3Reader_getAudioRange(reader, &start, &end) != 0 || MP3Reader_buildFrameIndexParallel(reader, &index, 0) != 0) return 0;
+    sink += index.count;
+    MP3FrameIndex_free(&index);
+    return end - start;
+}
+
+static uint64_t bench_hash(Corpus* corpus, int i) {
+    MP3AudioHash hash;
+    if (MP3Reader_hashAudio(corpus->readers[i], 0, &hash) != 0) return 0;
+    sink += hash.hash;
+    return hash.size;
+}
+
+
+static int corpus_load(Corpus* corpus, const char* dir) {
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        printf("Can't open corpus directory: %s\n", dir);
+        return -1;
+    }
+    memset(corpus, 0, sizeof(Corpus));
+    int capacity = 0;
+    size_t dir_len = strlen(dir);
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len < 4 || strcmp(entry->d_name + len - 4, ".mp3") != 0) continue;
+        if (corpus->count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            corpus->paths = (char**) realloc(corpus->paths, capacity * sizeof(char*));
+            corpus->sizes = (uint64_t*) realloc(corpus->sizes, capacity * sizeof(uint64_t));
+        }
+        char* path = (char*) malloc(dir_len + len + 2);
+        memcpy(path, dir, dir_len);
+        path[dir_len] = '/';
+        memcpy(path + dir_len + 1, entry->d_name, len + 1);
+
+        struct stat st;
+        if (stat(path, &st) != 0) {
+            free(path);
+            continue;
+        }
+        corpus->paths[corpus->count] = path;
+        corpus->sizes[corpus->count] = st.st_size;
+        corpus->bytes += st.st_size;
+        corpus->count++;
+    }
+    closedir(d);
+    if (corpus->count == 0) {
+        printf("No .mp3 files in %s\n", dir);
+        return -1;
+    }
+
+    corpus->arena = MP3Arena_create(0);
+    corpus->readers = (MP3Reader**) calloc(corpus->count, sizeof(MP3Reader*));
+    for (int i = 0; i < corpus->count; i++) {
+        corpus->readers[i] = MP3Reader_createWithArena(NULL, corpus->arena);
+        MP3Reader_load(corpus->readers[i], corpus->paths[i]);
+    }
+    return 0;
+}
+
+static void corpus_free(Corpus* corpus) {
+    for (int i = 0; i < corpus->count; i++) {
+        MP3Reader_destroy(corpus->readers[i]);
+        free(corpus->paths[i]);
+    }
+    MP3Arena_destroy(corpus->arena);
+    free(corpus->readers);
+    free(corpus->paths);
+    free(corpus->sizes);
+}
+
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        printf("Usage: %s <corpus_dir> [seconds]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2) min_seconds = atof(argv[2]);
+
+    Corpus corpus;
+    if (corpus_load(&corpus, argv[1]) != 0) return 1;
+    printf("Corpus: %d files, %.1f MB\n", corpus.count, corpus.bytes / 1e6);
+
+    scratch_reader = MP3Reader_create(NULL);
+    picture_copy = (uint8_t*) malloc(MP3_READER_MAX_FRAME_SIZE);
+    if (scratch_reader == NULL || picture_copy == NULL) return 1;
+
+    run(&corpus, "load_fread", bench_fread);
+    run(&corpus, "load_mmap", bench_mmap);
+    run(&corpus, "load_partial", bench_partial);
+    run(&corpus, "tag_scan", bench_tags);
+    run(&corpus, "frame_walk", bench_frames);
+    run(&corpus, "text", bench_text);
+    run(&corpus, "apic", bench_picture);
+    run(&corpus, "frame_index", bench_index);
+    run(&corpus, "frame_index_mt", bench_index_parallel);
+    run(&corpus, "audio_hash", bench_hash);
+
+    free(picture_copy);
+    MP3Reader_destroy(scratch_reader);
+    corpus_free(&corpus);
+    return 0;
+}
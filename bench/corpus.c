@@ -0,0 +1,289 @@
+// Synthetic corpus for the benchmarks: ID3v2.2/2.3/2.4 tags, small and large APIC
+// frames, CBR and VBR (Xing) audio and a few pathological files
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+
+typedef struct Buffer {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+} Buffer;
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)(rng_state >> 16);
+}
+
+static void put(Buffer* b, const void* data, size_t len) {
+    if (b->size + len > b->capacity) {
+        size_t capacity = b->capacity ? b->capacity : 4096;
+        while (capacity < b->size + len) capacity *= 2;
+        b->data = (uint8_t*) realloc(b->data, capacity);
+        if (b->data == NULL) {
+            printf("Out of memory\n");
+            exit(1);
+        }
+        b->capacity = capacity;
+    }
+    if (data != NULL) memcpy(b->data + b->size, data, len);
+    else memset(b->data + b->size, 0, len);
+    b->size += len;
+}
+
+static void put8(Buffer* b, uint8_t v) {
+    put(b, &v, 1);
+}
+
+static void putBE32(Buffer* b, uint32_t v) {
+    uint8_t p[4] = { (uint8_t)(v >> 24), (uint8_t)(v >> 16), (uint8_t)(v >> 8), (uint8_t) v };
+    put(b, p, 4);
+}
+
+static void putSyncsafe(uint8_t* p, uint32_t v) {
+    p[0] = (v >> 21) & 0x7F;
+    p[1] = (v >> 14) & 0x7F;
+    p[2] = (v >> 7) & 0x7F;
+    p[3] = v & 0x7F;
+}
+
+
+/*
+    ID3v2 tags
+*/
+
+// Frame header for version 2, 3 or 4, payload follows
+static void putFrameHeader(Buffer* b, int version, const char* id, uint32_t size) {
+    if (version == 2) {
+        put(b, id, 3);
+        uint8_t p[3] = { (uint8_t)(size >> 16), (uint8_t)(size >> 8), (uint8_t) size };
+        put(b, p, 3);
+        return;
+    }
+    put(b, id, 4);
+    if (version == 4) {
+        uint8_t p[4];
+        putSyncsafe(p, size);
+        put(b, p, 4);
+    } else {
+        putBE32(b, size);
+    }
+    put(b, NULL, 2); // flags
+}
+
+static void putTextFrame(Buffer* b, int version, const char* id, int encoding, const char* text) {
+    size_t len = strlen(text);
+    if (encoding == 1) { // UTF-16 with BOM
+        putFrameHeader(b, version, id, (uint32_t)(1 + 2 + len * 2));
+        put8(b, 1);
+        put8(b, 0xFF);
+        put8(b, 0xFE);
+        for (size_t i = 0; i < len; i++) {
+            put8(b, (uint8_t) text[i]);
+            put8(b, 0);
+        }
+        return;
+    }
+    putFrameHeader(b, version, id, (uint32_t)(1 + len));
+    put8(b, (uint8_t) encoding);
+    put(b, text, len);
+}
+
+static void putPicture(Buffer* b, int version, uint32_t size) {
+    const char* mime = "image/jpeg";
+    uint32_t header = version == 2 ? 1 + 3 + 1 + 1 : 1 + (uint32_t) strlen(mime) + 1 + 1 + 1;
+    putFrameHeader(b, version, version == 2 ? "PIC" : "APIC", header + size);
+    put8(b, 0);
+    if (version == 2) put(b, "JPG", 3);
+    else put(b, mime, strlen(mime) + 1);
+    put8(b, 3); // front cover
+    put8(b, 0); // empty description
+    size_t start = b->size;
+    put(b, NULL, size);
+    for (size_t i = start; i + 4 <= b->size; i += 4) {
+        uint32_t v = rng();
+        memcpy(b->data + i, &v, 4);
+    }
+    if (size >= 2) {
+        b->data[start] = 0xFF; // JPEG SOI
+        b->data[start + 1] = 0xD8;
+    }
+}
+
+// Tag with the common text frames, extra text frames and an optional picture
+static void putTag(Buffer* b, int version, int index, uint32_t picture_size, int extra_frames, uint32_t padding) {
+    size_t start = b->size;
+    uint8_t header[10] = { 'I', 'D', '3', (uint8_t) version, 0, 0, 0, 0, 0, 0 };
+    put(b, header, 10);
+
+    char text[64];
+    snprintf(text, sizeof(text), "Title %d", index);
+    int utf16 = index % 3 == 0;
+    putTextFrame(b, version, version == 2 ? "TT2" : "TIT2", utf16, text);
+    snprintf(text, sizeof(text), "Artist %d", index % 17);
+    putTextFrame(b, version, version == 2 ? "TP1" : "TPE1", 0, text);
+    snprintf(text, sizeof(text), "Album %d", index % 5);
+    putTextFrame(b, version, version == 2 ? "TAL" : "TALB", version == 4 ? 3 : 0, text);
+    snprintf(text, sizeof(text), "%d", 1990 + index % 30);
+    putTextFrame(b, version, version == 2 ? "TYE" : (version == 4 ? "TDRC" : "TYER"), 0, text);
+    snprintf(text, sizeof(text), "%d/12", index % 12 + 1);
+    putTextFrame(b, version, version == 2 ? "TRK" : "TRCK", 0, text);
+    for (int i = 0; i < extra_frames; i++) {
+        snprintf(text, sizeof(text), "Comment text number %d", i);
+        putTextFrame(b, version, version == 2 ? "TXX" : "TXXX", 0, text);
+    }
+    if (picture_size > 0) putPicture(b, version, picture_size);
+    put(b, NULL, padding);
+
+    putSyncsafe(b->data + start + 6, (uint32_t)(b->size - start - 10));
+}
+
+
+/*
+    MPEG audio
+*/
+
+static const uint32_t bitrates[] = { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 };
+
+// MPEG-1 Layer III, 44.1 kHz, mono
+static uint32_t frameSize(int bitrate_index, int padding) {
+    return 144000 * bitrates[bitrate_index] / 44100 + padding;
+}
+
+static void putFrame(Buffer* b, int bitrate_index, int padding) {
+    size_t start = b->size;
+    uint8_t header[4] = { 0xFF, 0xFB, (uint8_t)((bitrate_index << 4) | (padding << 1)), 0xC4 };
+    put(b, header, 4);
+    put(b, NULL, frameSize(bitrate_index, padding) - 4);
+    for (size_t i = start + 4 + 17; i < b->size; i += 7) b->data[i] = (uint8_t) rng();
+}
+
+// frames audio frames, VBR ones get a Xing header frame first
+static void putAudio(Buffer* b, uint32_t frames, int vbr) {
+    if (vbr) {
+        size_t start = b->size;
+        putFrame(b, 9, 0);
+        uint8_t* xing = b->data + start + 4 + 17;
+        memcpy(xing, "Xing", 4);
+        xing[7] = 0x07; // frames, bytes, TOC
+        for (int i = 0; i < 4; i++) xing[8 + i] = (uint8_t)(frames >> (24 - 8 * i));
+        for (int i = 0; i < 100; i++) xing[16 + i] = (uint8_t)(i * 256 / 100);
+    }
+
+    uint32_t acc = 0;
+    for (uint32_t i = 0; i < frames; i++) {
+        int index = vbr ? 5 + (int)(rng() % 10) : 9;
+        acc += 144000 * bitrates[index] % 44100;
+        int padding = acc >= 44100;
+        if (padding) acc -= 44100;
+        putFrame(b, index, padding);
+    }
+}
+
+static void putID3v1(Buffer* b, int index) {
+    uint8_t tag[128];
+    memset(tag, 0, sizeof(tag));
+    memcpy(tag, "TAG", 3);
+    snprintf((char*) tag + 3, 30, "Title %d", index);
+    tag[127] = 12;
+    put(b, tag, sizeof(tag));
+}
+
+
+static int writeFile(const char* dir, const char* name, const Buffer* b) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE* file = fopen(path, "wb");
+    if (file == NULL || (b->size > 0 && fwrite(b->data, 1, b->size, file) != b->size)) {
+        printf("Failed to write %s\n", path);
+        if (file != NULL) fclose(file);
+        return -1;
+    }
+    fclose(file);
+    return 0;
+}
+
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        printf("Usage: %s <dir> [files]\n", argv[0]);
+        return 1;
+    }
+    const char* dir = argv[1];
+    int files = argc > 2 ? atoi(argv[2]) : 200;
+    mkdir(dir, 0755);
+
+    Buffer b = { NULL, 0, 0 };
+    char name[64];
+    uint64_t total = 0;
+    for (int i = 0; i < files; i++) {
+        b.size = 0;
+        int version = 2 + i % 3;
+        // every 10th file carries a 1 MB cover, the others small ones or none
+        uint32_t picture = i % 10 == 0 ? 1024 * 1024 : (i % 2 ? 16 * 1024 + (rng() % 4096) : 0);
+        putTag(&b, version, i, picture, i % 7 == 0 ? 40 : 2, i % 4 == 0 ? 2048 : 0);
+        putAudio(&b, 300 + rng() % 1500, i % 2);
+        if (i % 3 != 1) putID3v1(&b, i);
+        snprintf(name, sizeof(name), "v2%d_%04d.mp3", version, i);
+        if (writeFile(dir, name, &b) != 0) return 1;
+        total += b.size;
+    }
+
+    // pathological sizes
+    b.size = 0;
+    if (writeFile(dir, "empty.mp3", &b) != 0) return 1;
+
+    uint8_t huge[10] = { 'I', 'D', '3', 4, 0, 0, 0x7F, 0x7F, 0x7F, 0x7F }; // tag larger than the file
+    put(&b, huge, 10);
+    putTextFrame(&b, 4, "TIT2", 0, "Truncated");
+    if (writeFile(dir, "tag_past_eof.mp3", &b) != 0) return 1;
+
+    b.size = 0;
+    putTag(&b, 3, 0, 0, 0, 0);
+    putFrameHeader(&b, 3, "TIT2", 0x7FFFFFFF); // frame claims more than the tag
+    putSyncsafe(b.data + 6, (uint32_t)(b.size - 10));
+    putAudio(&b, 50, 0);
+    if (writeFile(dir, "frame_past_tag.mp3", &b) != 0) return 1;
+
+    b.size = 0;
+    putTag(&b, 3, 3, 0, 0, 0);
+    putFrameHeader(&b, 3, "TIT2", 5000); // text frame running past the tag into the audio
+    put8(&b, 0);
+    put(&b, "Short", 5);
+    putSyncsafe(b.data + 6, (uint32_t)(b.size - 10));
+    putAudio(&b, 50, 0);
+    if (writeFile(dir, "text_past_tag.mp3", &b) != 0) return 1;
+
+    b.size = 0;
+    putTag(&b, 3, 4, 0, 0, 0);
+    putPicture(&b, 3, 100);
+    uint32_t apic = (uint32_t)(b.size - (1 + 10 + 1 + 1 + 1 + 100)); // picture frame payload
+    uint8_t* size = b.data + apic - 6;
+    for (int i = 0; i < 4; i++) size[i] = (uint8_t)(100000 >> (24 - 8 * i)); // picture past the end of the file
+    putSyncsafe(b.data + 6, (uint32_t)(b.size - 10 + 100000));
+    if (writeFile(dir, "picture_past_eof.mp3", &b) != 0) return 1;
+
+    b.size = 0;
+    putTag(&b, 4, 1, 0, 4000, 0); // many tiny frames
+    putAudio(&b, 100, 0);
+    if (writeFile(dir, "many_frames.mp3", &b) != 0) return 1;
+
+    b.size = 0;
+    putTag(&b, 3, 2, 0, 2, 256 * 1024); // mostly padding, no audio
+    if (writeFile(dir, "padding_only.mp3", &b) != 0) return 1;
+
+    b.size = 0;
+    putAudio(&b, 20000, 0); // no tags, long CBR stream
+    if (writeFile(dir, "audio_only.mp3", &b) != 0) return 1;
+
+    printf("Wrote %d files (%.1f MB) to %s\n", files + 8, total / 1e6, dir);
+    free(b.data);
+    return 0;
+}
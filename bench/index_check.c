@@ -0,0 +1,115 @@
+// Equivalence check for the parallel frame index: random MPEG streams (mixed bitrates,
+// padding, junk runs between frames, fake sync words inside payloads) are indexed
+// serially and with 2..17 threads, the results must be identical. Chunks are kept
+// tiny so every stream is split many times and each stitch point is exercised.
+#define MP3_INDEX_CHUNK_MIN 512
+#define MP3_READER_IMPLEMENTATION
+#include "../mp3_reader.h"
+
+#define CHECK_STREAMS 300
+#define CHECK_MAX_FRAMES 3000
+#define CHECK_THREADS_MAX 17
+
+
+static uint64_t state = 88172645463325252ULL;
+
+static uint32_t next_random(void) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return (uint32_t) state;
+}
+
+// MPEG-1 Layer III kbps by bitrate index, 0 is free format and not generated
+static const uint32_t bitrates[] = { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 };
+
+static uint32_t frame_size(int bitrate, int padding) {
+    return 144000 * bitrates[bitrate] / 44100 + padding;
+}
+
+static void put_header(uint8_t* p, int bitrate, int padding) {
+    p[0] = 0xFF;
+    p[1] = 0xFB; // MPEG-1 Layer III, no CRC
+    p[2] = (uint8_t)((bitrate << 4) | (padding << 1)); // 44.1 kHz
+    p[3] = 0xC4;
+}
+
+// Sync word inside a payload, sometimes followed by a second one where the first claims to end
+static void put_fake(uint8_t* p, uint32_t room) {
+    if (room < 200) return;
+    uint32_t offset = next_random() % (room - 200);
+    int bitrate = 1 + next_random() % 3;
+    uint32_t size = frame_size(bitrate, 0);
+    put_header(p + offset, bitrate, 0);
+    if (offset + size + 4 <= room) put_header(p + offset + size, 9, 0);
+}
+
+static uint32_t make_stream(uint8_t* buf) {
+    uint32_t n = 0;
+    uint32_t frames = 50 + next_random() % CHECK_MAX_FRAMES;
+    for (uint32_t i = 0; i < frames; i++) {
+        if (next_random() % 40 == 0) { // junk, mostly 0xFF to look like sync
+            uint32_t junk = next_random() % 600;
+            for (uint32_t k = 0; k < junk; k++) buf[n++] = next_random() % 3 ? 0xFF : (uint8_t) next_random();
+        }
+        int bitrate = 1 + next_random() % 14;
+        int padding = next_random() & 1;
+        uint32_t size = frame_size(bitrate, padding);
+        put_header(buf + n, bitrate, padding);
+        for (uint32_t k = 4; k < size; k++) buf[n + k] = next_random() % 5 ? 0 : (uint8_t) next_random();
+        if (next_random() % 3 == 0) put_fake(buf + n + 4, size - 4);
+        n += size;
+    }
+    return n;
+}
+
+static int same_index(const MP3FrameIndex* a, const MP3FrameIndex* b) {
+    return a->count == b->count && a->total_samples == b->total_samples && a->sample_rate == b->sample_rate &&
+           (a->count == 0 || memcmp(a->entries, b->entries, a->count * sizeof(*a->entries)) == 0);
+}
+
+
+int main(void) {
+    // largest stream: every frame at 320 kbps with padding plus the longest junk run
+    uint8_t* buf = (uint8_t*) malloc((size_t)(50 + CHECK_MAX_FRAMES) * (frame_size(14, 1) + 600));
+    MP3Reader* reader = MP3Reader_create(NULL);
+    if (buf == NULL || reader == NULL) {
+        printf("Failed to allocate memory\n");
+        return 1;
+    }
+
+    int failures = 0;
+    for (int stream = 0; stream < CHECK_STREAMS; stream++) {
+        uint32_t size = make_stream(buf);
+        reader->data = buf;
+        reader->size = reader->head_size = reader->file_size = size;
+        reader->storage = MP3_STORAGE_USER;
+
+        MP3FrameIndex serial;
+        if (MP3Reader_buildFrameIndex(reader, &serial) != 0) {
+            printf("Stream %d: serial index failed\n", stream);
+            return 1;
+        }
+        for (int threads = 2; threads <= CHECK_THREADS_MAX; threads++) {
+            MP3FrameIndex parallel;
+            if (MP3Reader_buildFrameIndexParallel(reader, &parallel, threads) != 0) {
+                printf("Stream %d: parallel index failed with %d threads\n", stream, threads);
+                return 1;
+            }
+            if (!same_index(&serial, &parallel)) {
+                printf("Stream %d (%u bytes): %u frames serially, %u with %d threads\n", stream, size, serial.count, parallel.count, threads);
+                failures++;
+            }
+            MP3FrameIndex_free(&parallel);
+        }
+        MP3FrameIndex_free(&serial);
+    }
+
+    reader->data = NULL;
+    reader->storage = MP3_STORAGE_NONE;
+    MP3Reader_destroy(reader);
+    free(buf);
+    if (failures > 0) return 1;
+    printf("Parallel index matches serial on %d streams, 2-%d threads\n", CHECK_STREAMS, CHECK_THREADS_MAX);
+    return 0;
+}
@@ -1,40 +1,215 @@
+// Built against libmp3reader with -DMP3_READER_LIBRARY (make mp3-reader-shared)
+#ifndef MP3_READER_LIBRARY
 #define MP3_READER_IMPLEMENTATION
+#endif
 #include "mp3_reader.h"
-#include <iconv.h>
-
-char* utf16_to_utf8(char* input, size_t input_len) {
-    size_t out_len = input_len*2;
-    char *output = malloc(out_len);
-    if (output == NULL) return NULL;
-    
-    iconv_t cd = iconv_open("UTF-8", "UTF-16");
-    if (cd == (iconv_t)-1) {
-        printf("iconv_open failed\n");
-        free(output);
-        return NULL;
-    }
-
-    char *out_ptr = output;
-    char *in_ptr = input;
-    if (iconv(cd, &in_ptr, &input_len, &out_ptr, &out_len) == (size_t) -1) {
-        printf("iconv failed to convert\n");
-        free(output);
-        return NULL;
-    }
-    iconv_close(cd);
-
-    *out_ptr = '\0';
-    return output;
+#include <signal.h>
+#include <unistd.h>
+
+
+void print_text(const MP3_TextData* text) {
+    char utf8[1024];
+    if (text->len > 0 && MP3_TextData_toUTF8(text, utf8, sizeof(utf8)) > 0) {
+        printf("%s", utf8);
+    }
 }
 
 
+typedef struct ScanOutput {
+    MP3Writer* writer;
+    long cached;
+} ScanOutput;
+
+
+int print_record(void* user, int worker, const MP3Record* record) {
+    ScanOutput* output = (ScanOutput*) user;
+    if (record->cached) __atomic_add_fetch(&output->cached, 1, __ATOMIC_RELAXED);
+    return MP3Writer_write(output->writer, worker, record);
+}
+
+
+int scan(const char* root, int threads, int queue_depth, const char* cache, int format, int stats) {
+    ScanOutput output = { MP3Writer_create(STDOUT_FILENO, format), 0 };
+    if (output.writer == NULL) return 1;
+
+    MP3ScanOptions options;
+    MP3ScanOptions_init(&options);
+    options.threads = threads;
+    options.queue_depth = queue_depth;
+    options.pictures = MP3PictureCache_create();
+    options.cache = cache != NULL ? MP3Cache_open(cache) : NULL;
+    options.on_record = print_record;
+    options.user = &output;
+
+    long files = MP3Scan_run(root, &options);
+    if (MP3Writer_flush(output.writer) != 0) {
+        fprintf(stderr, "Failed to write records\n");
+        files = -1;
+    }
+    MP3Writer_destroy(output.writer);
+    if (files >= 0) {
+        fprintf(stderr, "Scanned %ld files (%ld cached), %u distinct pictures\n", files, output.cached, options.pictures ? MP3PictureCache_count(options.pictures) : 0);
+        if (options.cache != NULL) MP3Cache_save(options.cache);
+    }
+    MP3Cache_close(options.cache);
+    MP3PictureCache_destroy(options.pictures);
+
+    if (stats) {
+#ifdef MP3_READER_STATS
+        MP3Stats total;
+        MP3Stats_collect(&total);
+        MP3Stats_print(&total, stderr);
+#else
+        fprintf(stderr, "Stats are not compiled in, build with -DMP3_READER_STATS\n");
+#endif
+    }
+    return files < 0;
+}
+
+
+// --set <file> [--padding <bytes>] ID=text..., an empty text removes the frame
+int set_tags(int argc, char* argv[]) {
+    MP3TextEdit* edits = (MP3TextEdit*) calloc(argc, sizeof(MP3TextEdit));
+    uint32_t padding = 4096;
+    int count = 0;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--padding") == 0 && i + 1 < argc) {
+            padding = (uint32_t) atoi(argv[++i]);
+            continue;
+        }
+        char* value = strchr(argv[i], '=');
+        if (value == NULL || value - argv[i] != 4 || MP3_getFrameId(argv[i]) == MP3_FRAME_UNKNOWN) {
+            printf("Expected ID=text, got: %s\n", argv[i]);
+            free(edits);
+            return 1;
+        }
+        edits[count].id = MP3_getFrameId(argv[i]);
+        edits[count].text = value[1] != 0 ? value + 1 : NULL;
+        count++;
+    }
+
+    MP3Reader* reader = MP3Reader_create(NULL);
+    int result = reader != NULL ? MP3Reader_updateTag(reader, argv[2], edits, count, padding) : -1;
+    if (result == 0) printf("Updated tag in place: %s\n", argv[2]);
+    else if (result == 1) printf("Rewrote file: %s\n", argv[2]);
+    MP3Reader_destroy(reader);
+    free(edits);
+    return result < 0;
+}
+
+
+// --hash [--skip-vbr] <file>..., prints hash, audio bytes and path per file
+int hash_files(int argc, char* argv[]) {
+    int flags = 0, failed = 0;
+    MP3Reader* reader = MP3Reader_create(NULL);
+    if (reader == NULL) return 1;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--skip-vbr") == 0) {
+            flags |= MP3_AUDIOHASH_SKIP_VBR;
+            continue;
+        }
+        MP3AudioHash hash;
+        if (MP3Reader_loadTags(reader, argv[i]) != 0 || MP3Reader_hashAudio(reader, flags, &hash) != 0) {
+            failed = 1;
+            continue;
+        }
+        printf("%016llx\t%u\t%s\n", (unsigned long long) hash.hash, hash.size, argv[i]);
+    }
+    MP3Reader_destroy(reader);
+    return failed;
+}
+
+
+static MP3Server* server;
+
+static void stop_server(int sig) {
+    (void) sig;
+    MP3Server_stop(server);
+}
+
+// --serve <socket> [threads] [--cache-entries <n>], runs until SIGINT or SIGTERM
+int serve(int argc, char* argv[]) {
+    MP3ServerOptions options;
+    MP3ServerOptions_init(&options);
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--cache-entries") == 0 && i + 1 < argc) options.cache_entries = (uint32_t) atoi(argv[++i]);
+        else options.threads = atoi(argv[i]);
+    }
+
+    server = MP3Server_create(argv[2], &options);
+    if (server == NULL) return 1;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_server;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    fprintf(stderr, "Listening on %s\n", argv[2]);
+    int result = MP3Server_run(server);
+    MP3Server_destroy(server);
+    return result != 0;
+}
+
 
 int main(int argc, char *argv[]) {
     if (argc < 2) {
         printf("Usage: %s <mp3_file>\n", argv[0]);
+        printf("       %s --scan <dir> [threads] [queue_depth] [--cache <file>] [--format tsv|json|binary] [--stats]\n", argv[0]);
+        printf("       %s --set <mp3_file> [--padding <bytes>] <ID>=<text>...\n", argv[0]);
+        printf("       %s --hash [--skip-vbr] <mp3_file>...\n", argv[0]);
+        printf("       %s --serve <socket> [threads] [--cache-entries <n>]\n", argv[0]);
         return 1;
     }
 
+    if (strcmp(argv[1], "--serve") == 0) {
+        if (argc < 3) {
+            printf("Usage: %s --serve <socket> [threads] [--cache-entries <n>]\n", argv[0]);
+            return 1;
+        }
+        return serve(argc, argv);
+    }
+
+    if (strcmp(argv[1], "--hash") == 0) {
+        if (argc < 3) {
+            printf("Usage: %s --hash [--skip-vbr] <mp3_file>...\n", argv[0]);
+            return 1;
+        }
+        return hash_files(argc, argv);
+    }
+
+    if (strcmp(argv[1], "--set") == 0) {
+        if (argc < 3) {
+            printf("Usage: %s --set <mp3_file> [--padding <bytes>] <ID>=<text>...\n", argv[0]);
+            return 1;
+        }
+        return set_tags(argc, argv);
+    }
+
+    if (strcmp(argv[1], "--scan") == 0) {
+        if (argc < 3) {
+            printf("Usage: %s --scan <dir> [threads] [queue_depth] [--cache <file>] [--format tsv|json|binary] [--stats]\n", argv[0]);
+            return 1;
+        }
+        int numbers[2] = { 0, 0 }, count = 0;
+        const char* cache = NULL;
+        int format = MP3_WRITER_TSV, stats = 0;
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) cache = argv[++i];
+            else if (strcmp(argv[i], "--stats") == 0) stats = 1;
+            else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+                const char* name = argv[++i];
+                if (strcmp(name, "json") == 0) format = MP3_WRITER_JSON;
+                else if (strcmp(name, "binary") == 0) format = MP3_WRITER_BINARY;
+                else if (strcmp(name, "tsv") != 0) {
+                    printf("Unknown format: %s\n", name);
+                    return 1;
+                }
+            }
+            else if (count < 2) numbers[count++] = atoi(argv[i]);
+        }
+        return scan(argv[2], numbers[0], numbers[1], cache, format, stats);
+    }
+
     MP3Reader* reader = MP3Reader_create(argv[1]);
     if (!reader) {
         return 1;
@@ -68,64 +243,52 @@ int main(int argc, char *argv[]) {
             printf("Found %d frames\n", vector_size(frames));
             for (int j = 0; j < vector_size(frames); j++) {
                 ID3v2TagFrameHeader* frameHeader = (ID3v2TagFrameHeader*) vector_index(frames, j);
-                printf("- Frame: %s (%u bytes)\n", frameHeader->header, ID3v2Tag_getFrameSize(tagHeader, frameHeader));
-
-                if (strncmp(frameHeader->header, "TIT2", 4) == 0) {
-                    MP3_TextData *text_data = MP3Reader_getFrameTextData(tagHeader, frameHeader);
-                    if (text_data != NULL) {
-                        printf("Encoding: %s\n", textEncoding[text_data->encoding]);
-                        printf("Title: ");
-                        if (text_data->encoding == 1 || text_data->encoding == 2) { // utf-16
-                            char* conv = utf16_to_utf8(text_data->data, text_data->len);
-                            if (conv != NULL) printf("%s", conv);
-                            free(conv);
-                        } else {
-                            printf("%s", text_data->data);
+                printf("- Frame: %.*s (%u bytes)\n", tagHeader->version_major == 2 ? 3 : 4, frameHeader->header, ID3v2Tag_getFrameSize(tagHeader, frameHeader));
+
+                switch (ID3v2Tag_getFrameId(tagHeader, frameHeader)) {
+                    case MP3_FRAME_TIT2: {
+                        MP3_TextData text_data;
+                        if (MP3Reader_readFrameText(reader, tagHeader, frameHeader, &text_data) == 0) {
+                            printf("Encoding: %s\n", textEncoding[text_data.encoding]);
+                            printf("Title: ");
+                            print_text(&text_data);
+                            printf("\n");
                         }
-                        printf("\n");
-                        MP3_TextData_free(text_data);
+                        break;
                     }
-                }
-                else if (strncmp(frameHeader->header, "TPE1", 4) == 0) {
-                    MP3_TextData *text_data = MP3Reader_getFrameTextData(tagHeader, frameHeader);
-                    if (text_data != NULL) {
-                        printf("Encoding: %s\n", textEncoding[text_data->encoding]);
-                        printf("Artist: ");
-                        if (text_data->encoding == 1 || text_data->encoding == 2) { // utf-16
-                            char* conv = utf16_to_utf8(text_data->data, text_data->len);
-                            if (conv != NULL) printf("%s", conv);
-                            free(conv);
-                        } else {
-                            printf("%s", text_data->data);
+                    case MP3_FRAME_TPE1: {
+                        MP3_TextData text_data;
+                        if (MP3Reader_readFrameText(reader, tagHeader, frameHeader, &text_data) == 0) {
+                            printf("Encoding: %s\n", textEncoding[text_data.encoding]);
+                            printf("Artist: ");
+                            print_text(&text_data);
+                            printf("\n");
                         }
-                        printf("\n");
-                        MP3_TextData_free(text_data);
+                        break;
                     }
-                }
-                /*
-                ... other tags
-                */ 
-                else if (strncmp(frameHeader->header, "APIC", 4) == 0) {
-                    MP3_Picture* picture = MP3Reader_getFramePictureData(tagHeader, frameHeader);
-                    if (picture != NULL) {
-                        printf("Picture: MIME type: %s, size: %u bytes\n", picture->mime_type, picture->size);
-                        
-                        if (strcmp((char*)picture->mime_type, "image/jpeg") == 0 || strcmp((char*)picture->mime_type, "image/jpg") == 0) {
-                            FILE* f = fopen("output.jpg", "wb");
-                            if (f != NULL) {
-                                fwrite(picture->data, 1, picture->size, f);
-                                fclose(f);
-                                printf("Saved picture as output.jpg\n");
+                    /*
+                    ... other tags
+                    */
+                    case MP3_FRAME_APIC: {
+                        MP3_Picture picture;
+                        if (MP3Reader_readFramePicture(reader, tagHeader, frameHeader, &picture) == 0) {
+                            printf("Picture: MIME type: %s, size: %u bytes\n", picture.mime_type, picture.size);
+
+                            const char* filename = NULL;
+                            if (strcmp((char*)picture.mime_type, "image/jpeg") == 0 || strcmp((char*)picture.mime_type, "image/jpg") == 0) {
+                                filename = "output.jpg";
+                            }
+                            else if (strcmp((char*)picture.mime_type, "image/png") == 0) {
+                                filename = "output.png";
                             }
-                        }
-                        else if (strcmp((char*)picture->mime_type, "image/png") == 0) {
-                            FILE* f = fopen("output.png", "wb");
-                            printf("Saved picture as output.png\n");
-                        }
 
-                        MP3_Picture_free(picture);
+                            if (filename != NULL && MP3Reader_savePicture(reader, &picture, filename) == 0) {
+                                printf("Saved picture as %s\n", filename);
+                            }
+                        }
+                        break;
                     }
-                }                
+                }
             }
             vector_destroy(frames);
         }
@@ -0,0 +1,4 @@
+// Implementation unit of libmp3reader (make lib), programs linking the library include
+// mp3_reader.h without defining MP3_READER_IMPLEMENTATION
+#define MP3_READER_IMPLEMENTATION
+#include "mp3_reader.h"
@@ -5,6 +5,56 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Header version, MP3Reader_version() returns the one the library was built from
+#define MP3_READER_VERSION_MAJOR 1
+#define MP3_READER_VERSION_MINOR 0
+#define MP3_READER_VERSION_PATCH 0
+#define MP3_READER_VERSION ((MP3_READER_VERSION_MAJOR << 16) | (MP3_READER_VERSION_MINOR << 8) | MP3_READER_VERSION_PATCH)
+#define MP3_READER_VERSION_STRING "1.0.0"
+
+// Public functions, the only symbols libmp3reader exports (built with -fvisibility=hidden)
+#ifndef MP3_API
+#if defined(__GNUC__)
+#define MP3_API __attribute__((visibility("default")))
+#else
+#define MP3_API
+#endif
+#endif
+
+// MP3_READER_VERSION of the implementation, differs from the header's if an older or
+// newer library is loaded at run time
+MP3_API uint32_t MP3Reader_version(void);
+
+
+
+
+/*
+    ARENA
+*/
+typedef struct MP3ArenaBlock {
+    struct MP3ArenaBlock* next;
+    size_t size;           // Usable bytes after the block header
+    size_t used;
+} MP3ArenaBlock;
+
+// Bump allocator, everything is released at once by MP3Arena_reset. Not thread-safe,
+// use one per worker.
+typedef struct MP3Arena {
+    MP3ArenaBlock* first;
+    MP3ArenaBlock* current;
+    size_t block_size;
+} MP3Arena;
+
+MP3_API MP3Arena* MP3Arena_create(size_t block_size);
+MP3_API void      MP3Arena_destroy(MP3Arena* arena);
+MP3_API void*     MP3Arena_alloc(MP3Arena* arena, size_t size);
+MP3_API void      MP3Arena_reset(MP3Arena* arena);
+
+
 
 
 
@@ -15,14 +65,62 @@ typedef struct vector {
     void** data;
     int size;
     int capacity;
+    MP3Arena* arena;       // Owning arena, NULL for heap
 } vector;
 
-vector* vector_create();
-void    vector_destroy(vector* v);
-int     vector_size(vector* v);
-int     vector_push_back(vector* v, void *item);
-void*   vector_pop_back(vector *v);
-void*   vector_index(vector* v, int index);
+MP3_API vector* vector_create();
+MP3_API vector* vector_create_arena(MP3Arena* arena);
+MP3_API void    vector_destroy(vector* v);
+MP3_API int     vector_size(vector* v);
+MP3_API int     vector_push_back(vector* v, void *item);
+MP3_API void*   vector_pop_back(vector *v);
+MP3_API void*   vector_index(vector* v, int index);
+
+
+
+
+
+#ifdef MP3_READER_STATS
+/*
+    STATS
+    Per-thread counters and stage timers, compiled in with -DMP3_READER_STATS only.
+    Stage times are inclusive, a record's time also counts in the stages it calls.
+*/
+enum {
+    MP3_STAGE_LOAD = 0, // MP3Reader_load*, io_uring reads only count bytes and syscalls
+    MP3_STAGE_TAGS,     // ID3v2 tag search
+    MP3_STAGE_FRAMES,   // Frame lists and the frame directory
+    MP3_STAGE_TEXT,     // UTF-8 conversion
+    MP3_STAGE_PICTURE,  // Picture writes and hashing
+    MP3_STAGE_AUDIO,    // Frame index and duration
+    MP3_STAGE_RECORD,   // MP3Reader_getRecord
+    MP3_STAGE_OUTPUT,   // Scanner on_record callback
+    MP3_STAGE_COUNT
+};
+
+typedef struct MP3Stats {
+    uint64_t files;                   // Successful loads
+    uint64_t bytes_read;
+    uint64_t syscalls;                // File and io_uring calls made by the library
+    uint64_t bytes_scanned;           // Searched for ID3v2 headers
+    uint64_t tags;                    // ID3v2 headers returned by tag iterators
+    uint64_t frames;                  // ID3v2 frames walked
+    uint64_t audio_frames;            // Indexed MPEG frames
+    uint64_t text_bytes;              // Converted to UTF-8
+    uint64_t allocations;             // malloc/realloc calls
+    uint64_t calls[MP3_STAGE_COUNT];
+    uint64_t ns[MP3_STAGE_COUNT];
+    uint64_t cycles[MP3_STAGE_COUNT]; // TSC ticks, 0 where there is no TSC
+} MP3Stats;
+
+// Counters of the calling thread, created on first use
+MP3_API MP3Stats* MP3Stats_get(void);
+// Sum of all threads, exact once the counting threads are done
+MP3_API void MP3Stats_collect(MP3Stats* total);
+MP3_API void MP3Stats_reset(void);
+MP3_API void MP3Stats_print(const MP3Stats* stats, FILE* out);
+MP3_API const char* MP3Stats_stageName(int stage);
+#endif // MP3_READER_STATS
 
 
 
@@ -71,16 +169,190 @@ typedef struct ID3v2TagHeader {
 } ID3v2TagHeader;
 
 
+// ID3v2.3/2.4 frame header. ID3v2.2 frames start with a 6-byte header instead,
+// 3-byte ID and 3-byte size, use ID3v2Tag_getFrameHeaderSize/getFrameSize/getFrameId.
 typedef struct ID3v2TagFrameHeader {
     char    header[4];     // Frame type
     uint8_t size[4];       // Size bytes (8 bits)
     uint8_t flags[2];      // Flags
 } ID3v2TagFrameHeader;
 
+// 4-byte frame ID as a big-endian integer, usable in case labels
+#define MP3_FRAME_ID(a, b, c, d) (((uint32_t)(uint8_t)(a) << 24) | ((uint32_t)(uint8_t)(b) << 16) | ((uint32_t)(uint8_t)(c) << 8) | (uint32_t)(uint8_t)(d))
+
+// Frame IDs of ID3v2.3 and ID3v2.4, X(name, id0, id1, id2, id3)
+#define MP3_FRAME_LIST(X) \
+    X(AENC, 'A', 'E', 'N', 'C') \
+    X(APIC, 'A', 'P', 'I', 'C') \
+    X(ASPI, 'A', 'S', 'P', 'I') \
+    X(COMM, 'C', 'O', 'M', 'M') \
+    X(COMR, 'C', 'O', 'M', 'R') \
+    X(ENCR, 'E', 'N', 'C', 'R') \
+    X(EQU2, 'E', 'Q', 'U', '2') \
+    X(EQUA, 'E', 'Q', 'U', 'A') \
+    X(ETCO, 'E', 'T', 'C', 'O') \
+    X(GEOB, 'G', 'E', 'O', 'B') \
+    X(GRID, 'G', 'R', 'I', 'D') \
+    X(IPLS, 'I', 'P', 'L', 'S') \
+    X(LINK, 'L', 'I', 'N', 'K') \
+    X(MCDI, 'M', 'C', 'D', 'I') \
+    X(MLLT, 'M', 'L', 'L', 'T') \
+    X(OWNE, 'O', 'W', 'N', 'E') \
+    X(PCNT, 'P', 'C', 'N', 'T') \
+    X(POPM, 'P', 'O', 'P', 'M') \
+    X(POSS, 'P', 'O', 'S', 'S') \
+    X(PRIV, 'P', 'R', 'I', 'V') \
+    X(RBUF, 'R', 'B', 'U', 'F') \
+    X(RVA2, 'R', 'V', 'A', '2') \
+    X(RVAD, 'R', 'V', 'A', 'D') \
+    X(RVRB, 'R', 'V', 'R', 'B') \
+    X(SEEK, 'S', 'E', 'E', 'K') \
+    X(SIGN, 'S', 'I', 'G', 'N') \
+    X(SYLT, 'S', 'Y', 'L', 'T') \
+    X(SYTC, 'S', 'Y', 'T', 'C') \
+    X(TALB, 'T', 'A', 'L', 'B') \
+    X(TBPM, 'T', 'B', 'P', 'M') \
+    X(TCOM, 'T', 'C', 'O', 'M') \
+    X(TCON, 'T', 'C', 'O', 'N') \
+    X(TCOP, 'T', 'C', 'O', 'P') \
+    X(TDAT, 'T', 'D', 'A', 'T') \
+    X(TDEN, 'T', 'D', 'E', 'N') \
+    X(TDLY, 'T', 'D', 'L', 'Y') \
+    X(TDOR, 'T', 'D', 'O', 'R') \
+    X(TDRC, 'T', 'D', 'R', 'C') \
+    X(TDRL, 'T', 'D', 'R', 'L') \
+    X(TDTG, 'T', 'D', 'T', 'G') \
+    X(TENC, 'T', 'E', 'N', 'C') \
+    X(TEXT, 'T', 'E', 'X', 'T') \
+    X(TFLT, 'T', 'F', 'L', 'T') \
+    X(TIME, 'T', 'I', 'M', 'E') \
+    X(TIPL, 'T', 'I', 'P', 'L') \
+    X(TIT1, 'T', 'I', 'T', '1') \
+    X(TIT2, 'T', 'I', 'T', '2') \
+    X(TIT3, 'T', 'I', 'T', '3') \
+    X(TKEY, 'T', 'K', 'E', 'Y') \
+    X(TLAN, 'T', 'L', 'A', 'N') \
+    X(TLEN, 'T', 'L', 'E', 'N') \
+    X(TMCL, 'T', 'M', 'C', 'L') \
+    X(TMED, 'T', 'M', 'E', 'D') \
+    X(TMOO, 'T', 'M', 'O', 'O') \
+    X(TOAL, 'T', 'O', 'A', 'L') \
+    X(TOFN, 'T', 'O', 'F', 'N') \
+    X(TOLY, 'T', 'O', 'L', 'Y') \
+    X(TOPE, 'T', 'O', 'P', 'E') \
+    X(TORY, 'T', 'O', 'R', 'Y') \
+    X(TOWN, 'T', 'O', 'W', 'N') \
+    X(TPE1, 'T', 'P', 'E', '1') \
+    X(TPE2, 'T', 'P', 'E', '2') \
+    X(TPE3, 'T', 'P', 'E', '3') \
+    X(TPE4, 'T', 'P', 'E', '4') \
+    X(TPOS, 'T', 'P', 'O', 'S') \
+    X(TPRO, 'T', 'P', 'R', 'O') \
+    X(TPUB, 'T', 'P', 'U', 'B') \
+    X(TRCK, 'T', 'R', 'C', 'K') \
+    X(TRDA, 'T', 'R', 'D', 'A') \
+    X(TRSN, 'T', 'R', 'S', 'N') \
+    X(TRSO, 'T', 'R', 'S', 'O') \
+    X(TSIZ, 'T', 'S', 'I', 'Z') \
+    X(TSOA, 'T', 'S', 'O', 'A') \
+    X(TSOP, 'T', 'S', 'O', 'P') \
+    X(TSOT, 'T', 'S', 'O', 'T') \
+    X(TSRC, 'T', 'S', 'R', 'C') \
+    X(TSSE, 'T', 'S', 'S', 'E') \
+    X(TSST, 'T', 'S', 'S', 'T') \
+    X(TXXX, 'T', 'X', 'X', 'X') \
+    X(TYER, 'T', 'Y', 'E', 'R') \
+    X(UFID, 'U', 'F', 'I', 'D') \
+    X(USER, 'U', 'S', 'E', 'R') \
+    X(USLT, 'U', 'S', 'L', 'T') \
+    X(WCOM, 'W', 'C', 'O', 'M') \
+    X(WCOP, 'W', 'C', 'O', 'P') \
+    X(WOAF, 'W', 'O', 'A', 'F') \
+    X(WOAR, 'W', 'O', 'A', 'R') \
+    X(WOAS, 'W', 'O', 'A', 'S') \
+    X(WORS, 'W', 'O', 'R', 'S') \
+    X(WPAY, 'W', 'P', 'A', 'Y') \
+    X(WPUB, 'W', 'P', 'U', 'B') \
+    X(WXXX, 'W', 'X', 'X', 'X')
+
+// ID3v2.2 frame IDs with their ID3v2.3 equivalent, X(name, id0, id1, id2)
+#define MP3_FRAME_LIST_V22(X) \
+    X(RBUF, 'B', 'U', 'F') \
+    X(PCNT, 'C', 'N', 'T') \
+    X(COMM, 'C', 'O', 'M') \
+    X(AENC, 'C', 'R', 'A') \
+    X(ETCO, 'E', 'T', 'C') \
+    X(EQUA, 'E', 'Q', 'U') \
+    X(GEOB, 'G', 'E', 'O') \
+    X(IPLS, 'I', 'P', 'L') \
+    X(LINK, 'L', 'N', 'K') \
+    X(MCDI, 'M', 'C', 'I') \
+    X(MLLT, 'M', 'L', 'L') \
+    X(APIC, 'P', 'I', 'C') \
+    X(POPM, 'P', 'O', 'P') \
+    X(RVRB, 'R', 'E', 'V') \
+    X(RVAD, 'R', 'V', 'A') \
+    X(SYLT, 'S', 'L', 'T') \
+    X(SYTC, 'S', 'T', 'C') \
+    X(TALB, 'T', 'A', 'L') \
+    X(TBPM, 'T', 'B', 'P') \
+    X(TCOM, 'T', 'C', 'M') \
+    X(TCON, 'T', 'C', 'O') \
+    X(TCOP, 'T', 'C', 'R') \
+    X(TDAT, 'T', 'D', 'A') \
+    X(TDLY, 'T', 'D', 'Y') \
+    X(TENC, 'T', 'E', 'N') \
+    X(TFLT, 'T', 'F', 'T') \
+    X(TIME, 'T', 'I', 'M') \
+    X(TKEY, 'T', 'K', 'E') \
+    X(TLAN, 'T', 'L', 'A') \
+    X(TLEN, 'T', 'L', 'E') \
+    X(TMED, 'T', 'M', 'T') \
+    X(TOPE, 'T', 'O', 'A') \
+    X(TOFN, 'T', 'O', 'F') \
+    X(TOLY, 'T', 'O', 'L') \
+    X(TORY, 'T', 'O', 'R') \
+    X(TOAL, 'T', 'O', 'T') \
+    X(TPE1, 'T', 'P', '1') \
+    X(TPE2, 'T', 'P', '2') \
+    X(TPE3, 'T', 'P', '3') \
+    X(TPE4, 'T', 'P', '4') \
+    X(TPOS, 'T', 'P', 'A') \
+    X(TPUB, 'T', 'P', 'B') \
+    X(TSRC, 'T', 'R', 'C') \
+    X(TRDA, 'T', 'R', 'D') \
+    X(TRCK, 'T', 'R', 'K') \
+    X(TSIZ, 'T', 'S', 'I') \
+    X(TSSE, 'T', 'S', 'S') \
+    X(TIT1, 'T', 'T', '1') \
+    X(TIT2, 'T', 'T', '2') \
+    X(TIT3, 'T', 'T', '3') \
+    X(TEXT, 'T', 'X', 'T') \
+    X(TXXX, 'T', 'X', 'X') \
+    X(TYER, 'T', 'Y', 'E') \
+    X(UFID, 'U', 'F', 'I') \
+    X(USLT, 'U', 'L', 'T') \
+    X(WOAF, 'W', 'A', 'F') \
+    X(WOAR, 'W', 'A', 'R') \
+    X(WOAS, 'W', 'A', 'S') \
+    X(WCOM, 'W', 'C', 'M') \
+    X(WCOP, 'W', 'C', 'P') \
+    X(WPUB, 'W', 'P', 'B') \
+    X(WXXX, 'W', 'X', 'X')
+
+// Dense frame IDs, MP3_FRAME_TALB etc., usable as table indexes
+enum {
+    MP3_FRAME_UNKNOWN = 0,
+#define MP3_FRAME_ENUM(name, a, b, c, d) MP3_FRAME_##name,
+    MP3_FRAME_LIST(MP3_FRAME_ENUM)
+#undef MP3_FRAME_ENUM
+    MP3_FRAME_COUNT
+};
+
 
 
 // Bitrates for MPEG-1
-const int bitratesMPEG1[][16] = {
+static const int bitratesMPEG1[][16] = {
     {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 0}, // Layer I
     {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 0},    // Layer II
     {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0}      // Layer III
@@ -88,15 +360,15 @@ const int bitratesMPEG1[][16] = {
 
 
 // Bitrates for MPEG-2/2.5
-const int bitratesMPEG2[][16] = {
-    {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 176, 192, 224, 256, 0},    // Layer I
-    {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},    // Layer II
-    {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},    // Layer II
+static const int bitratesMPEG2[][16] = {
+    {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256, 0}, // Layer I
+    {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},      // Layer II
+    {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},      // Layer III
 };
 
 
 // Frequencies
-const int frequencies[][4] = {
+static const int frequencies[][4] = {
     {44100, 48000, 32000, 0},  // MPEG-1
     {22050, 24000, 16000, 0},  // MPEG-2
     {0,     0,     0,     0},  // Reserved
@@ -105,7 +377,7 @@ const int frequencies[][4] = {
 
 
 // Versions
-const char versions[][16] = {
+static const char versions[][16] = {
     "MPEG 2.5\0",
     "Reserved\0",
     "MPEG 2  \0",
@@ -114,7 +386,7 @@ const char versions[][16] = {
 
 
 // Channel modes
-const char channelMode[][16] = {
+static const char channelMode[][16] = {
     "Stereo\0",
     "Joint stereo\0",
     "Dual Mono\0",
@@ -122,7 +394,7 @@ const char channelMode[][16] = {
 };
 
 // Emphasis
-const char emphasis[][16] = {
+static const char emphasis[][16] = {
     "none\0",
     "50/15 ms\0",
     "Reserved\0",
@@ -130,7 +402,7 @@ const char emphasis[][16] = {
 };
 
 
-const char textEncoding[][16] = {
+static const char textEncoding[][16] = {
     "ISO-8859-1",
     "UTF-16",
     "UTF-16",
@@ -145,9 +417,75 @@ const char textEncoding[][16] = {
     MP3 Reader
 */
 
+// ID3v2 tag search modes
+enum {
+    MP3_TAGSCAN_SPEC = 0, // Tags at offset 0 (chained) and an appended tag with footer
+    MP3_TAGSCAN_FULL      // Every valid tag header anywhere in the data
+};
+
+// Audio bytes after the ID3v2 tag read by MP3Reader_loadTags
+#ifndef MP3_READER_PROBE_SIZE
+#define MP3_READER_PROBE_SIZE 4096
+#endif
+
+// Storage backing MP3Reader data
+enum {
+    MP3_STORAGE_NONE = 0, // No data loaded
+    MP3_STORAGE_HEAP,     // malloc'ed copy of the file
+    MP3_STORAGE_MMAP,     // Read-only file mapping
+    MP3_STORAGE_USER      // Memory owned by the caller
+};
+
+// Sparse time -> byte offset table, struct-of-arrays so lookups only touch samples
+typedef struct MP3SeekTable {
+    uint32_t count;
+    uint32_t sample_rate;
+    uint64_t* samples;     // Sample position of each entry, ascending
+    uint32_t* offsets;     // File offset of each entry
+} MP3SeekTable;
+
+// Frames indexed per tag by the frame directory, later frames are found by walking
+#ifndef MP3_FRAMEDIR_SIZE
+#define MP3_FRAMEDIR_SIZE 64
+#endif
+
+// Lazily built per-tag frame directory. Instances of one frame ID are chained
+// through next[], slot numbers are stored +1 so 0 means none.
+typedef struct ID3v2FrameDir {
+    const uint8_t* tag;                  // Tag header the directory was built for, NULL if none
+    const uint8_t* base;                 // Frames area, reader data or a decoded copy
+    uint16_t count;                      // Frames indexed
+    uint32_t resume;                     // Offset of the first frame not indexed, 0 if all are
+    uint16_t first[MP3_FRAME_COUNT];     // First slot of each MP3_FRAME_*
+    uint16_t next[MP3_FRAMEDIR_SIZE];    // Next slot with the same frame ID
+    uint32_t offsets[MP3_FRAMEDIR_SIZE]; // Frame offset from base
+} ID3v2FrameDir;
+
+// Copy of a tag's frames area or of one frame decoded into the scratch arena
+typedef struct MP3Decoded {
+    const uint8_t* source; // Tag or frame header it was decoded from
+    uint8_t* data;         // NULL if decoding failed
+    uint32_t size;
+    struct MP3Decoded* next;
+} MP3Decoded;
+
 typedef struct MP3Reader {
     uint8_t* data;
     uint32_t size;
+    uint8_t* buffer;       // Reusable heap buffer, kept across loads
+    uint32_t capacity;     // Allocated size of buffer
+    uint32_t file_size;    // Size of the file on disk
+    uint32_t head_size;    // Bytes of data matching the file from offset 0
+    int storage;           // MP3_STORAGE_*
+    int fd;                // Source file kept open after a load, -1 if none
+    MP3Arena* arena;       // Optional arena for vectors, text and picture structs
+    MP3SeekTable seek;     // Built on first MP3Reader_seekToTime
+    ID3v2FrameDir frames;  // Built on first MP3Reader_findFrame of a tag
+    MP3Arena* scratch;     // Decoded tags and frames, reset on each load
+    const uint8_t* unsync_tag; // Tag decoded into unsync_data (v2.3 whole-tag unsynchronisation)
+    uint8_t* unsync_data;  // Frames area of unsync_tag without unsynchronisation
+    uint32_t unsync_size;
+    MP3Decoded* decoded;   // Everything decoded into scratch since the load, each source once
 } MP3Reader;
 
 typedef struct MP3_TextData {
@@ -164,27 +502,410 @@ typedef struct MP3_Picture {
 } MP3_Picture;
 
 
-MP3Reader* MP3Reader_create(const char *filename);
-void MP3Reader_destroy(MP3Reader* reader);
+// Stack-allocated ID3v2 tag iterator
+typedef struct ID3v2TagIter {
+    MP3Reader* reader;
+    int mode;              // MP3_TAGSCAN_*
+    int done;              // Nothing left to return
+    uint32_t pos;          // Next offset to look at
+} ID3v2TagIter;
+
+// Stack-allocated ID3v2 frame iterator
+typedef struct ID3v2FrameIter {
+    ID3v2TagHeader* tag;
+    uint8_t* data;         // Frames area
+    uint32_t pos;          // Next frame offset in data
+    uint32_t end;          // End of frames area
+} ID3v2FrameIter;
+
+
+MP3_API MP3Reader* MP3Reader_create(const char *filename);
+MP3_API MP3Reader* MP3Reader_createWithArena(const char *filename, MP3Arena* arena);
+MP3_API void MP3Reader_destroy(MP3Reader* reader);
+MP3_API int MP3Reader_reserve(MP3Reader* reader, uint32_t capacity);
+
+MP3_API int MP3Reader_load(MP3Reader* reader, const char *filename);
+MP3_API int MP3Reader_loadMmap(MP3Reader* reader, const char *filename);
+MP3_API int MP3Reader_loadTags(MP3Reader* reader, const char *filename);
+MP3_API ID3v1Tag* MP3Reader_getID3v1Tag(MP3Reader* reader);
+
+MP3_API uint32_t size7bitsToNormal(const uint8_t size[4]);
+MP3_API uint32_t size8bitsToNormal(const uint8_t size[4]);
+MP3_API uint32_t ID3v2Tag_getTagSize(ID3v2TagHeader* tagHeader);
+MP3_API uint32_t ID3v2Tag_getFrameSize(ID3v2TagHeader* tagHeader, ID3v2TagFrameHeader* frameHeader);
+MP3_API int ID3v2Tag_isValid(const ID3v2TagHeader* tagHeader, const char magic[3]);
+MP3_API uint32_t ID3v2Tag_getFrameHeaderSize(ID3v2TagHeader* tagHeader);
+MP3_API int MP3_getFrameId(const char id[4]);
+MP3_API int MP3_getFrameIdV22(const char id[3]);
+MP3_API const char* MP3_getFrameName(int id);
+MP3_API int ID3v2Tag_getFrameId(ID3v2TagHeader* tagHeader, ID3v2TagFrameHeader* frameHeader);
+
+MP3_API vector* MP3Reader_getID3v2Tags(MP3Reader* reader);
+MP3_API vector* MP3Reader_findID3v2Tags(MP3Reader* reader, int mode);
+MP3_API vector* MP3Reader_getID3v2TagFrames(MP3Reader* reader, ID3v2TagHeader* tagHeader);
+// Frame lookup through the reader's frame directory, the first call for a tag walks its frames once
+MP3_API ID3v2TagFrameHeader* MP3Reader_findFrame(MP3Reader* reader, ID3v2TagHeader* tagHeader, int id);
+MP3_API ID3v2TagFrameHeader* MP3Reader_findNextFrame(MP3Reader* reader, ID3v2TagHeader* tagHeader, ID3v2TagFrameHeader* frameHeader);
+MP3_API int MP3Reader_countFrames(MP3Reader* reader, ID3v2TagHeader* tagHeader, int id);
+
+MP3_API void ID3v2TagIter_init(ID3v2TagIter* it, MP3Reader* reader, int mode);
+MP3_API ID3v2TagHeader* ID3v2TagIter_next(ID3v2TagIter* it);
+MP3_API void ID3v2FrameIter_init(ID3v2FrameIter* it, MP3Reader* reader, ID3v2TagHeader* tagHeader);
+MP3_API ID3v2TagFrameHeader* ID3v2FrameIter_next(ID3v2FrameIter* it);
+
+
+MP3_API MP3_TextData* MP3Reader_getFrameTextData(ID3v2TagHeader* tagHeader, ID3v2TagFrameHeader* frameHeader);
+MP3_API void MP3_TextData_free(MP3_TextData* data);
+
+MP3_API MP3_Picture* MP3Reader_getFramePictureData(ID3v2TagHeader* tagHeader, ID3v2TagFrameHeader* frameHeader);
+MP3_API void MP3_Picture_free(MP3_Picture* picture);
+
+// Same as above, allocated from the reader's arena when it has one (don't free those)
+MP3_API MP3_TextData* MP3Reader_allocFrameTextData(MP3Reader* reader, ID3v2TagHeader* tagHeader, ID3v2TagFrameHeader* frameHeader);
+MP3_API MP3_Picture* MP3Reader_allocFramePictureData(MP3Reader* reader, ID3v2TagHeader* tagHeader, ID3v2TagFrameHeader* frameHeader);
+
+// Frame content without the extra header bytes selected by frame flags. Unsynchronised and
+// compressed frames are decoded once into the reader's scratch arena, valid until the next load;
+// everything else points into the tag. Compression needs MP3_READER_USE_ZLIB.
+MP3_API int MP3Reader_getFrameData(MP3Reader* reader, ID3v2TagHeader* tagHeader, ID3v2TagFrameHeader* frameHeader, uint8_t** data, uint32_t* size);
+
+// Allocation-free variants filling a caller-provided struct, return 0 on success
+MP3_API int MP3Reader_readFrameText(MP3Reader* reader, ID3v2TagHeader* tagHeader, ID3v2TagFrameHeader* frameHeader, MP3_TextData* out);
+MP3_API int MP3Reader_readFramePicture(MP3Reader* reader, ID3v2TagHeader* tagHeader, ID3v2TagFrameHeader* frameHeader, MP3_Picture* out);
+
+// Write picture bytes to fd / a new file. Copied in the kernel from the source file
+// when the picture lies in the loaded file data, written from memory otherwise.
+MP3_API int MP3Reader_writePicture(MP3Reader* reader, const MP3_Picture* picture, int fd);
+MP3_API int MP3Reader_savePicture(MP3Reader* reader, const MP3_Picture* picture, const char* filename);
+
+// UTF-8 conversion into a caller buffer, always NUL-terminated. Text ends at the first
+// terminator, output is truncated on a character boundary. Return bytes written or -1.
+MP3_API int MP3_latin1ToUTF8(const uint8_t* in, uint32_t len, char* out, uint32_t cap);
+MP3_API int MP3_utf16ToUTF8(const uint8_t* in, uint32_t len, int big_endian, char* out, uint32_t cap);
+MP3_API int MP3_TextData_toUTF8(const MP3_TextData* text, char* out, uint32_t cap);
+MP3_API int MP3Reader_readFrameTextUTF8(MP3Reader* reader, ID3v2TagHeader* tagHeader, ID3v2TagFrameHeader* frameHeader, char* out, uint32_t cap);
+
+
+
+
+/*
+    Tag writer
+*/
+
+// Text frame change, the last edit of an ID wins
+typedef struct MP3TextEdit {
+    int id;                // MP3_FRAME_* text frame, TXXX excluded
+    const char* text;      // UTF-8, NULL removes the frame
+} MP3TextEdit;
+
+// Apply edits to the ID3v2 tag at the start of filename, other frames are copied as they
+// are. The tag is overwritten in place with one pwrite when the frames fit into it (its
+// padding shrinks), otherwise the file is rewritten through <filename>.tmp with padding
+// bytes of fresh padding and the audio copied in the kernel. Text is UTF-8 in v2.4 tags,
+// ISO-8859-1 or UTF-16 in v2.3; files without a tag get a v2.4 one, v2.2 tags are refused.
+// Loads tags into reader, returns 0 in place, 1 rewritten or -1.
+MP3_API int MP3Reader_updateTag(MP3Reader* reader, const char* filename, const MP3TextEdit* edits, int count, uint32_t padding);
+
+
+
+
+/*
+    MPEG audio frames
+*/
+
+// Entry of the frame index, offsets are file offsets
+typedef struct MP3FrameIndexEntry {
+    uint32_t offset;
+    uint16_t size;
+    uint16_t samples;
+} MP3FrameIndexEntry;
+
+typedef struct MP3FrameIndex {
+    MP3FrameIndexEntry* entries;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t sample_rate;   // Sample rate of the first frame
+    uint64_t total_samples;
+} MP3FrameIndex;
+
+MP3_API int MP3FrameHeader_parse(const uint8_t* data, MP3FrameHeader* header);
+MP3_API uint32_t MP3FrameHeader_getBitrate(const MP3FrameHeader* header);
+MP3_API uint32_t MP3FrameHeader_getFrequency(const MP3FrameHeader* header);
+MP3_API uint32_t MP3FrameHeader_getFrameSize(const MP3FrameHeader* header);
+MP3_API uint32_t MP3FrameHeader_getSamples(const MP3FrameHeader* header);
+
+// Xing/Info (LAME) or VBRI header found in the first audio frame
+typedef struct MP3VBRHeader {
+    char type[4];            // "Xing", "Info" or "VBRI"
+    uint32_t offset;         // File offset of the frame carrying the header
+    uint32_t frame_size;     // Size of that frame
+    uint32_t frames;         // Audio frames, without the header frame (0 if unknown)
+    uint32_t bytes;          // Audio bytes (0 if unknown)
+    uint32_t sample_rate;
+    uint32_t samples_per_frame;
+    int has_toc;             // toc is valid (Xing only)
+    uint8_t toc[100];        // Xing seek table, byte position / 256 for each percent of duration
+} MP3VBRHeader;
+
+MP3_API int MP3Reader_getAudioRange(MP3Reader* reader, uint32_t* start, uint32_t* end);
+MP3_API int MP3Reader_findAudioFrame(MP3Reader* reader, uint32_t pos, uint32_t end, uint32_t* offset, MP3FrameHeader* header);
+MP3_API int MP3Reader_buildFrameIndex(MP3Reader* reader, MP3FrameIndex* index);
+// Same index built by threads (0 - number of CPUs) over chunks of the audio, serial for
+// audio below MP3_INDEX_CHUNK_MIN per thread
+MP3_API int MP3Reader_buildFrameIndexParallel(MP3Reader* reader, MP3FrameIndex* index, int threads);
+MP3_API uint32_t MP3FrameIndex_getDuration(const MP3FrameIndex* index);
+MP3_API void MP3FrameIndex_free(MP3FrameIndex* index);
+
+MP3_API int MP3Reader_getVBRHeader(MP3Reader* reader, MP3VBRHeader* vbr);
+MP3_API int MP3Reader_getDuration(MP3Reader* reader, uint32_t* duration_ms);
+
+// Incremental xxHash64 state, MP3Hash64_final gives MP3_hash64 of everything passed to update
+typedef struct MP3Hash64 {
+    uint64_t v[4];
+    uint64_t seed;
+    uint64_t total;
+    uint8_t tail[32];      // Bytes short of a full stripe
+    uint32_t tail_size;
+} MP3Hash64;
+
+// Audio fingerprint flags
+enum {
+    MP3_AUDIOHASH_SKIP_VBR = 1 // Leave out the Xing/Info/VBRI frame, encoders and taggers rewrite it
+};
+
+// Bytes read per pread when the audio isn't in memory
+#ifndef MP3_AUDIOHASH_BUFFER
+#define MP3_AUDIOHASH_BUFFER (256 * 1024)
+#endif
+
+typedef struct MP3AudioHash {
+    uint64_t hash;         // xxHash64 of the audio bytes
+    uint32_t offset;       // File offset of the hashed range
+    uint32_t size;
+} MP3AudioHash;
+
+// Hash of the audio payload only, so retagged copies match. Works on any load: audio in
+// memory is hashed in place, after MP3Reader_loadTags it is streamed from the file.
+MP3_API int MP3Reader_hashAudio(MP3Reader* reader, int flags, MP3AudioHash* hash);
+
+// Frames per seek table entry built from a frame index
+#ifndef MP3_SEEK_INTERVAL
+#define MP3_SEEK_INTERVAL 32
+#endif
+
+MP3_API int MP3SeekTable_fromIndex(MP3SeekTable* table, const MP3FrameIndex* index, uint32_t interval);
+MP3_API int MP3SeekTable_fromVBR(MP3SeekTable* table, const MP3VBRHeader* vbr);
+MP3_API int MP3SeekTable_lookup(const MP3SeekTable* table, uint64_t sample);
+MP3_API void MP3SeekTable_free(MP3SeekTable* table);
+MP3_API int MP3Reader_seekToTime(MP3Reader* reader, uint32_t ms, uint32_t* offset);
+
+
+
+
+/*
+    Stream parser
+*/
+
+// Fixed buffering window, must hold the largest audio frame plus a header
+#ifndef MP3_STREAM_WINDOW
+#define MP3_STREAM_WINDOW 4096
+#endif
+
+// Stream parser events
+enum {
+    MP3_STREAM_TAG = 1,     // ID3v2 tag header
+    MP3_STREAM_FRAME,       // ID3v2 frame, with payload if it was requested
+    MP3_STREAM_AUDIO_FRAME, // MPEG audio frame boundary
+    MP3_STREAM_ID3V1        // ID3v1 trailer, reported by MP3StreamParser_finish
+};
+
+typedef struct MP3StreamEvent {
+    int type;                          // MP3_STREAM_*
+    uint64_t offset;                   // Stream offset of the item
+    const ID3v2TagHeader* tag;         // Current tag (TAG, FRAME)
+    const ID3v2TagFrameHeader* frame;  // FRAME
+    const uint8_t* data;               // FRAME payload if materialized, else NULL
+    uint32_t size;                     // FRAME payload size or AUDIO_FRAME size
+    uint32_t samples;                  // AUDIO_FRAME samples
+    const ID3v1Tag* id3v1;             // ID3V1
+} MP3StreamEvent;
+
+// Return nonzero to stop parsing
+typedef int (*MP3StreamEventFn)(void* user, const MP3StreamEvent* event);
+// Return nonzero to receive the payload of this frame (e.g. APIC)
+typedef int (*MP3StreamWantFn)(void* user, const ID3v2TagHeader* tag, const ID3v2TagFrameHeader* frame);
+
+typedef struct MP3StreamParser {
+    int state;
+    uint8_t window[MP3_STREAM_WINDOW];
+    uint32_t window_len;
+    uint64_t pos;                   // Stream offset of window[0]
+    uint64_t total;                 // Bytes fed so far
+    uint64_t skip;                  // Bytes to drop before parsing resumes
+    uint64_t tag_end;               // Stream offset where the current tag ends
+    ID3v2TagHeader tag;
+    ID3v2TagFrameHeader frame;
+    uint64_t frame_offset;
+    uint8_t* frame_data;            // Materialized frame payload
+    uint32_t frame_len;
+    uint32_t frame_need;
+    uint32_t frame_capacity;
+    uint8_t tail[sizeof(ID3v1Tag)]; // Last bytes of the stream
+    MP3StreamEventFn on_event;
+    MP3StreamWantFn want_frame;
+    void* user;
+} MP3StreamParser;
+
+MP3_API void MP3StreamParser_init(MP3StreamParser* parser, MP3StreamEventFn on_event, MP3StreamWantFn want_frame, void* user);
+MP3_API int  MP3StreamParser_feed(MP3StreamParser* parser, const uint8_t* data, size_t len);
+MP3_API int  MP3StreamParser_finish(MP3StreamParser* parser);
+MP3_API void MP3StreamParser_free(MP3StreamParser* parser);
+
+
+
+
+/*
+    Records and batch scanner
+*/
+
+// Metadata of one file. Pointers reference the reader buffer and are only valid
+// until the reader loads the next file.
+typedef struct MP3Record {
+    const char* path;
+    uint32_t file_size;
+    uint32_t duration_ms;        // 0 if unknown
+    const ID3v1Tag* id3v1;       // NULL if none
+    const ID3v2TagHeader* id3v2; // First ID3v2 tag, NULL if none
+    MP3_TextData title;          // Fields are zeroed when missing
+    MP3_TextData artist;
+    MP3_TextData album;
+    MP3_TextData year;
+    MP3_TextData track;
+    int has_picture;
+    MP3_Picture picture;         // First APIC frame
+    uint32_t picture_offset;     // File offset of the picture data
+    uint64_t picture_hash;       // MP3_hash64 of the picture data, set with a picture cache
+    uint32_t picture_id;         // Shared ID of identical pictures, 0 if none
+    int picture_is_new;          // First record with this picture, emit the bytes only then
+    int cached;                  // Filled from an MP3Cache: id3v2 is NULL, picture.data is NULL
+} MP3Record;
+
+// Called concurrently from worker threads, return nonzero to stop the scan
+typedef int (*MP3ScanFn)(void* user, int worker, const MP3Record* record);
+
+// Hash -> picture ID table shared by all scanner threads
+typedef struct MP3PictureCache MP3PictureCache;
+
+// File identity, a cached record is reused while all of it matches
+typedef struct MP3CacheKey {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_ns;
+} MP3CacheKey;
+
+// Persistent columnar record cache
+typedef struct MP3Cache MP3Cache;
+
+typedef struct MP3ScanOptions {
+    int threads;                 // Worker threads, 0 - number of CPUs
+    int queue_depth;             // Reads in flight per worker (io_uring), 0 - blocking reads
+    MP3PictureCache* pictures;   // Optional, fills picture_hash/_id/_is_new of records
+    MP3Cache* cache;             // Optional, unchanged files are reported from it without reading
+    MP3ScanFn on_record;
+    void* user;
+} MP3ScanOptions;
+
+MP3_API int MP3Reader_getRecord(MP3Reader* reader, MP3Record* record);
+MP3_API void MP3ScanOptions_init(MP3ScanOptions* options);
+
+// xxHash64 of data
+MP3_API uint64_t MP3_hash64(const void* data, size_t len, uint64_t seed);
+MP3_API void MP3Hash64_init(MP3Hash64* state, uint64_t seed);
+MP3_API void MP3Hash64_update(MP3Hash64* state, const void* data, size_t len);
+MP3_API uint64_t MP3Hash64_final(const MP3Hash64* state);
+
+MP3_API MP3PictureCache* MP3PictureCache_create(void);
+MP3_API void MP3PictureCache_destroy(MP3PictureCache* cache);
+// ID of the picture, is_new is set when this is the first picture with its content
+MP3_API uint32_t MP3PictureCache_add(MP3PictureCache* cache, const MP3_Picture* picture, uint64_t* hash, int* is_new);
+// Same with a known MP3_hash64 of the picture data (never 0)
+MP3_API uint32_t MP3PictureCache_addHash(MP3PictureCache* cache, uint64_t hash, uint32_t size, int* is_new);
+MP3_API uint32_t MP3PictureCache_count(MP3PictureCache* cache);
+
+// Map the cache file written by the last run (a missing file is an empty cache). Records
+// added meanwhile, hits included, become the new cache on MP3Cache_save.
+MP3_API MP3Cache* MP3Cache_open(const char* filename);
+MP3_API int MP3Cache_save(MP3Cache* cache);
+MP3_API void MP3Cache_close(MP3Cache* cache);
+MP3_API int MP3Cache_getKey(const char* path, MP3CacheKey* key);
+// 0 and a filled record if key matches, strings point into the mapping until MP3Cache_close
+MP3_API int MP3Cache_lookup(MP3Cache* cache, const MP3CacheKey* key, MP3Record* record);
+MP3_API int MP3Cache_add(MP3Cache* cache, const MP3CacheKey* key, const MP3Record* record);
+
+// Record output formats
+enum {
+    MP3_WRITER_TSV = 0, // path, title, artist, album, year, track, duration_ms separated by tabs
+    MP3_WRITER_JSON,    // One JSON object per line
+    MP3_WRITER_BINARY   // u32 size of the rest, u32 file_size, duration_ms, picture_size, picture_offset,
+                        // picture_id, u8 picture_type, cached, 2 zero bytes, then path, title, artist,
+                        // album, year, track, mime as u32 length + UTF-8 bytes; native byte order
+};
+
+// Serializes records into per-worker buffers and flushes them to fd with large writes,
+// whole records only. MP3Writer_write may run concurrently for different workers.
+typedef struct MP3Writer MP3Writer;
+MP3_API MP3Writer* MP3Writer_create(int fd, int format);
+MP3_API int MP3Writer_write(MP3Writer* writer, int worker, const MP3Record* record);
+MP3_API int MP3Writer_flush(MP3Writer* writer); // Call once the writing threads are done
+MP3_API void MP3Writer_destroy(MP3Writer* writer);
+MP3_API long MP3Scan_run(const char* root, const MP3ScanOptions* options);
+
 
-int MP3Reader_load(MP3Reader* reader, const char *filename);
-ID3v1Tag* MP3Reader_getID3v1Tag(MP3Reader* reader);
 
-uint32_t size7bitsToNormal(const uint8_t size[4]);
-uint32_t size8bitsToNormal(const uint8_t size[4]);
-uint32_t ID3v2Tag_getTagSize(ID3v2TagHeader* tagHeader);
-uint32_t ID3v2Tag_getFrameSize(ID3v2TagHeader* tagHeader, ID3v2TagFrameHeader* frameHeader);
 
-vector* MP3Reader_getID3v2Tags(MP3Reader* reader);
-vector* MP3Reader_getID3v2TagFrames(MP3Reader* reader, ID3v2TagHeader* tagHeader);
 
+/*
+    Query server
+    Answers metadata and cover requests on a Unix socket. Requests are lines and may be
+    pipelined, responses come back in request order:
+        INFO <path>      OK <length>\n, then one MP3_WRITER_JSON record line
+        PICTURE <path>   OK <length> <mime>\n, then the picture bytes
+        PING             OK 0\n
+    Failures answer ERR <message>\n. Parsed files stay in an LRU keyed by path and are
+    revalidated with stat on every request.
+*/
+
+#ifndef MP3_SERVER_CACHE_ENTRIES
+#define MP3_SERVER_CACHE_ENTRIES 4096
+#endif
+
+// Longest request line
+#ifndef MP3_SERVER_LINE_MAX
+#define MP3_SERVER_LINE_MAX 8192
+#endif
 
-MP3_TextData* MP3Reader_getFrameTextData(ID3v2TagHeader* tagHeader, ID3v2TagFrameHeader* frameHeader);
-void MP3_TextData_free(MP3_TextData* data);
+// Open connections, clients past it get ERR too many connections
+#ifndef MP3_SERVER_MAX_CONNECTIONS
+#define MP3_SERVER_MAX_CONNECTIONS 1024
+#endif
 
-MP3_Picture* MP3Reader_getFramePictureData(ID3v2TagHeader* tagHeader, ID3v2TagFrameHeader* frameHeader);
-void MP3_Picture_free(MP3_Picture* picture);
+typedef struct MP3ServerOptions {
+    int threads;             // Workers answering requests of any connection (0 - number of CPUs)
+    uint32_t cache_entries;  // LRU capacity, 0 - MP3_SERVER_CACHE_ENTRIES
+    int idle_timeout_ms;     // Connections idle that long are closed, 0 - never
+    uint32_t max_connections; // 0 - MP3_SERVER_MAX_CONNECTIONS
+    int send_timeout_ms;     // Connections not taking a response for that long are closed, 0 - never
+} MP3ServerOptions;
 
+typedef struct MP3Server MP3Server;
+MP3_API void MP3ServerOptions_init(MP3ServerOptions* options);
+// Listen on socket_path, a stale socket file there is replaced
+MP3_API MP3Server* MP3Server_create(const char* socket_path, const MP3ServerOptions* options);
+// Serve until MP3Server_stop, 0 on a clean stop
+MP3_API int MP3Server_run(MP3Server* server);
+MP3_API void MP3Server_stop(MP3Server* server); // Async-signal-safe
+MP3_API void MP3Server_destroy(MP3Server* server);
 
 
 
@@ -198,12 +919,169 @@ void MP3_Picture_free(MP3_Picture* picture);
 
 
 
+#ifdef __cplusplus
+}
+#endif
+
+
+
 #ifdef MP3_READER_IMPLEMENTATION
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+#ifdef MP3_READER_USE_ZLIB
+#include <zlib.h>
+#endif
+#if defined(__linux__) && !defined(MP3_READER_NO_URING)
+#define MP3_READER_URING
+#include <linux/io_uring.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef MP3_READER_STATS
+/*
+    STATS
+*/
+
+typedef struct MP3StatsBlock {
+    MP3Stats stats;
+    struct MP3StatsBlock* next;
+} MP3StatsBlock;
+
+// Blocks outlive their threads so finished scan workers still count
+static pthread_mutex_t MP3Stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static MP3StatsBlock* MP3Stats_blocks = NULL;
+static __thread MP3Stats* MP3Stats_local = NULL;
+
+MP3Stats* MP3Stats_get(void) {
+    if (MP3Stats_local != NULL) return MP3Stats_local;
+
+    static MP3Stats fallback; // out of memory, counts are racy but harmless
+    MP3StatsBlock* block = (MP3StatsBlock*) calloc(1, sizeof(MP3StatsBlock));
+    if (block == NULL) return &fallback;
+    pthread_mutex_lock(&MP3Stats_lock);
+    block->next = MP3Stats_blocks;
+    MP3Stats_blocks = block;
+    pthread_mutex_unlock(&MP3Stats_lock);
+    MP3Stats_local = &block->stats;
+    return MP3Stats_local;
+}
+
+void MP3Stats_collect(MP3Stats* total) {
+    memset(total, 0, sizeof(MP3Stats));
+    pthread_mutex_lock(&MP3Stats_lock);
+    for (MP3StatsBlock* block = MP3Stats_blocks; block != NULL; block = block->next) {
+        const uint64_t* in = (const uint64_t*) &block->stats;
+        uint64_t* out = (uint64_t*) total;
+        for (size_t i = 0; i < sizeof(MP3Stats) / sizeof(uint64_t); i++) out[i] += in[i];
+    }
+    pthread_mutex_unlock(&MP3Stats_lock);
+}
+
+void MP3Stats_reset(void) {
+    pthread_mutex_lock(&MP3Stats_lock);
+    for (MP3StatsBlock* block = MP3Stats_blocks; block != NULL; block = block->next) {
+        memset(&block->stats, 0, sizeof(MP3Stats));
+    }
+    pthread_mutex_unlock(&MP3Stats_lock);
+}
+
+const char* MP3Stats_stageName(int stage) {
+    static const char* const names[MP3_STAGE_COUNT] = { "load", "tags", "frames", "text", "picture", "audio", "record", "output" };
+    return stage >= 0 && stage < MP3_STAGE_COUNT ? names[stage] : "unknown";
+}
+
+void MP3Stats_print(const MP3Stats* stats, FILE* out) {
+    fprintf(out, "files %llu, bytes read %llu, syscalls %llu, allocations %llu\n",
+            (unsigned long long) stats->files, (unsigned long long) stats->bytes_read,
+            (unsigned long long) stats->syscalls, (unsigned long long) stats->allocations);
+    fprintf(out, "bytes scanned %llu, tags %llu, frames %llu, audio frames %llu, text bytes %llu\n",
+            (unsigned long long) stats->bytes_scanned, (unsigned long long) stats->tags,
+            (unsigned long long) stats->frames, (unsigned long long) stats->audio_frames,
+            (unsigned long long) stats->text_bytes);
+    for (int i = 0; i < MP3_STAGE_COUNT; i++) {
+        if (stats->calls[i] == 0) continue;
+        fprintf(out, "%-8s %10llu calls %12.3f ms %14llu cycles\n", MP3Stats_stageName(i),
+                (unsigned long long) stats->calls[i], stats->ns[i] / 1e6, (unsigned long long) stats->cycles[i]);
+    }
+}
+
+typedef struct MP3StatsTimer {
+    int stage;
+    uint64_t ns;
+    uint64_t cycles;
+} MP3StatsTimer;
+
+static uint64_t MP3Stats_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static uint64_t MP3Stats_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static MP3StatsTimer MP3StatsTimer_start(int stage) {
+    MP3StatsTimer timer;
+    timer.stage = stage;
+    timer.ns = MP3Stats_ns();
+    timer.cycles = MP3Stats_cycles();
+    return timer;
+}
+
+static void MP3StatsTimer_stop(MP3StatsTimer* timer) {
+    MP3Stats* stats = MP3Stats_get();
+    stats->cycles[timer->stage] += MP3Stats_cycles() - timer->cycles;
+    stats->ns[timer->stage] += MP3Stats_ns() - timer->ns;
+    stats->calls[timer->stage]++;
+}
+
+// Counter update, and a timer covering the rest of the enclosing block (every return path)
+#define MP3_STATS_ADD(field, n) (MP3Stats_get()->field += (n))
+#define MP3_STATS_TIME(stage) MP3StatsTimer MP3_stats_timer __attribute__((cleanup(MP3StatsTimer_stop))) = MP3StatsTimer_start(stage)
+#else
+#define MP3_STATS_ADD(field, n) ((void) 0)
+#define MP3_STATS_TIME(stage) ((void) 0)
+#endif // MP3_READER_STATS
+
+
 /*
     MP3 Reader
 */
 
+uint32_t MP3Reader_version(void) {
+    return MP3_READER_VERSION;
+}
+
 MP3Reader* MP3Reader_create(const char *filename) {
+    return MP3Reader_createWithArena(filename, NULL);
+}
+
+MP3Reader* MP3Reader_createWithArena(const char *filename, MP3Arena* arena) {
+    (void) filename;
+    MP3_STATS_ADD(allocations, 1);
     MP3Reader* reader = (MP3Reader*) malloc(sizeof(MP3Reader));
     if (!reader) {
         printf("Failed to allocate memory for MP3Reader\n");
@@ -211,17 +1089,77 @@ MP3Reader* MP3Reader_create(const char *filename) {
     }
     reader->data = NULL;
     reader->size = 0;
+    reader->buffer = NULL;
+    reader->capacity = 0;
+    reader->file_size = 0;
+    reader->head_size = 0;
+    reader->storage = MP3_STORAGE_NONE;
+    reader->fd = -1;
+    reader->arena = arena;
+    memset(&reader->seek, 0, sizeof(MP3SeekTable));
+    reader->frames.tag = NULL;
+    reader->scratch = NULL;
+    reader->unsync_tag = NULL;
+    reader->unsync_data = NULL;
+    reader->unsync_size = 0;
+    reader->decoded = NULL;
     return reader;
 }
 
+// Drop loaded data, the heap buffer is kept for the next load
+static void MP3Reader_freeData(MP3Reader* reader) {
+    if (reader->storage == MP3_STORAGE_MMAP) {
+        munmap(reader->data, reader->size);
+        MP3_STATS_ADD(syscalls, 1);
+    }
+    reader->data = NULL;
+    reader->size = 0;
+    reader->file_size = 0;
+    reader->head_size = 0;
+    reader->storage = MP3_STORAGE_NONE;
+    if (reader->fd >= 0) {
+        close(reader->fd);
+        MP3_STATS_ADD(syscalls, 1);
+        reader->fd = -1;
+    }
+    MP3SeekTable_free(&reader->seek);
+    reader->frames.tag = NULL;
+    reader->unsync_tag = NULL;
+    reader->unsync_data = NULL;
+    reader->unsync_size = 0;
+    reader->decoded = NULL;
+    MP3Arena_reset(reader->scratch);
+}
+
 void MP3Reader_destroy(MP3Reader* reader) {
     if (reader != NULL) {
-        free(reader->data);
+        MP3Reader_freeData(reader);
+        MP3Arena_destroy(reader->scratch);
+        free(reader->buffer);
         free(reader);
     }
 }
 
 
+// Grow heap buffer to at least capacity bytes, never shrinks
+int MP3Reader_reserve(MP3Reader* reader, uint32_t capacity) {
+    if (reader == NULL) return -1;
+    if (capacity <= reader->capacity) return 0;
+
+    MP3_STATS_ADD(allocations, 1);
+    uint8_t* buffer = (uint8_t*) realloc(reader->buffer, capacity);
+    if (buffer == NULL) {
+        printf("Failed to allocate memory for file data\n");
+        return -1;
+    }
+
+    if (reader->storage == MP3_STORAGE_HEAP) reader->data = buffer;
+    reader->buffer = buffer;
+    reader->capacity = capacity;
+    return 0;
+}
+
+
 int MP3Reader_load(MP3Reader* reader, const char *filename) {
     if (reader == NULL) {
         printf("MP3Reader is NULL\n");
@@ -229,11 +1167,8 @@ int MP3Reader_load(MP3Reader* reader, const char *filename) {
     }
 
     // free existing data
-    if (reader->data != NULL) {
-        free(reader->data);
-        reader->data = NULL;
-        reader->size = 0;
-    }
+    MP3Reader_freeData(reader);
+    MP3_STATS_TIME(MP3_STAGE_LOAD);
 
     // open file
     FILE* file = fopen(filename, "rb");
@@ -242,30 +1177,200 @@ int MP3Reader_load(MP3Reader* reader, const char *filename) {
         return -1;
     }
 
-    // get file size
+    // get file size, reader sizes are 32-bit
     fseek(file, 0, SEEK_END);
-    reader->size = ftell(file);
+    long file_size = ftell(file);
     fseek(file, 0, SEEK_SET);
+    if (file_size < 0 || (uint64_t) file_size > UINT32_MAX) {
+        printf("File too large: %s\n", filename);
+        fclose(file);
+        return -1;
+    }
+    uint32_t size = (uint32_t) file_size;
 
 
-    // allocate memory for file data
-    reader->data = (uint8_t*) malloc(reader->size);
-    if (!reader->data) {
-        printf("Failed to allocate memory for file data\n");
+    // grow buffer only if this file is larger than previous ones
+    if (MP3Reader_reserve(reader, size) != 0) {
         fclose(file);
         return -1;
     }
 
+    reader->data = reader->buffer;
+    reader->size = size;
+    reader->storage = MP3_STORAGE_HEAP;
+
     // read file into memory
     if (fread(reader->data, 1, reader->size, file) != reader->size) {
         printf("Failed to read file into memory\n");
         fclose(file);
-        free(reader->data);
-        reader->data = NULL;
+        MP3Reader_freeData(reader);
         return -1;
     }
 
+    reader->fd = dup(fileno(file));
     fclose(file);
+    MP3_STATS_ADD(syscalls, 6); // open, 2 lseek, read, dup, close
+    MP3_STATS_ADD(bytes_read, reader->size);
+    MP3_STATS_ADD(files, 1);
+    reader->file_size = reader->size;
+    reader->head_size = reader->size;
+    return 0;
+}
+
+
+// Map file read-only instead of copying it into memory
+int MP3Reader_loadMmap(MP3Reader* reader, const char *filename) {
+    if (reader == NULL) {
+        printf("MP3Reader is NULL\n");
+        return -1;
+    }
+
+    // free existing data
+    MP3Reader_freeData(reader);
+    MP3_STATS_TIME(MP3_STAGE_LOAD);
+
+    // open file
+    int fd = open(filename, O_RDONLY);
+    MP3_STATS_ADD(syscalls, 2); // open, fstat
+    if (fd < 0) {
+        printf("Failed to open file: %s\n", filename);
+        return -1;
+    }
+
+    // get file size
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        printf("Failed to stat file: %s\n", filename);
+        close(fd);
+        return -1;
+    }
+
+    if ((uint64_t) st.st_size > UINT32_MAX) { // reader sizes are 32-bit
+        printf("File too large: %s\n", filename);
+        close(fd);
+        return -1;
+    }
+
+    // empty files can't be mapped, nothing to read anyway
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        printf("Failed to map file: %s\n", filename);
+        close(fd);
+        return -1;
+    }
+
+    reader->fd = fd;
+    reader->data = (uint8_t*) data;
+    reader->size = (uint32_t) st.st_size;
+    reader->file_size = reader->size;
+    reader->head_size = reader->size;
+    reader->storage = MP3_STORAGE_MMAP;
+    MP3_STATS_ADD(syscalls, 1);
+    MP3_STATS_ADD(files, 1);
+    return 0;
+}
+
+
+// pread until len bytes are read
+static int MP3_preadFull(int fd, void* buf, size_t len, off_t offset) {
+    uint8_t* p = (uint8_t*) buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, offset);
+        MP3_STATS_ADD(syscalls, 1);
+        if (n <= 0) return -1;
+        MP3_STATS_ADD(bytes_read, n);
+        p += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+// Read only the ID3v2 region at the start and the ID3v1 trailer.
+// data holds [ID3v2 tag][first audio bytes][last 128 bytes], so tag and frame accessors work
+// unchanged. The probe covers the first audio frame for Xing/VBRI detection.
+int MP3Reader_loadTags(MP3Reader* reader, const char *filename) {
+    if (reader == NULL) {
+        printf("MP3Reader is NULL\n");
+        return -1;
+    }
+
+    // free existing data
+    MP3Reader_freeData(reader);
+    MP3_STATS_TIME(MP3_STAGE_LOAD);
+
+    // open file
+    int fd = open(filename, O_RDONLY);
+    MP3_STATS_ADD(syscalls, 2); // open, fstat
+    if (fd < 0) {
+        printf("Failed to open file: %s\n", filename);
+        return -1;
+    }
+
+    // get file size
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        printf("Failed to stat file: %s\n", filename);
+        close(fd);
+        return -1;
+    }
+    if ((uint64_t) st.st_size > UINT32_MAX) { // reader sizes are 32-bit
+        printf("File too large: %s\n", filename);
+        close(fd);
+        return -1;
+    }
+    uint32_t file_size = (uint32_t) st.st_size;
+
+    // ID3v2 tag region
+    uint32_t head_size = 0;
+    ID3v2TagHeader header;
+    if (file_size >= sizeof(ID3v2TagHeader) &&
+        MP3_preadFull(fd, &header, sizeof(header), 0) == 0 &&
+        strncmp(header.header, "ID3", 3) == 0) {
+        head_size = sizeof(ID3v2TagHeader) + ID3v2Tag_getTagSize(&header);
+        if (header.flags & 0x10) head_size += sizeof(ID3v2TagHeader); // footer
+    }
+    head_size += MP3_READER_PROBE_SIZE;
+
+    // small file, head and tail overlap
+    uint32_t tail_size = sizeof(ID3v1Tag);
+    if ((uint64_t) head_size + tail_size >= file_size) {
+        head_size = file_size;
+        tail_size = 0;
+    }
+
+    if (head_size + tail_size == 0) {
+        close(fd);
+        reader->file_size = file_size;
+        return 0;
+    }
+
+    if (MP3Reader_reserve(reader, head_size + tail_size) != 0) {
+        close(fd);
+        return -1;
+    }
+    reader->data = reader->buffer;
+    reader->storage = MP3_STORAGE_HEAP;
+
+    if (MP3_preadFull(fd, reader->data, head_size, 0) != 0 ||
+        (tail_size > 0 && MP3_preadFull(fd, reader->data + head_size, tail_size, file_size - tail_size) != 0)) {
+        printf("Failed to read file into memory\n");
+        close(fd);
+        MP3Reader_freeData(reader);
+        return -1;
+    }
+
+    reader->fd = fd;
+    reader->size = head_size + tail_size;
+    reader->file_size = file_size;
+    reader->head_size = head_size;
+    MP3_STATS_ADD(files, 1);
     return 0;
 }
 
@@ -304,177 +1409,4396 @@ uint32_t ID3v2Tag_getTagSize(ID3v2TagHeader* tagHeader) {
 
 // Get ID3v2 Tag frame size
 uint32_t ID3v2Tag_getFrameSize(ID3v2TagHeader* tagHeader, ID3v2TagFrameHeader* frameHeader) {
+    if (tagHeader->version_major == 2) {
+        const uint8_t* p = (const uint8_t*) frameHeader;
+        return (p[3] << 16) | (p[4] << 8) | p[5];
+    }
     return (tagHeader->version_major == 4) ? size7bitsToNormal(frameHeader->size) : size8bitsToNormal(frameHeader->size);
 }
 
 
+// Get ID3v2 Tag frame header size, 6 for ID3v2.2
+uint32_t ID3v2Tag_getFrameHeaderSize(ID3v2TagHeader* tagHeader) {
+    return (tagHeader->version_major == 2) ? 6 : sizeof(ID3v2TagFrameHeader);
+}
 
 
-// Get ID3v2 Tags
-vector* MP3Reader_getID3v2Tags(MP3Reader* reader) {
-    vector* tags = vector_create();
-    if (reader == NULL || reader->size < sizeof(ID3v2TagHeader)) {
-        return tags;
-    }
 
-    for (uint32_t i = 0; i < reader->size - sizeof(ID3v2TagHeader); i++) {
-        ID3v2TagHeader* header = (ID3v2TagHeader*)(reader->data + i);
-        if (strncmp(header->header, "ID3", 3) == 0) {
-            vector_push_back(tags, header);
-        }
-    }
 
-    return tags;
+// Validate ID3v2 tag header ("ID3") or footer ("3DI")
+int ID3v2Tag_isValid(const ID3v2TagHeader* tagHeader, const char magic[3]) {
+    if (memcmp(tagHeader->header, magic, 3) != 0) return 0;
+    if (tagHeader->version_major < 2 || tagHeader->version_major > 4) return 0;
+    if (tagHeader->version_minor == 0xFF) return 0;
+    return ((tagHeader->size[0] | tagHeader->size[1] | tagHeader->size[2] | tagHeader->size[3]) & 0x80) == 0;
 }
 
 
+// Map a 4-byte frame ID to MP3_FRAME_*, the switch compiles to a jump table or binary search
+int MP3_getFrameId(const char id[4]) {
+    switch (MP3_FRAME_ID(id[0], id[1], id[2], id[3])) {
+#define MP3_FRAME_CASE(name, a, b, c, d) case MP3_FRAME_ID(a, b, c, d): return MP3_FRAME_##name;
+        MP3_FRAME_LIST(MP3_FRAME_CASE)
+#undef MP3_FRAME_CASE
+        default: return MP3_FRAME_UNKNOWN;
+    }
+}
 
-// Get ID3v2Tag frames
-vector* MP3Reader_getID3v2TagFrames(MP3Reader* reader, ID3v2TagHeader* tagHeader) {
-    vector* frames = vector_create();
-    if (reader == NULL || tagHeader == NULL) {
-        return frames;
+
+// Map a 3-byte ID3v2.2 frame ID to the MP3_FRAME_* of its ID3v2.3 equivalent
+int MP3_getFrameIdV22(const char id[3]) {
+    switch (MP3_FRAME_ID(0, id[0], id[1], id[2])) {
+#define MP3_FRAME_CASE(name, a, b, c) case MP3_FRAME_ID(0, a, b, c): return MP3_FRAME_##name;
+        MP3_FRAME_LIST_V22(MP3_FRAME_CASE)
+#undef MP3_FRAME_CASE
+        default: return MP3_FRAME_UNKNOWN;
     }
+}
 
-    uint32_t start_pos = (uint8_t*)tagHeader - reader->data + sizeof(ID3v2TagHeader);
-    uint32_t pos = start_pos;
-    uint32_t tag_size = ID3v2Tag_getTagSize(tagHeader);
 
-    for (; pos < start_pos + tag_size - sizeof(ID3v2TagFrameHeader); ) {
-        if (pos + sizeof(ID3v2TagFrameHeader) > reader->size) break;
+// 4-character name of MP3_FRAME_*, "" for unknown
+const char* MP3_getFrameName(int id) {
+    static const char names[MP3_FRAME_COUNT][5] = {
+        "",
+#define MP3_FRAME_NAME(name, a, b, c, d) #name,
+        MP3_FRAME_LIST(MP3_FRAME_NAME)
+#undef MP3_FRAME_NAME
+    };
+    return (id > 0 && id < MP3_FRAME_COUNT) ? names[id] : names[0];
+}
+
 
-        ID3v2TagFrameHeader* frameHeader = (ID3v2TagFrameHeader*)(reader->data + pos);
-        if (frameHeader->header[0] == 0) break; // No more frames
-        vector_push_back(frames, frameHeader);
+// Get MP3_FRAME_* of a frame
+int ID3v2Tag_getFrameId(ID3v2TagHeader* tagHeader, ID3v2TagFrameHeader* frameHeader) {
+    if (tagHeader->version_major == 2) return MP3_getFrameIdV22(frameHeader->header);
+    return MP3_getFrameId(frameHeader->header);
+}
 
-        uint32_t frame_size = ID3v2Tag_getFrameSize(tagHeader, frameHeader);
-        pos += sizeof(ID3v2TagFrameHeader) + frame_size;
-    }
 
-    return frames;
+// Get ID3v2 Tags (full scan)
+vector* MP3Reader_getID3v2Tags(MP3Reader* reader) {
+    return MP3Reader_findID3v2Tags(reader, MP3_TAGSCAN_FULL);
 }
 
 
-MP3_TextData* MP3Reader_getFrameTextData(ID3v2TagHeader* tagHeader, ID3v2TagFrameHeader* frameHeader) {
-    if (tagHeader == NULL || frameHeader == NULL) {
-        return NULL;
+// Find ID3v2 Tags
+vector* MP3Reader_findID3v2Tags(MP3Reader* reader, int mode) {
+    MP3_STATS_TIME(MP3_STAGE_TAGS);
+    vector* tags = vector_create_arena(reader ? reader->arena : NULL);
+    ID3v2TagIter it;
+    ID3v2TagIter_init(&it, reader, mode);
+
+    ID3v2TagHeader* header;
+    while ((header = ID3v2TagIter_next(&it)) != NULL) {
+        vector_push_back(tags, header);
     }
+    return tags;
+}
 
-    MP3_TextData* text_data = (MP3_TextData*) malloc(sizeof(MP3_TextData));
-    if (text_data == NULL) return NULL;
 
-    uint8_t* frame_data = (uint8_t*)frameHeader + sizeof(ID3v2TagFrameHeader);
-    uint32_t frame_size = ID3v2Tag_getFrameSize(tagHeader, frameHeader);
-    uint8_t encoding = frame_data[0]; // Text encoding
+// Get ID3v2Tag frames
+vector* MP3Reader_getID3v2TagFrames(MP3Reader* reader, ID3v2TagHeader* tagHeader) {
+    MP3_STATS_TIME(MP3_STAGE_FRAMES);
+    vector* frames = vector_create_arena(reader ? reader->arena : NULL);
+    ID3v2FrameIter it;
+    ID3v2FrameIter_init(&it, reader, tagHeader);
 
-    // skip encoding byte
-    frame_data++;
-    frame_size--;
-    if (frame_size == 0) {
-        MP3_TextData_free(text_data);
-        return NULL;
+    ID3v2TagFrameHeader* frameHeader;
+    while ((frameHeader = ID3v2FrameIter_next(&it)) != NULL) {
+        vector_push_back(frames, frameHeader);
     }
-
-    text_data->encoding = encoding;
-    text_data->data = frame_data;
-    text_data->len = frame_size;
-    return text_data;
+    return frames;
 }
 
-void MP3_TextData_free(MP3_TextData* data) {
-    free(data);
-}
 
+// Index the frames of tagHeader in reader->frames, unless that is already done
+static void MP3Reader_buildFrameDir(MP3Reader* reader, ID3v2TagHeader* tagHeader) {
+    ID3v2FrameDir* dir = &reader->frames;
+    if (dir->tag == (const uint8_t*) tagHeader) return;
+    MP3_STATS_TIME(MP3_STAGE_FRAMES);
+
+    memset(dir->first, 0, sizeof(dir->first));
+    dir->tag = (const uint8_t*) tagHeader;
+    dir->base = NULL;
+    dir->count = 0;
+    dir->resume = 0;
+
+    uint16_t* last[MP3_FRAME_COUNT]; // Tail of each chain, valid once first[] is set
+    ID3v2FrameIter it;
+    ID3v2FrameIter_init(&it, reader, tagHeader);
+    dir->base = it.data;
+
+    ID3v2TagFrameHeader* frameHeader;
+    while ((frameHeader = ID3v2FrameIter_next(&it)) != NULL) {
+        uint32_t offset = (uint8_t*) frameHeader - it.data;
+        if (dir->count == MP3_FRAMEDIR_SIZE) {
+            dir->resume = offset;
+            break;
+        }
 
+        int id = ID3v2Tag_getFrameId(tagHeader, frameHeader);
+        uint16_t slot = dir->count++;
+        dir->offsets[slot] = offset;
+        dir->next[slot] = 0;
+        if (dir->first[id] == 0) dir->first[id] = slot + 1;
+        else *last[id] = slot + 1;
+        last[id] = &dir->next[slot];
+    }
+}
 
+// Linear walk for frames past the directory, starting at pos in the frames area
+static ID3v2TagFrameHeader* MP3Reader_walkFrames(MP3Reader* reader, ID3v2TagHeader* tagHeader, uint64_t pos, int id) {
+    ID3v2FrameIter it;
+    ID3v2FrameIter_init(&it, reader, tagHeader);
+    if (it.data == NULL) return NULL;
+    it.pos = pos > it.end ? it.end : (uint32_t) pos;
 
-MP3_Picture* MP3Reader_getFramePictureData(ID3v2TagHeader* tagHeader, ID3v2TagFrameHeader* frameHeader) {
-    if (tagHeader == NULL || frameHeader == NULL) {
-        return NULL;
+    ID3v2TagFrameHeader* frameHeader;
+    while ((frameHeader = ID3v2FrameIter_next(&it)) != NULL) {
+        if (ID3v2Tag_getFrameId(tagHeader, frameHeader) == id) return frameHeader;
     }
+    return NULL;
+}
 
-    MP3_Picture* picture = (MP3_Picture*) malloc(sizeof(MP3_Picture));
-    if (picture == NULL) return NULL;
+// Find the first frame with MP3_FRAME_* id, NULL if the tag has none
+ID3v2TagFrameHeader* MP3Reader_findFrame(MP3Reader* reader, ID3v2TagHeader* tagHeader, int id) {
+    if (reader == NULL || tagHeader == NULL || id < 0 || id >= MP3_FRAME_COUNT) return NULL;
+    MP3Reader_buildFrameDir(reader, tagHeader);
 
+    ID3v2FrameDir* dir = &reader->frames;
+    if (dir->first[id]) return (ID3v2TagFrameHeader*)(dir->base + dir->offsets[dir->first[id] - 1]);
+    return dir->resume ? MP3Reader_walkFrames(reader, tagHeader, dir->resume, id) : NULL;
+}
 
-    uint8_t* frame_data = (uint8_t*)frameHeader + sizeof(ID3v2TagFrameHeader);
-    uint32_t frame_size = ID3v2Tag_getFrameSize(tagHeader, frameHeader);
-    uint8_t encoding = frame_data[0]; // Text encoding
-    uint32_t data_pos = 1;
+// Find the next frame with the same ID as frameHeader, for TXXX, COMM, APIC etc.
+ID3v2TagFrameHeader* MP3Reader_findNextFrame(MP3Reader* reader, ID3v2TagHeader* tagHeader, ID3v2TagFrameHeader* frameHeader) {
+    if (reader == NULL || tagHeader == NULL || frameHeader == NULL) return NULL;
+    MP3Reader_buildFrameDir(reader, tagHeader);
 
-    // Read MIME type
-    int mime_index = 0;
-    while (data_pos < frame_size && frame_data[data_pos] != 0 && mime_index < 63) {
-        picture->mime_type[mime_index++] = frame_data[data_pos++];
+    ID3v2FrameDir* dir = &reader->frames;
+    int id = ID3v2Tag_getFrameId(tagHeader, frameHeader);
+    uint32_t offset = (const uint8_t*) frameHeader - dir->base;
+    uint64_t next = (uint64_t) offset + ID3v2Tag_getFrameHeaderSize(tagHeader) + ID3v2Tag_getFrameSize(tagHeader, frameHeader);
+
+    if (dir->resume == 0 || offset < dir->resume) {
+        for (uint16_t slot = dir->first[id]; slot != 0; slot = dir->next[slot - 1]) {
+            if (dir->offsets[slot - 1] > offset) return (ID3v2TagFrameHeader*)(dir->base + dir->offsets[slot - 1]);
+        }
+        if (dir->resume == 0) return NULL;
+        next = dir->resume;
+    }
+    return MP3Reader_walkFrames(reader, tagHeader, next, id);
+}
+
+// Number of frames with MP3_FRAME_* id
+int MP3Reader_countFrames(MP3Reader* reader, ID3v2TagHeader* tagHeader, int id) {
+    int count = 0;
+    ID3v2TagFrameHeader* frameHeader = MP3Reader_findFrame(reader, tagHeader, id);
+    while (frameHeader != NULL) {
+        count++;
+        frameHeader = MP3Reader_findNextFrame(reader, tagHeader, frameHeader);
+    }
+    return count;
+}
+
+
+
+
+/*
+    Iterators
+*/
+
+// Undo unsynchronisation (0xFF 0x00 -> 0xFF), out may equal in. Returns the decoded size.
+static uint32_t MP3_removeUnsync(const uint8_t* in, uint32_t len, uint8_t* out) {
+    uint32_t i = 0, o = 0;
+    while (i < len) {
+        // copy up to and including the next 0xFF
+        const uint8_t* ff = (const uint8_t*) memchr(in + i, 0xFF, len - i);
+        uint32_t k = ff ? (uint32_t)(ff - (in + i)) + 1 : len - i;
+        memmove(out + o, in + i, k);
+        i += k;
+        o += k;
+        if (ff && i < len && in[i] == 0x00) i++;
+    }
+    return o;
+}
+
+// Decoded copy of source since the load, a new empty entry the first time, NULL without memory
+static MP3Decoded* MP3Reader_decoded(MP3Reader* reader, const uint8_t* source, int* found) {
+    for (MP3Decoded* d = reader->decoded; d != NULL; d = d->next) {
+        if (d->source == source) {
+            *found = 1;
+            return d;
+        }
+    }
+    *found = 0;
+    if (reader->scratch == NULL && (reader->scratch = MP3Arena_create(0)) == NULL) return NULL;
+    MP3Decoded* d = (MP3Decoded*) MP3Arena_alloc(reader->scratch, sizeof(MP3Decoded));
+    if (d == NULL) return NULL;
+    d->source = source;
+    d->data = NULL;
+    d->size = 0;
+    d->next = reader->decoded;
+    reader->decoded = d;
+    return d;
+}
+
+// Decode a v2.2/v2.3 tag with the unsynchronisation flag once, frame sizes count decoded bytes
+static int MP3Reader_decodeTag(MP3Reader* reader, ID3v2TagHeader* tagHeader, const uint8_t* data, uint32_t size) {
+    if (reader->unsync_tag == (const uint8_t*) tagHeader) return 0;
+
+    int found;
+    MP3Decoded* decoded = MP3Reader_decoded(reader, (const uint8_t*) tagHeader, &found);
+    if (decoded == NULL) return -1;
+    if (!found && (decoded->data = (uint8_t*) MP3Arena_alloc(reader->scratch, size > 0 ? size : 1)) != NULL) {
+        decoded->size = MP3_removeUnsync(data, size, decoded->data);
+    }
+    if (decoded->data == NULL) return -1;
+
+    reader->unsync_data = decoded->data;
+    reader->unsync_size = decoded->size;
+    reader->unsync_tag = (const uint8_t*) tagHeader;
+    return 0;
+}
+
+void ID3v2TagIter_init(ID3v2TagIter* it, MP3Reader* reader, int mode) {
+    it->reader = reader;
+    it->mode = mode;
+    it->pos = 0;
+    it->done = (reader == NULL || reader->size < sizeof(ID3v2TagHeader));
+}
+
+ID3v2TagHeader* ID3v2TagIter_next(ID3v2TagIter* it) {
+    if (it->done) return NULL;
+
+    const uint8_t* data = it->reader->data;
+    uint32_t last = it->reader->size - sizeof(ID3v2TagHeader); // last possible header offset
+
+    if (it->mode == MP3_TAGSCAN_FULL) {
+        // memchr jumps to 'I' candidates at memory speed, rest is validated
+        const uint8_t* p = data + it->pos;
+        const uint8_t* end = data + last + 1;
+        while (p < end && (p = (const uint8_t*) memchr(p, 'I', end - p)) != NULL) {
+            if (ID3v2Tag_isValid((const ID3v2TagHeader*) p, "ID3")) {
+                MP3_STATS_ADD(bytes_scanned, p - data + 1 - it->pos);
+                MP3_STATS_ADD(tags, 1);
+                it->pos = p - data + 1;
+                return (ID3v2TagHeader*) p;
+            }
+            p++;
+        }
+        MP3_STATS_ADD(bytes_scanned, end > data + it->pos ? end - (data + it->pos) : 0);
+        it->done = 1;
+        return NULL;
+    }
+
+    // prepended tags, possibly several in a row
+    MP3_STATS_ADD(bytes_scanned, sizeof(ID3v2TagHeader));
+    if (it->pos + sizeof(ID3v2TagHeader) <= it->reader->head_size && ID3v2Tag_isValid((const ID3v2TagHeader*)(data + it->pos), "ID3")) {
+        ID3v2TagHeader* header = (ID3v2TagHeader*)(data + it->pos);
+        MP3_STATS_ADD(tags, 1);
+        it->pos += sizeof(ID3v2TagHeader) + ID3v2Tag_getTagSize(header);
+        if (header->flags & 0x10) it->pos += sizeof(ID3v2TagHeader); // footer
+        return header;
+    }
+
+    // appended tag, located through its footer at the end or right before ID3v1.
+    // Needs the whole file in memory.
+    it->done = 1;
+    if (it->reader->head_size != it->reader->size) return NULL;
+
+    uint32_t footers[2] = { last, 0 };
+    int footer_count = 1;
+    if (it->reader->size >= sizeof(ID3v1Tag) + sizeof(ID3v2TagHeader) && MP3Reader_getID3v1Tag(it->reader) != NULL) {
+        footers[footer_count++] = last - sizeof(ID3v1Tag);
+    }
+
+    for (int i = 0; i < footer_count; i++) {
+        const ID3v2TagHeader* footer = (const ID3v2TagHeader*)(data + footers[i]);
+        if (!ID3v2Tag_isValid(footer, "3DI")) continue;
+
+        uint32_t tag_size = ID3v2Tag_getTagSize((ID3v2TagHeader*) footer);
+        if (footers[i] < tag_size + sizeof(ID3v2TagHeader)) continue;
+
+        uint32_t header_pos = footers[i] - tag_size - sizeof(ID3v2TagHeader);
+        if (header_pos < it->pos) continue; // already found as prepended tag
+        if (ID3v2Tag_isValid((const ID3v2TagHeader*)(data + header_pos), "ID3")) {
+            MP3_STATS_ADD(tags, 1);
+            return (ID3v2TagHeader*)(data + header_pos);
+        }
+    }
+    return NULL;
+}
+
+
+void ID3v2FrameIter_init(ID3v2FrameIter* it, MP3Reader* reader, ID3v2TagHeader* tagHeader) {
+    it->tag = tagHeader;
+    it->data = NULL;
+    it->pos = 0;
+    it->end = 0;
+    if (reader == NULL || tagHeader == NULL) return;
+
+    uint32_t start_pos = (uint8_t*)tagHeader - reader->data + sizeof(ID3v2TagHeader);
+    uint64_t end_pos = (uint64_t) start_pos + ID3v2Tag_getTagSize(tagHeader);
+    if (end_pos > reader->head_size) end_pos = reader->head_size; // bytes past the head may come from the tail
+    if (start_pos >= end_pos) return;
+
+    it->data = reader->data + start_pos;
+    it->end = (uint32_t) end_pos - start_pos;
+
+    if (tagHeader->version_major < 4 && (tagHeader->flags & 0x80)) { // unsynchronisation
+        if (MP3Reader_decodeTag(reader, tagHeader, it->data, it->end) != 0) {
+            it->data = NULL;
+            it->end = 0;
+            return;
+        }
+        it->data = reader->unsync_data;
+        it->end = reader->unsync_size;
+    }
+
+    if (tagHeader->version_major == 2 && (tagHeader->flags & 0x40)) { // v2.2 compression, never specified
+        it->end = 0;
+        return;
+    }
+
+    if (tagHeader->flags & 0x40 && it->end >= 4) { // extended header
+        uint64_t ext_size = tagHeader->version_major == 4 ? size7bitsToNormal(it->data) : (uint64_t) size8bitsToNormal(it->data) + 4;
+        it->pos = ext_size > it->end ? it->end : (uint32_t) ext_size;
+    }
+}
+
+ID3v2TagFrameHeader* ID3v2FrameIter_next(ID3v2FrameIter* it) {
+    uint32_t header_size = ID3v2Tag_getFrameHeaderSize(it->tag);
+    if (it->pos + header_size > it->end) return NULL;
+
+    ID3v2TagFrameHeader* frameHeader = (ID3v2TagFrameHeader*)(it->data + it->pos);
+    if (frameHeader->header[0] == 0) { // No more frames
+        it->end = it->pos;
+        return NULL;
+    }
+
+    uint32_t frame_size = ID3v2Tag_getFrameSize(it->tag, frameHeader);
+    uint64_t next = (uint64_t) it->pos + header_size + frame_size;
+    if (next > it->end) { // Declared size overruns the frames area, stop the walk here
+        it->end = it->pos;
+        return NULL;
+    }
+    MP3_STATS_ADD(frames, 1);
+    it->pos = (uint32_t) next;
+    return frameHeader;
+}
+
+
+MP3_TextData* MP3Reader_getFrameTextData(ID3v2TagHeader* tagHeader, ID3v2TagFrameHeader* frameHeader) {
+    MP3_TextData* text_data = (MP3_TextData*) malloc(sizeof(MP3_TextData));
+    if (text_data == NULL) return NULL;
+
+    if (MP3Reader_readFrameText(NULL, tagHeader, frameHeader, text_data) != 0) {
+        MP3_TextData_free(text_data);
+        return NULL;
+    }
+    return text_data;
+}
+
+void MP3_TextData_free(MP3_TextData* data) {
+    free(data);
+}
+
+
+// Upper bound for the decompressed size of a frame
+#ifndef MP3_READER_MAX_FRAME_SIZE
+#define MP3_READER_MAX_FRAME_SIZE (64u << 20)
+#endif
+
+// End of the frames area holding frame: the decoded copy of an unsynchronised tag, else
+// the tag itself, cut at the loaded head of the file
+static const uint8_t* MP3Reader_framesEnd(MP3Reader* reader, ID3v2TagHeader* tagHeader, const uint8_t* frame) {
+    for (MP3Decoded* d = reader != NULL ? reader->decoded : NULL; d != NULL; d = d->next) {
+        if (d->data != NULL && frame >= d->data && frame < d->data + d->size) return d->data + d->size;
+    }
+    const uint8_t* end = (const uint8_t*) tagHeader + sizeof(ID3v2TagHeader) + ID3v2Tag_getTagSize(tagHeader);
+    if (reader != NULL && reader->data != NULL && frame >= reader->data && frame < reader->data + reader->head_size &&
+        end > reader->data + reader->head_size) {
+        end = reader->data + reader->head_size;
+    }
+    return end;
+}
+
+// Undo frame unsynchronisation and compression into decoded, data stays NULL on failure
+static void MP3Reader_decodeFrame(MP3Reader* reader, MP3Decoded* decoded, const uint8_t* p, uint32_t len, int unsync, int compressed, uint32_t decoded_size) {
+    if (unsync) {
+        uint8_t* out = (uint8_t*) MP3Arena_alloc(reader->scratch, len > 0 ? len : 1);
+        if (out == NULL) return;
+        len = MP3_removeUnsync(p, len, out);
+        p = out;
+    }
+
+    if (compressed) {
+#ifdef MP3_READER_USE_ZLIB
+        if (decoded_size == 0 || decoded_size > MP3_READER_MAX_FRAME_SIZE) return;
+        uint8_t* out = (uint8_t*) MP3Arena_alloc(reader->scratch, decoded_size);
+        if (out == NULL) return;
+        uLongf out_len = decoded_size;
+        if (uncompress(out, &out_len, p, len) != Z_OK) return;
+        p = out;
+        len = (uint32_t) out_len;
+#else
+        (void) decoded_size;
+        return;
+#endif
+    }
+
+    decoded->data = (uint8_t*) p;
+    decoded->size = len;
+}
+
+int MP3Reader_getFrameData(MP3Reader* reader, ID3v2TagHeader* tagHeader, ID3v2TagFrameHeader* frameHeader, uint8_t** data, uint32_t* size) {
+    if (tagHeader == NULL || frameHeader == NULL) {
+        return -1;
+    }
+
+    uint8_t* p = (uint8_t*)frameHeader + ID3v2Tag_getFrameHeaderSize(tagHeader);
+    uint32_t len = ID3v2Tag_getFrameSize(tagHeader, frameHeader);
+    // the declared size is untrusted, the frame has to end inside the frames area
+    const uint8_t* end = MP3Reader_framesEnd(reader, tagHeader, (const uint8_t*) frameHeader);
+    if (p > end || len > (size_t)(end - p)) return -1;
+    uint8_t flags = frameHeader->flags[1];
+    uint32_t extra = 0;
+    uint32_t decoded_size = 0;
+    int unsync = 0;
+    int compressed = 0;
+
+    if (tagHeader->version_major == 4) {
+        // [group id][encryption method][data length indicator]
+        if (flags & 0x04) return -1; // encrypted
+        unsync = (flags & 0x02) || (tagHeader->flags & 0x80);
+        compressed = flags & 0x08;
+        extra = ((flags & 0x40) ? 1 : 0) + ((flags & 0x01) ? 4 : 0);
+        if (extra > len) return -1;
+        if (flags & 0x01) decoded_size = size7bitsToNormal(p + extra - 4);
+    }
+    else if (tagHeader->version_major == 3) {
+        // [decompressed size][encryption method][group id]
+        if (flags & 0x40) return -1; // encrypted
+        compressed = flags & 0x80;
+        extra = (compressed ? 4 : 0) + ((flags & 0x20) ? 1 : 0);
+        if (extra > len) return -1;
+        if (compressed) decoded_size = size8bitsToNormal(p);
+    }
+    p += extra;
+    len -= extra;
+
+    // zero-copy path
+    if (!unsync && !compressed) {
+        *data = p;
+        *size = len;
+        return 0;
+    }
+
+    // decoded once per load, later calls return the same copy (or the same failure)
+    if (reader == NULL) return -1;
+    int found;
+    MP3Decoded* decoded = MP3Reader_decoded(reader, (const uint8_t*) frameHeader, &found);
+    if (decoded == NULL) return -1;
+    if (!found) MP3Reader_decodeFrame(reader, decoded, p, len, unsync, compressed, decoded_size);
+    if (decoded->data == NULL) return -1;
+
+    *data = decoded->data;
+    *size = decoded->size;
+    return 0;
+}
+
+
+// Fill caller-provided text data, no allocation
+int MP3Reader_readFrameText(MP3Reader* reader, ID3v2TagHeader* tagHeader, ID3v2TagFrameHeader* frameHeader, MP3_TextData* out) {
+    if (tagHeader == NULL || frameHeader == NULL || out == NULL) {
+        return -1;
+    }
+
+    uint8_t* frame_data;
+    uint32_t frame_size;
+    if (MP3Reader_getFrameData(reader, tagHeader, frameHeader, &frame_data, &frame_size) != 0) return -1;
+    if (frame_size < 2) return -1; // encoding byte and at least one byte of text
+
+    out->encoding = frame_data[0]; // Text encoding
+    out->data = (char*)(frame_data + 1);
+    out->len = frame_size - 1;
+    return 0;
+}
+
+
+
+
+MP3_Picture* MP3Reader_getFramePictureData(ID3v2TagHeader* tagHeader, ID3v2TagFrameHeader* frameHeader) {
+    MP3_Picture* picture = (MP3_Picture*) malloc(sizeof(MP3_Picture));
+    if (picture == NULL) return NULL;
+
+    if (MP3Reader_readFramePicture(NULL, tagHeader, frameHeader, picture) != 0) {
+        MP3_Picture_free(picture);
+        return NULL;
+    }
+    return picture;
+}
+
+// Fill caller-provided picture, no allocation
+int MP3Reader_readFramePicture(MP3Reader* reader, ID3v2TagHeader* tagHeader, ID3v2TagFrameHeader* frameHeader, MP3_Picture* out) {
+    if (tagHeader == NULL || frameHeader == NULL || out == NULL) {
+        return -1;
+    }
+
+    uint8_t* frame_data;
+    uint32_t frame_size;
+    if (MP3Reader_getFrameData(reader, tagHeader, frameHeader, &frame_data, &frame_size) != 0) return -1;
+    if (frame_size == 0) return -1;
+    uint8_t encoding = frame_data[0]; // Text encoding
+    uint32_t data_pos = 1;
+
+    // Read MIME type
+    int mime_index = 0;
+    if (tagHeader->version_major == 2) {
+        // ID3v2.2 PIC: 3-character image format instead of a MIME type
+        if (frame_size < 4) return -1;
+        if (memcmp(frame_data + 1, "JPG", 3) == 0) strncpy((char*)out->mime_type, "image/jpeg", 64);
+        else if (memcmp(frame_data + 1, "PNG", 3) == 0) strncpy((char*)out->mime_type, "image/png", 64);
+        else snprintf((char*)out->mime_type, 64, "image/%.3s", (const char*) frame_data + 1);
+        mime_index = strlen((char*)out->mime_type);
+        data_pos = 4;
+    }
+    else {
+        while (data_pos < frame_size && frame_data[data_pos] != 0 && mime_index < 63) {
+            out->mime_type[mime_index++] = frame_data[data_pos++];
+        }
+        out->mime_type[mime_index] = '\0';
+        data_pos++; // Skip null terminator
+    }
+
+    if (mime_index == 0) {
+        strncpy((char*)out->mime_type, "image/jpeg", 64);
+    }
+
+    // picture type byte
+    if (data_pos >= frame_size) {
+        return -1;
+    }
+
+
+    out->picture_type = frame_data[data_pos++];
+
+    // description skip
+    if (encoding == 0) {
+        // ISO-8859-1
+        while (data_pos < frame_size && frame_data[data_pos] != 0) {
+            data_pos++;
+        }
+        data_pos++; // Skip null terminator
+    }
+    else if (encoding == 1 || encoding == 2) {
+        // UTF-16
+        while ((data_pos < frame_size - 1) && !(frame_data[data_pos] == 0 && frame_data[data_pos+1] == 0)) {
+            data_pos += 2;
+        }
+        data_pos += 2; // Skip null terminator
+    }
+    else if (encoding == 3) {
+        // UTF-8
+        while (data_pos < frame_size && frame_data[data_pos] != 0) {
+            data_pos++;
+        }
+        data_pos++; // Skip null terminator
+    }
+    else {
+        return -1;
+    }
+
+
+    if (data_pos >= frame_size) {
+        return -1;
+    }
+
+    // image data
+    out->size = frame_size - data_pos;
+    out->data = frame_data + data_pos;
+    return 0;
+}
+
+void MP3_Picture_free(MP3_Picture* picture) {
+    free(picture);
+}
+
+
+// Copy len bytes at offset of the source file to out_fd without passing them through
+// userspace, returns bytes copied (less than len when the kernel can't do it)
+static uint32_t MP3_copyFileRange(int in_fd, off_t offset, int out_fd, uint32_t len) {
+    uint32_t done = 0;
+#ifdef __linux__
+#ifdef SYS_copy_file_range
+    // same filesystem, may even reflink
+    while (done < len) {
+        int64_t in_off = offset + done;
+        long n = syscall(SYS_copy_file_range, in_fd, &in_off, out_fd, NULL, (size_t)(len - done), 0);
+        MP3_STATS_ADD(syscalls, 1);
+        if (n <= 0) break;
+        done += (uint32_t) n;
+    }
+#endif
+    // any output, sockets and pipes included
+    while (done < len) {
+        off_t in_off = offset + done;
+        ssize_t n = sendfile(out_fd, in_fd, &in_off, len - done);
+        MP3_STATS_ADD(syscalls, 1);
+        if (n <= 0) break;
+        done += (uint32_t) n;
+    }
+#else
+    (void) in_fd;
+    (void) offset;
+    (void) out_fd;
+#endif
+    return done;
+}
+
+int MP3Reader_writePicture(MP3Reader* reader, const MP3_Picture* picture, int fd) {
+    if (picture == NULL || picture->data == NULL || fd < 0) {
+        return -1;
+    }
+    MP3_STATS_TIME(MP3_STAGE_PICTURE);
+
+    uint32_t done = 0;
+    // data matches the file only in its head, loadTags keeps the ID3v1 trailer after it
+    if (reader != NULL && reader->fd >= 0 && reader->data != NULL &&
+        picture->data >= reader->data && picture->data + picture->size <= reader->data + reader->head_size) {
+        done = MP3_copyFileRange(reader->fd, picture->data - reader->data, fd, picture->size);
+    }
+
+    while (done < picture->size) {
+        ssize_t n = write(fd, picture->data + done, picture->size - done);
+        MP3_STATS_ADD(syscalls, 1);
+        if (n <= 0) {
+            printf("Failed to write picture\n");
+            return -1;
+        }
+        done += (uint32_t) n;
+    }
+    return 0;
+}
+
+int MP3Reader_savePicture(MP3Reader* reader, const MP3_Picture* picture, const char* filename) {
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("Failed to open file: %s\n", filename);
+        return -1;
+    }
+
+    int result = MP3Reader_writePicture(reader, picture, fd);
+    if (close(fd) != 0) result = -1;
+    return result;
+}
+
+
+MP3_TextData* MP3Reader_allocFrameTextData(MP3Reader* reader, ID3v2TagHeader* tagHeader, ID3v2TagFrameHeader* frameHeader) {
+    if (reader == NULL || reader->arena == NULL) {
+        return MP3Reader_getFrameTextData(tagHeader, frameHeader);
+    }
+
+    MP3_TextData* text_data = (MP3_TextData*) MP3Arena_alloc(reader->arena, sizeof(MP3_TextData));
+    if (text_data == NULL) return NULL;
+    if (MP3Reader_readFrameText(reader, tagHeader, frameHeader, text_data) != 0) return NULL;
+    return text_data;
+}
+
+MP3_Picture* MP3Reader_allocFramePictureData(MP3Reader* reader, ID3v2TagHeader* tagHeader, ID3v2TagFrameHeader* frameHeader) {
+    if (reader == NULL || reader->arena == NULL) {
+        return MP3Reader_getFramePictureData(tagHeader, frameHeader);
+    }
+
+    MP3_Picture* picture = (MP3_Picture*) MP3Arena_alloc(reader->arena, sizeof(MP3_Picture));
+    if (picture == NULL) return NULL;
+    if (MP3Reader_readFramePicture(reader, tagHeader, frameHeader, picture) != 0) return NULL;
+    return picture;
+}
+
+
+
+
+/*
+    UTF-8 conversion
+*/
+
+// Append code point, 0 if it doesn't fit
+static int MP3_putUTF8(char* out, uint32_t* pos, uint32_t cap, uint32_t cp) {
+    uint32_t n = cp < 0x80 ? 1 : cp < 0x800 ? 2 : cp < 0x10000 ? 3 : 4;
+    if (*pos + n >= cap) return 0; // keep room for NUL
+
+    uint8_t* o = (uint8_t*) out + *pos;
+    switch (n) {
+    case 1: o[0] = (uint8_t) cp; break;
+    case 2: o[0] = 0xC0 | (cp >> 6); o[1] = 0x80 | (cp & 0x3F); break;
+    case 3: o[0] = 0xE0 | (cp >> 12); o[1] = 0x80 | ((cp >> 6) & 0x3F); o[2] = 0x80 | (cp & 0x3F); break;
+    default: o[0] = 0xF0 | (cp >> 18); o[1] = 0x80 | ((cp >> 12) & 0x3F); o[2] = 0x80 | ((cp >> 6) & 0x3F); o[3] = 0x80 | (cp & 0x3F); break;
+    }
+    *pos += n;
+    return 1;
+}
+
+// 8 bytes, any byte order
+static uint64_t MP3_load64(const uint8_t* p) {
+    uint64_t w;
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+#define MP3_SWAR_ONES  0x0101010101010101ULL
+#define MP3_SWAR_HIGHS 0x8080808080808080ULL
+
+int MP3_latin1ToUTF8(const uint8_t* in, uint32_t len, char* out, uint32_t cap) {
+    if (out == NULL || cap == 0) return -1;
+    uint32_t i = 0, pos = 0;
+
+    while (i < len) {
+        // ASCII fast path, 8 bytes at a time while there is no high bit and no NUL
+        while (i + 8 <= len && pos + 8 < cap) {
+            uint64_t w = MP3_load64(in + i);
+            if ((w & MP3_SWAR_HIGHS) || ((w - MP3_SWAR_ONES) & ~w & MP3_SWAR_HIGHS)) break;
+            memcpy(out + pos, in + i, 8);
+            i += 8;
+            pos += 8;
+        }
+        if (i >= len || in[i] == 0) break;
+        if (!MP3_putUTF8(out, &pos, cap, in[i])) break;
+        i++;
+    }
+    out[pos] = 0;
+    return (int) pos;
+}
+
+// Next code point of at most len bytes of UTF-8, U+FFFD for a malformed sequence (overlong,
+// surrogate, past U+10FFFF or cut short), used is set to the bytes it took
+static uint32_t MP3_decodeUTF8(const uint8_t* s, uint32_t len, uint32_t* used) {
+    uint32_t cp = s[0], need, min;
+    *used = 1;
+    if (cp < 0x80) return cp;
+    else if (cp >= 0xC2 && cp < 0xE0) { cp &= 0x1F; need = 1; min = 0x80; }
+    else if ((cp & 0xF0) == 0xE0) { cp &= 0x0F; need = 2; min = 0x800; }
+    else if (cp >= 0xF0 && cp < 0xF5) { cp &= 0x07; need = 3; min = 0x10000; }
+    else return 0xFFFD;
+
+    for (uint32_t i = 1; i <= need; i++) {
+        if (i >= len || (s[i] & 0xC0) != 0x80) {
+            *used = i;
+            return 0xFFFD;
+        }
+        cp = (cp << 6) | (s[i] & 0x3F);
+    }
+    *used = need + 1;
+    return cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp < 0xE000) ? 0xFFFD : cp;
+}
+
+// UTF-8 text validated on the way through, same fast path as ISO-8859-1
+static int MP3_utf8ToUTF8(const uint8_t* in, uint32_t len, char* out, uint32_t cap) {
+    uint32_t i = 0, pos = 0;
+
+    while (i < len) {
+        while (i + 8 <= len && pos + 8 < cap) {
+            uint64_t w = MP3_load64(in + i);
+            if ((w & MP3_SWAR_HIGHS) || ((w - MP3_SWAR_ONES) & ~w & MP3_SWAR_HIGHS)) break;
+            memcpy(out + pos, in + i, 8);
+            i += 8;
+            pos += 8;
+        }
+        if (i >= len || in[i] == 0) break;
+        uint32_t used;
+        uint32_t cp = MP3_decodeUTF8(in + i, len - i, &used);
+        if (!MP3_putUTF8(out, &pos, cap, cp)) break;
+        i += used;
+    }
+    out[pos] = 0;
+    return (int) pos;
+}
+
+int MP3_utf16ToUTF8(const uint8_t* in, uint32_t len, int big_endian, char* out, uint32_t cap) {
+    if (out == NULL || cap == 0) return -1;
+    uint32_t i = 0, pos = 0;
+
+    // ASCII code units: high byte zero, low byte < 0x80
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    int low_first = big_endian;
+#else
+    int low_first = !big_endian;
+#endif
+    uint64_t mask = low_first ? 0xFF80FF80FF80FF80ULL : 0x80FF80FF80FF80FFULL;
+    uint64_t lanes = low_first ? 0x00FF00FF00FF00FFULL : 0xFF00FF00FF00FF00ULL;
+    uint32_t lo = big_endian ? 1 : 0;
+
+    while (i + 1 < len) {
+        // 4 ASCII code units at a time while there is no terminator
+        while (i + 8 <= len && pos + 4 < cap) {
+            uint64_t w = MP3_load64(in + i);
+            if (w & mask) break;
+            uint64_t chars = w & lanes;
+            if (!low_first) chars >>= 8;
+            if ((chars - 0x0001000100010001ULL) & ~chars & 0x8000800080008000ULL) break;
+            out[pos] = (char) in[i + lo];
+            out[pos + 1] = (char) in[i + 2 + lo];
+            out[pos + 2] = (char) in[i + 4 + lo];
+            out[pos + 3] = (char) in[i + 6 + lo];
+            i += 8;
+            pos += 4;
+        }
+        if (i + 1 >= len) break;
+
+        uint32_t unit = big_endian ? (in[i] << 8 | in[i + 1]) : (in[i + 1] << 8 | in[i]);
+        i += 2;
+        if (unit == 0) break;
+
+        uint32_t cp = unit;
+        if (unit >= 0xD800 && unit < 0xDC00 && i + 1 < len) {
+            // surrogate pair
+            uint32_t low = big_endian ? (in[i] << 8 | in[i + 1]) : (in[i + 1] << 8 | in[i]);
+            if (low >= 0xDC00 && low < 0xE000) {
+                cp = 0x10000 + ((unit - 0xD800) << 10) + (low - 0xDC00);
+                i += 2;
+            } else {
+                cp = 0xFFFD;
+            }
+        } else if (unit >= 0xD800 && unit < 0xE000) {
+            cp = 0xFFFD; // lone surrogate
+        }
+        if (!MP3_putUTF8(out, &pos, cap, cp)) break;
+    }
+    out[pos] = 0;
+    return (int) pos;
+}
+
+// Normalize any ID3v2 text encoding to UTF-8
+int MP3_TextData_toUTF8(const MP3_TextData* text, char* out, uint32_t cap) {
+    if (text == NULL || out == NULL || cap == 0) return -1;
+    const uint8_t* in = (const uint8_t*) text->data;
+    uint32_t len = text->len;
+    MP3_STATS_TIME(MP3_STAGE_TEXT);
+    MP3_STATS_ADD(text_bytes, len);
+
+    switch (text->encoding) {
+    case 0: // ISO-8859-1
+        return MP3_latin1ToUTF8(in, len, out, cap);
+    case 1: { // UTF-16 with BOM, little-endian if it's missing
+        int big_endian = 0;
+        if (len >= 2 && in[0] == 0xFE && in[1] == 0xFF) big_endian = 1;
+        if (len >= 2 && ((in[0] == 0xFE && in[1] == 0xFF) || (in[0] == 0xFF && in[1] == 0xFE))) {
+            in += 2;
+            len -= 2;
+        }
+        return MP3_utf16ToUTF8(in, len, big_endian, out, cap);
+    }
+    case 2: // UTF-16BE
+        return MP3_utf16ToUTF8(in, len, 1, out, cap);
+    case 3: // UTF-8, malformed sequences become U+FFFD like lone UTF-16 surrogates
+        return MP3_utf8ToUTF8(in, len, out, cap);
+    }
+    out[0] = 0;
+    return -1;
+}
+
+int MP3Reader_readFrameTextUTF8(MP3Reader* reader, ID3v2TagHeader* tagHeader, ID3v2TagFrameHeader* frameHeader, char* out, uint32_t cap) {
+    MP3_TextData text;
+    if (MP3Reader_readFrameText(reader, tagHeader, frameHeader, &text) != 0) {
+        if (out != NULL && cap > 0) out[0] = 0;
+        return -1;
+    }
+    return MP3_TextData_toUTF8(&text, out, cap);
+}
+
+
+
+/*
+    Tag writer
+*/
+
+// Next code point of NUL-terminated UTF-8 text, U+FFFD for malformed input. The
+// terminator is no continuation byte, so decoding never reads past it.
+static uint32_t MP3_readUTF8(const uint8_t** p) {
+    uint32_t used;
+    uint32_t cp = MP3_decodeUTF8(*p, 4, &used);
+    *p += used;
+    return cp;
+}
+
+// Text frame payload: encoding byte and text, at most 3 + 2 * strlen(text) bytes
+static uint32_t MP3_encodeText(int version, const char* text, uint8_t* out) {
+    uint32_t len = (uint32_t) strlen(text);
+    if (version >= 4) {
+        out[0] = 3; // UTF-8
+        memcpy(out + 1, text, len);
+        return len + 1;
+    }
+
+    // ISO-8859-1 when every character fits
+    const uint8_t* p = (const uint8_t*) text;
+    const uint8_t* end = p + len;
+    uint32_t n = 1;
+    int latin1 = 1;
+    while (p < end && latin1) {
+        uint32_t cp = MP3_readUTF8(&p);
+        latin1 = cp <= 0xFF;
+        out[n++] = (uint8_t) cp;
+    }
+    if (latin1) {
+        out[0] = 0;
+        return n;
+    }
+
+    // UTF-16 with a little-endian BOM
+    out[0] = 1;
+    out[1] = 0xFF;
+    out[2] = 0xFE;
+    n = 3;
+    for (p = (const uint8_t*) text; p < end;) {
+        uint32_t cp = MP3_readUTF8(&p);
+        if (cp >= 0x10000) {
+            cp -= 0x10000;
+            uint32_t high = 0xD800 | (cp >> 10), low = 0xDC00 | (cp & 0x3FF);
+            out[n++] = (uint8_t) high;
+            out[n++] = (uint8_t)(high >> 8);
+            cp = low;
+        }
+        out[n++] = (uint8_t) cp;
+        out[n++] = (uint8_t)(cp >> 8);
+    }
+    return n;
+}
+
+static void MP3_putSize(uint8_t* p, uint32_t size, int syncsafe) {
+    if (syncsafe) {
+        p[0] = (size >> 21) & 0x7F;
+        p[1] = (size >> 14) & 0x7F;
+        p[2] = (size >> 7) & 0x7F;
+        p[3] = size & 0x7F;
+    } else {
+        p[0] = (uint8_t)(size >> 24);
+        p[1] = (uint8_t)(size >> 16);
+        p[2] = (uint8_t)(size >> 8);
+        p[3] = (uint8_t) size;
+    }
+}
+
+// New text frame at out, returns its size
+static uint32_t MP3_putTextFrame(uint8_t* out, int version, int id, const char* text) {
+    memcpy(out, MP3_getFrameName(id), 4);
+    uint32_t size = MP3_encodeText(version, text, out + 10);
+    MP3_putSize(out + 4, size, version >= 4);
+    out[8] = 0;
+    out[9] = 0;
+    return size + 10;
+}
+
+// write/pwrite until len bytes are written, offset -1 writes at the file position
+static int MP3_writeFull(int fd, const uint8_t* data, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = offset >= 0 ? pwrite(fd, data, len, offset) : write(fd, data, len);
+        MP3_STATS_ADD(syscalls, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        data += n;
+        len -= n;
+        if (offset >= 0) offset += n;
+    }
+    return 0;
+}
+
+// Stream [offset, offset + len) of in_fd to the end of out_fd
+static int MP3_copyTail(int in_fd, off_t offset, int out_fd, uint32_t len) {
+    uint32_t done = MP3_copyFileRange(in_fd, offset, out_fd, len);
+    uint8_t buffer[64 * 1024];
+    while (done < len) {
+        uint32_t chunk = len - done < sizeof(buffer) ? len - done : (uint32_t) sizeof(buffer);
+        if (MP3_preadFull(in_fd, buffer, chunk, offset + done) != 0 || MP3_writeFull(out_fd, buffer, chunk, -1) != 0) return -1;
+        done += chunk;
+    }
+    return 0;
+}
+
+static int MP3_isTextFrame(int id) {
+    const char* name = MP3_getFrameName(id);
+    return name[0] == 'T' && id != MP3_FRAME_TXXX;
+}
+
+// Text frames defined by only one of ID3v2.3 and ID3v2.4
+static int MP3_isFrameInVersion(int id, int version) {
+    switch (id) {
+        case MP3_FRAME_TDAT: case MP3_FRAME_TIME: case MP3_FRAME_TORY: case MP3_FRAME_TRDA:
+        case MP3_FRAME_TSIZ: case MP3_FRAME_TYER:
+            return version == 3;
+        case MP3_FRAME_TDEN: case MP3_FRAME_TDOR: case MP3_FRAME_TDRC: case MP3_FRAME_TDRL:
+        case MP3_FRAME_TDTG: case MP3_FRAME_TIPL: case MP3_FRAME_TMCL: case MP3_FRAME_TMOO:
+        case MP3_FRAME_TPRO: case MP3_FRAME_TSOA: case MP3_FRAME_TSOP: case MP3_FRAME_TSOT:
+        case MP3_FRAME_TSST:
+            return version == 4;
+        default:
+            return 1;
+    }
+}
+
+int MP3Reader_updateTag(MP3Reader* reader, const char* filename, const MP3TextEdit* edits, int count, uint32_t padding) {
+    if (reader == NULL || filename == NULL || count < 0 || (count > 0 && edits == NULL)) return -1;
+    uint64_t capacity = 10 + 10;
+    for (int i = 0; i < count; i++) {
+        if (!MP3_isTextFrame(edits[i].id)) {
+            printf("Not a text frame: %s\n", MP3_getFrameName(edits[i].id));
+            return -1;
+        }
+        if (edits[i].text != NULL) capacity += 10 + 3 + 2 * (uint64_t) strlen(edits[i].text);
+    }
+    if (MP3Reader_loadTags(reader, filename) != 0) return -1;
+
+    ID3v2TagHeader* tag = NULL;
+    uint32_t region = 0; // ID3v2 bytes at the start of the file
+    int version = 4;
+    if (reader->head_size >= sizeof(ID3v2TagHeader) && ID3v2Tag_isValid((const ID3v2TagHeader*) reader->data, "ID3")) {
+        tag = (ID3v2TagHeader*) reader->data;
+        version = tag->version_major;
+        region = sizeof(ID3v2TagHeader) + ID3v2Tag_getTagSize(tag) + (tag->flags & 0x10 ? sizeof(ID3v2TagHeader) : 0);
+        if (version == 2 || region > reader->head_size || region > reader->file_size) {
+            printf(version == 2 ? "ID3v2.2 tags can't be rewritten: %s\n" : "ID3v2 tag is truncated: %s\n", filename);
+            MP3Reader_freeData(reader);
+            return -1;
+        }
+        capacity += ID3v2Tag_getTagSize(tag);
+    }
+    for (int i = 0; i < count; i++) {
+        if (!MP3_isFrameInVersion(edits[i].id, version)) {
+            printf("%s is not an ID3v2.%d frame: %s\n", MP3_getFrameName(edits[i].id), version, filename);
+            MP3Reader_freeData(reader);
+            return -1;
+        }
+    }
+
+    uint8_t* out = (uint8_t*) malloc(capacity + padding);
+    uint8_t* written = (uint8_t*) calloc(count > 0 ? count : 1, 1);
+    if (out == NULL || written == NULL || capacity + padding >= (1u << 28)) {
+        printf("Failed to allocate memory for the new tag\n");
+        free(out);
+        free(written);
+        MP3Reader_freeData(reader);
+        return -1;
+    }
+
+    // existing frames in order, edited ones replaced at their first occurrence
+    uint32_t size = sizeof(ID3v2TagHeader);
+    if (tag != NULL) {
+        ID3v2FrameIter it;
+        ID3v2FrameIter_init(&it, reader, tag);
+        uint32_t header_size = ID3v2Tag_getFrameHeaderSize(tag);
+        // v2.4 frames are copied as stored, without the tag flag they have to say so themselves
+        uint8_t unsync = version == 4 && (tag->flags & 0x80) ? 0x02 : 0;
+        ID3v2TagFrameHeader* frame;
+        while ((frame = ID3v2FrameIter_next(&it)) != NULL) {
+            int id = ID3v2Tag_getFrameId(tag, frame);
+            int edit = -1;
+            for (int i = count - 1; i >= 0 && edit < 0 && id != MP3_FRAME_UNKNOWN; i--) {
+                if (edits[i].id == id) edit = i;
+            }
+
+            if (edit < 0) {
+                uint32_t len = header_size + ID3v2Tag_getFrameSize(tag, frame); // the iterator keeps it inside the tag
+                memcpy(out + size, frame, len);
+                out[size + 9] |= unsync;
+                size += len;
+            } else if (!written[edit]) {
+                if (edits[edit].text != NULL) size += MP3_putTextFrame(out + size, version, id, edits[edit].text);
+                written[edit] = 1;
+            }
+        }
+    }
+
+    // frames that weren't there yet
+    for (int i = 0; i < count; i++) {
+        int last = 1;
+        for (int j = i + 1; j < count && last; j++) last = edits[j].id != edits[i].id;
+        if (last && !written[i] && edits[i].text != NULL) size += MP3_putTextFrame(out + size, version, edits[i].id, edits[i].text);
+    }
+    free(written);
+
+    // tag-wide unsynchronisation (copied v2.4 frames carry it), the extended header and the footer are dropped
+    out[0] = 'I';
+    out[1] = 'D';
+    out[2] = '3';
+    out[3] = (uint8_t) version;
+    out[4] = tag != NULL ? tag->version_minor : 0;
+    out[5] = tag != NULL ? (uint8_t)(tag->flags & ~0xD0) : 0;
+
+    int result = -1;
+    if (tag != NULL && !(tag->flags & 0x10) && size <= region) {
+        // fits, the rest of the old tag becomes padding
+        memset(out + size, 0, region - size);
+        MP3_putSize(out + 6, region - sizeof(ID3v2TagHeader), 1);
+        int fd = open(filename, O_WRONLY);
+        if (fd >= 0 && MP3_writeFull(fd, out, region, 0) == 0 && close(fd) == 0) result = 0;
+        else {
+            printf("Failed to write tag: %s\n", filename);
+            if (fd >= 0) close(fd);
+        }
+    } else {
+        memset(out + size, 0, padding);
+        size += padding;
+        MP3_putSize(out + 6, size - sizeof(ID3v2TagHeader), 1);
+
+        size_t len = strlen(filename);
+        char* tmp = (char*) malloc(len + 5);
+        struct stat st;
+        int fd = -1;
+        if (tmp != NULL && fstat(reader->fd, &st) == 0) {
+            memcpy(tmp, filename, len);
+            memcpy(tmp + len, ".tmp", 5);
+            fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+        }
+        if (fd >= 0 && MP3_writeFull(fd, out, size, -1) == 0 &&
+            MP3_copyTail(reader->fd, region, fd, reader->file_size - region) == 0 &&
+            fsync(fd) == 0 && close(fd) == 0) {
+            fd = -1;
+            if (rename(tmp, filename) == 0) result = 1;
+        }
+        if (result != 1) {
+            printf("Failed to rewrite file: %s\n", filename);
+            if (fd >= 0) close(fd);
+            if (tmp != NULL) unlink(tmp);
+        }
+        free(tmp);
+    }
+
+    free(out);
+    MP3Reader_freeData(reader); // data no longer matches the file
+    return result;
+}
+
+
+
+
+/*
+    MPEG audio frames
+*/
+
+// Decode 4 header bytes (big-endian), returns frame size or 0 if invalid
+static uint32_t MP3_decodeFrameHeader(uint32_t h, uint32_t* samples, uint32_t* frequency) {
+    uint32_t version = (h >> 19) & 3;
+    uint32_t layer = (h >> 17) & 3;
+    uint32_t bitrate_index = (h >> 12) & 15;
+    uint32_t frequency_index = (h >> 10) & 3;
+    uint32_t padding = (h >> 9) & 1;
+
+    if ((h >> 21) != 0x7FF || version == 1 || layer == 0) return 0;
+    if (bitrate_index == 0 || bitrate_index == 15 || frequency_index == 3) return 0; // free format unsupported
+    if ((h & 3) == 2) return 0; // reserved emphasis
+
+    uint32_t bitrate = (version == 3 ? bitratesMPEG1 : bitratesMPEG2)[3 - layer][bitrate_index] * 1000;
+    uint32_t freq = frequencies[3 - version][frequency_index];
+    *frequency = freq;
+
+    if (layer == 3) { // Layer I
+        *samples = 384;
+        return (12 * bitrate / freq + padding) * 4;
+    }
+    if (layer == 1 && version != 3) { // Layer III, MPEG-2/2.5
+        *samples = 576;
+        return 72 * bitrate / freq + padding;
+    }
+    *samples = 1152;
+    return 144 * bitrate / freq + padding;
+}
+
+static uint32_t MP3_readBE32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Fill header bitfields from 4 raw bytes, 0 if it's a valid frame header
+int MP3FrameHeader_parse(const uint8_t* data, MP3FrameHeader* header) {
+    uint32_t h = MP3_readBE32(data);
+    uint32_t samples, frequency;
+    if (MP3_decodeFrameHeader(h, &samples, &frequency) == 0) return -1;
+
+    header->sync = h >> 21;
+    header->version = (h >> 19) & 3;
+    header->layer = (h >> 17) & 3;
+    header->protection = (h >> 16) & 1;
+    header->bitrate = (h >> 12) & 15;
+    header->frequency = (h >> 10) & 3;
+    header->padding = (h >> 9) & 1;
+    header->private_bit = (h >> 8) & 1;
+    header->mode = (h >> 6) & 3;
+    header->mode_extension = (h >> 4) & 3;
+    header->copyright = (h >> 3) & 1;
+    header->original = (h >> 2) & 1;
+    header->emphasis = h & 3;
+    return 0;
+}
+
+// Pack bitfields back into the raw header word
+static uint32_t MP3FrameHeader_pack(const MP3FrameHeader* header) {
+    return ((uint32_t)header->sync << 21) | ((uint32_t)header->version << 19) | ((uint32_t)header->layer << 17) |
+           ((uint32_t)header->protection << 16) | ((uint32_t)header->bitrate << 12) | ((uint32_t)header->frequency << 10) |
+           ((uint32_t)header->padding << 9) | ((uint32_t)header->private_bit << 8) | ((uint32_t)header->mode << 6) |
+           ((uint32_t)header->mode_extension << 4) | ((uint32_t)header->copyright << 3) | ((uint32_t)header->original << 2) |
+           header->emphasis;
+}
+
+// Bitrate in kbps
+uint32_t MP3FrameHeader_getBitrate(const MP3FrameHeader* header) {
+    return (header->version == 3 ? bitratesMPEG1 : bitratesMPEG2)[3 - header->layer][header->bitrate];
+}
+
+// Sample rate in Hz
+uint32_t MP3FrameHeader_getFrequency(const MP3FrameHeader* header) {
+    return frequencies[3 - header->version][header->frequency];
+}
+
+// Frame size in bytes including the header
+uint32_t MP3FrameHeader_getFrameSize(const MP3FrameHeader* header) {
+    uint32_t samples, frequency;
+    return MP3_decodeFrameHeader(MP3FrameHeader_pack(header), &samples, &frequency);
+}
+
+// Samples per channel in the frame
+uint32_t MP3FrameHeader_getSamples(const MP3FrameHeader* header) {
+    uint32_t samples = 0, frequency;
+    MP3_decodeFrameHeader(MP3FrameHeader_pack(header), &samples, &frequency);
+    return samples;
+}
+
+
+// Audio payload bounds in file offsets: after leading ID3v2 tags, before an appended tag and ID3v1
+int MP3Reader_getAudioRange(MP3Reader* reader, uint32_t* start, uint32_t* end) {
+    if (reader == NULL || reader->data == NULL) return -1;
+
+    *start = 0;
+    *end = reader->file_size;
+
+    ID3v2TagIter it;
+    ID3v2TagIter_init(&it, reader, MP3_TAGSCAN_SPEC);
+    ID3v2TagHeader* tag;
+    while ((tag = ID3v2TagIter_next(&it)) != NULL) {
+        uint32_t offset = (uint8_t*) tag - reader->data;
+        if (offset == *start) {
+            *start = it.pos; // leading tag, iterator is right after it
+        } else {
+            *end = offset;   // appended tag
+        }
+    }
+
+    if (*end == reader->file_size && MP3Reader_getID3v1Tag(reader) != NULL) {
+        *end -= sizeof(ID3v1Tag);
+    }
+    if (*start > *end) *start = *end;
+    return 0;
+}
+
+
+// Frame at pos is accepted if it fits and is followed by a matching header (or the end)
+static uint32_t MP3_checkFrame(const uint8_t* data, uint32_t pos, uint32_t end, uint32_t* samples, uint32_t* frequency) {
+    uint32_t h = MP3_readBE32(data + pos);
+    uint32_t size = MP3_decodeFrameHeader(h, samples, frequency);
+    if (size == 0 || pos + size > end) return 0;
+
+    if (pos + size + 4 <= end) {
+        uint32_t next = MP3_readBE32(data + pos + size);
+        uint32_t next_samples, next_frequency;
+        // same version, layer and sample rate
+        if ((next & 0xFFFE0C00) != (h & 0xFFFE0C00) || MP3_decodeFrameHeader(next, &next_samples, &next_frequency) == 0) return 0;
+    }
+    return size;
+}
+
+// Next valid frame at or after pos, resyncing on 0xFF bytes. Returns its size or 0 at the end.
+static uint32_t MP3_syncFrame(const uint8_t* data, uint32_t pos, uint32_t end, uint32_t* offset, uint32_t* samples, uint32_t* frequency) {
+    while (pos + 4 <= end) {
+        uint32_t size = MP3_checkFrame(data, pos, end, samples, frequency);
+        if (size != 0) {
+            *offset = pos;
+            return size;
+        }
+
+        const uint8_t* p = (const uint8_t*) memchr(data + pos + 1, 0xFF, end - pos - 1);
+        if (p == NULL) break;
+        pos = p - data;
+    }
+    return 0;
+}
+
+
+// Find first valid audio frame in [pos, end), 0 on success
+int MP3Reader_findAudioFrame(MP3Reader* reader, uint32_t pos, uint32_t end, uint32_t* offset, MP3FrameHeader* header) {
+    if (reader == NULL || reader->data == NULL) return -1;
+    if (end > reader->head_size) end = reader->head_size;
+
+    uint32_t samples, frequency;
+    if (MP3_syncFrame(reader->data, pos, end, offset, &samples, &frequency) == 0) return -1;
+    if (header != NULL) MP3FrameHeader_parse(reader->data + *offset, header);
+    return 0;
+}
+
+
+// Walk all audio frames into a flat index. Needs the audio in memory (MP3Reader_load / MP3Reader_loadMmap).
+static void MP3FrameIndex_init(MP3FrameIndex* index) {
+    index->entries = NULL;
+    index->count = 0;
+    index->capacity = 0;
+    index->sample_rate = 0;
+    index->total_samples = 0;
+}
+
+// Append the frames found from pos while they start before stop, frames may extend up
+// to end. Returns the position after the last one, *failed is set when out of memory.
+static uint32_t MP3FrameIndex_scan(MP3FrameIndex* index, const uint8_t* data, uint32_t pos, uint32_t stop, uint32_t end, int* failed) {
+    uint32_t first = pos;
+    uint32_t offset, samples, frequency, size;
+    while ((size = MP3_syncFrame(data, pos, end, &offset, &samples, &frequency)) != 0 && offset < stop) {
+        if (index->count == index->capacity) {
+            // first guess from the first frame size, then double
+            uint32_t new_cap = index->capacity == 0 ? (stop - first) / size + 16 : index->capacity * 2;
+            MP3_STATS_ADD(allocations, 1);
+            MP3FrameIndexEntry* entries = (MP3FrameIndexEntry*) realloc(index->entries, new_cap * sizeof(MP3FrameIndexEntry));
+            if (entries == NULL) {
+                *failed = 1;
+                return pos;
+            }
+            index->entries = entries;
+            index->capacity = new_cap;
+        }
+
+        if (index->count == 0) index->sample_rate = frequency;
+        MP3FrameIndexEntry* entry = &index->entries[index->count++];
+        entry->offset = offset;
+        entry->size = (uint16_t) size;
+        entry->samples = (uint16_t) samples;
+        index->total_samples += samples;
+        pos = offset + size;
+    }
+    return pos;
+}
+
+int MP3Reader_buildFrameIndex(MP3Reader* reader, MP3FrameIndex* index) {
+    if (index == NULL) return -1;
+    MP3_STATS_TIME(MP3_STAGE_AUDIO);
+    MP3FrameIndex_init(index);
+
+    uint32_t start, end;
+    if (MP3Reader_getAudioRange(reader, &start, &end) != 0) return -1;
+    if (end > reader->head_size) {
+        printf("Audio data is not loaded\n");
+        return -1;
+    }
+
+    int failed = 0;
+    MP3FrameIndex_scan(index, reader->data, start, end, end, &failed);
+    if (failed) {
+        MP3FrameIndex_free(index);
+        return -1;
+    }
+    MP3_STATS_ADD(audio_frames, index->count);
+    return 0;
+}
+
+
+/*
+    Parallel frame index
+    Each chunk is indexed from the first valid frame at or after its start. The serial
+    walk reaches a chunk at some position P: if P is at or before the chunk start nothing
+    valid lies in between (the previous chunk looked), so the chunk's frames are the serial
+    ones. If the last frame straddles into the chunk, the walk is redone serially from P
+    until it lands on a frame the chunk also found, from there on both chains agree.
+*/
+
+#ifndef MP3_INDEX_CHUNK_MIN
+#define MP3_INDEX_CHUNK_MIN (4u << 20)
+#endif
+#define MP3_INDEX_MAX_THREADS 64
+
+typedef struct MP3IndexChunk {
+    const uint8_t* data;
+    uint32_t start;      // Chunk covers frames starting in [start, stop)
+    uint32_t stop;
+    uint32_t end;        // End of the audio
+    int failed;
+    MP3FrameIndex index;
+    pthread_t thread;
+    int running;         // Has its own thread
+} MP3IndexChunk;
+
+static void* MP3IndexChunk_run(void* arg) {
+    MP3IndexChunk* chunk = (MP3IndexChunk*) arg;
+    MP3FrameIndex_scan(&chunk->index, chunk->data, chunk->start, chunk->stop, chunk->end, &chunk->failed);
+    return NULL;
+}
+
+static int MP3FrameIndex_append(MP3FrameIndex* index, const MP3FrameIndexEntry* entries, uint32_t count) {
+    if (count == 0) return 0;
+    if (index->count + count > index->capacity) {
+        uint32_t new_cap = index->capacity ? index->capacity : 1024;
+        while (new_cap < index->count + count) new_cap *= 2;
+        MP3_STATS_ADD(allocations, 1);
+        MP3FrameIndexEntry* grown = (MP3FrameIndexEntry*) realloc(index->entries, new_cap * sizeof(MP3FrameIndexEntry));
+        if (grown == NULL) return -1;
+        index->entries = grown;
+        index->capacity = new_cap;
+    }
+    memcpy(index->entries + index->count, entries, count * sizeof(MP3FrameIndexEntry));
+    index->count += count;
+    for (uint32_t i = 0; i < count; i++) index->total_samples += entries[i].samples;
+    return 0;
+}
+
+int MP3Reader_buildFrameIndexParallel(MP3Reader* reader, MP3FrameIndex* index, int threads) {
+    if (index == NULL) return -1;
+    uint32_t start, end;
+    if (MP3Reader_getAudioRange(reader, &start, &end) != 0) return -1;
+    if (end > reader->head_size) return MP3Reader_buildFrameIndex(reader, index); // prints the error
+
+    if (threads <= 0) threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > MP3_INDEX_MAX_THREADS) threads = MP3_INDEX_MAX_THREADS;
+    if ((uint64_t) threads * MP3_INDEX_CHUNK_MIN > end - start) threads = (int)((end - start) / MP3_INDEX_CHUNK_MIN);
+    if (threads < 2) return MP3Reader_buildFrameIndex(reader, index);
+
+    MP3_STATS_TIME(MP3_STAGE_AUDIO);
+    MP3IndexChunk chunks[MP3_INDEX_MAX_THREADS];
+    for (int i = 0; i < threads; i++) {
+        MP3IndexChunk* chunk = &chunks[i];
+        chunk->data = reader->data;
+        chunk->start = start + (uint32_t)((uint64_t)(end - start) * i / threads);
+        chunk->stop = start + (uint32_t)((uint64_t)(end - start) * (i + 1) / threads);
+        chunk->end = end;
+        chunk->failed = 0;
+        MP3FrameIndex_init(&chunk->index);
+        // chunk 0 runs on this thread, the others run inline if they can't be started
+        chunk->running = i > 0 && pthread_create(&chunk->thread, NULL, MP3IndexChunk_run, chunk) == 0;
+    }
+    for (int i = 0; i < threads; i++) {
+        if (chunks[i].running) pthread_join(chunks[i].thread, NULL);
+        else MP3IndexChunk_run(&chunks[i]);
+    }
+
+    // stitch, chunk 0 starts where the serial walk does
+    MP3FrameIndex_init(index);
+    int failed = 0;
+    uint32_t pos = start;
+    for (int i = 0; i < threads && !failed; i++) {
+        MP3IndexChunk* chunk = &chunks[i];
+        failed = chunk->failed;
+        uint32_t from = 0; // first chunk entry the serial walk agrees with
+
+        // redo the frames straddling into the chunk until both walks meet
+        while (!failed && pos > chunk->start) {
+            while (from < chunk->index.count && chunk->index.entries[from].offset < pos) from++;
+            uint32_t before = from > 0 ? chunk->index.entries[from - 1].offset + chunk->index.entries[from - 1].size : chunk->start;
+            if (before <= pos) break; // nothing valid in [pos, entries[from]), that is the next serial frame
+
+            if (from == chunk->index.count) { // pos inside the chunk's last frame
+                pos = MP3FrameIndex_scan(index, reader->data, pos, chunk->stop, end, &failed);
+                break;
+            }
+            uint32_t meet = chunk->index.entries[from].offset;
+            pos = MP3FrameIndex_scan(index, reader->data, pos, meet + 1, end, &failed);
+            if (index->count > 0 && index->entries[index->count - 1].offset == meet) {
+                from++; // met, same chain from here on
+                break;
+            }
+        }
+
+        if (!failed && from < chunk->index.count) {
+            if (index->count == 0) index->sample_rate = chunk->index.sample_rate;
+            failed = MP3FrameIndex_append(index, chunk->index.entries + from, chunk->index.count - from) != 0;
+            const MP3FrameIndexEntry* last = &chunk->index.entries[chunk->index.count - 1];
+            pos = last->offset + last->size;
+        }
+    }
+
+    for (int i = 0; i < threads; i++) MP3FrameIndex_free(&chunks[i].index);
+    if (failed) {
+        MP3FrameIndex_free(index);
+        return -1;
+    }
+    MP3_STATS_ADD(audio_frames, index->count);
+    return 0;
+}
+
+// Duration in milliseconds
+uint32_t MP3FrameIndex_getDuration(const MP3FrameIndex* index) {
+    if (index == NULL || index->sample_rate == 0) return 0;
+    return (uint32_t)(index->total_samples * 1000 / index->sample_rate);
+}
+
+void MP3FrameIndex_free(MP3FrameIndex* index) {
+    if (index == NULL) return;
+    free(index->entries);
+    index->entries = NULL;
+    index->count = 0;
+    index->capacity = 0;
+}
+
+
+// Detect Xing/Info or VBRI header in the first audio frame, 0 if found
+int MP3Reader_getVBRHeader(MP3Reader* reader, MP3VBRHeader* vbr) {
+    uint32_t start, end, offset;
+    MP3FrameHeader header;
+    if (MP3Reader_getAudioRange(reader, &start, &end) != 0) return -1;
+    if (MP3Reader_findAudioFrame(reader, start, end, &offset, &header) != 0) return -1;
+
+    uint32_t frame_size = MP3FrameHeader_getFrameSize(&header);
+    if (offset + frame_size > reader->head_size) return -1;
+    const uint8_t* frame = reader->data + offset;
+
+    memset(vbr, 0, sizeof(MP3VBRHeader));
+    vbr->offset = offset;
+    vbr->frame_size = frame_size;
+    vbr->sample_rate = MP3FrameHeader_getFrequency(&header);
+    vbr->samples_per_frame = MP3FrameHeader_getSamples(&header);
+
+    // Xing/Info sits right after the side information
+    uint32_t side_info;
+    if (header.version == 3) side_info = header.mode == 3 ? 17 : 32;
+    else side_info = header.mode == 3 ? 9 : 17;
+    uint32_t pos = 4 + side_info + (header.protection == 0 ? 2 : 0);
+
+    if (pos + 8 <= frame_size && (memcmp(frame + pos, "Xing", 4) == 0 || memcmp(frame + pos, "Info", 4) == 0)) {
+        memcpy(vbr->type, frame + pos, 4);
+        uint32_t flags = MP3_readBE32(frame + pos + 4);
+        pos += 8;
+        if ((flags & 1) && pos + 4 <= frame_size) {
+            vbr->frames = MP3_readBE32(frame + pos);
+            pos += 4;
+        }
+        if ((flags & 2) && pos + 4 <= frame_size) {
+            vbr->bytes = MP3_readBE32(frame + pos);
+            pos += 4;
+        }
+        if ((flags & 4) && pos + 100 <= frame_size) {
+            memcpy(vbr->toc, frame + pos, 100);
+            vbr->has_toc = 1;
+        }
+        return 0;
+    }
+
+    // VBRI always sits 32 bytes after the header
+    pos = 4 + 32;
+    if (pos + 18 <= frame_size && memcmp(frame + pos, "VBRI", 4) == 0) {
+        memcpy(vbr->type, frame + pos, 4);
+        vbr->bytes = MP3_readBE32(frame + pos + 10);
+        vbr->frames = MP3_readBE32(frame + pos + 14);
+        return 0;
+    }
+    return -1;
+}
+
+
+// Duration in milliseconds: VBR header if present, else the frame index when the
+// audio is loaded, else a CBR estimate from the first frame bitrate
+int MP3Reader_getDuration(MP3Reader* reader, uint32_t* duration_ms) {
+    MP3_STATS_TIME(MP3_STAGE_AUDIO);
+    MP3VBRHeader vbr;
+    if (MP3Reader_getVBRHeader(reader, &vbr) == 0 && vbr.frames > 0 && vbr.sample_rate > 0) {
+        *duration_ms = (uint32_t)((uint64_t) vbr.frames * vbr.samples_per_frame * 1000 / vbr.sample_rate);
+        return 0;
+    }
+
+    uint32_t start, end;
+    if (MP3Reader_getAudioRange(reader, &start, &end) != 0) return -1;
+
+    if (end <= reader->head_size) {
+        MP3FrameIndex index;
+        if (MP3Reader_buildFrameIndex(reader, &index) != 0) return -1;
+        *duration_ms = MP3FrameIndex_getDuration(&index);
+        MP3FrameIndex_free(&index);
+        return index.sample_rate > 0 ? 0 : -1;
+    }
+
+    uint32_t offset;
+    MP3FrameHeader header;
+    if (MP3Reader_findAudioFrame(reader, start, end, &offset, &header) != 0) return -1;
+    *duration_ms = (uint32_t)((uint64_t)(end - offset) * 8 / MP3FrameHeader_getBitrate(&header));
+    return 0;
+}
+
+
+
+// Audio range without the VBR header frame if requested, then hashed from memory or
+// through a fixed buffer with sequential readahead
+int MP3Reader_hashAudio(MP3Reader* reader, int flags, MP3AudioHash* hash) {
+    MP3_STATS_TIME(MP3_STAGE_AUDIO);
+    uint32_t start, end;
+    if (hash == NULL || MP3Reader_getAudioRange(reader, &start, &end) != 0) return -1;
+
+    MP3VBRHeader vbr;
+    if ((flags & MP3_AUDIOHASH_SKIP_VBR) && MP3Reader_getVBRHeader(reader, &vbr) == 0 && vbr.offset + vbr.frame_size <= end) {
+        start = vbr.offset + vbr.frame_size;
+    }
+    hash->offset = start;
+    hash->size = end - start;
+    MP3_STATS_ADD(bytes_scanned, hash->size);
+
+    MP3Hash64 state;
+    MP3Hash64_init(&state, 0);
+    if (end <= reader->head_size) {
+        MP3Hash64_update(&state, reader->data + start, end - start);
+        hash->hash = MP3Hash64_final(&state);
+        return 0;
+    }
+    if (reader->fd < 0) {
+        printf("Audio data is not loaded\n");
+        return -1;
+    }
+
+    uint8_t* buffer = (uint8_t*) malloc(MP3_AUDIOHASH_BUFFER);
+    if (buffer == NULL) {
+        printf("Failed to allocate memory for audio hash\n");
+        return -1;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(reader->fd, start, end - start, POSIX_FADV_SEQUENTIAL);
+#endif
+    // bytes already in memory are not read again
+    uint32_t pos = start;
+    if (pos < reader->head_size) {
+        MP3Hash64_update(&state, reader->data + pos, reader->head_size - pos);
+        pos = reader->head_size;
+    }
+    while (pos < end) {
+        uint32_t chunk = end - pos < MP3_AUDIOHASH_BUFFER ? end - pos : MP3_AUDIOHASH_BUFFER;
+        if (MP3_preadFull(reader->fd, buffer, chunk, pos) != 0) {
+            printf("Failed to read audio data\n");
+            free(buffer);
+            return -1;
+        }
+        MP3Hash64_update(&state, buffer, chunk);
+        pos += chunk;
+    }
+    free(buffer);
+    hash->hash = MP3Hash64_final(&state);
+    return 0;
+}
+
+
+
+/*
+    Seek table
+*/
+
+static int MP3SeekTable_alloc(MP3SeekTable* table, uint32_t count) {
+    // both arrays in one block
+    uint8_t* block = (uint8_t*) malloc((size_t) count * (sizeof(uint64_t) + sizeof(uint32_t)));
+    if (block == NULL) return -1;
+    table->samples = (uint64_t*) block;
+    table->offsets = (uint32_t*)(block + (size_t) count * sizeof(uint64_t));
+    table->count = count;
+    return 0;
+}
+
+// One entry every interval frames
+int MP3SeekTable_fromIndex(MP3SeekTable* table, const MP3FrameIndex* index, uint32_t interval) {
+    memset(table, 0, sizeof(MP3SeekTable));
+    if (index == NULL || index->count == 0) return -1;
+    if (interval == 0) interval = 1;
+
+    if (MP3SeekTable_alloc(table, (index->count + interval - 1) / interval) != 0) return -1;
+    table->sample_rate = index->sample_rate;
+
+    uint64_t samples = 0;
+    for (uint32_t i = 0; i < index->count; i++) {
+        if (i % interval == 0) {
+            table->samples[i / interval] = samples;
+            table->offsets[i / interval] = index->entries[i].offset;
+        }
+        samples += index->entries[i].samples;
+    }
+    return 0;
+}
+
+// 100 entries from the Xing TOC plus the end of audio, file offsets
+int MP3SeekTable_fromVBR(MP3SeekTable* table, const MP3VBRHeader* vbr) {
+    memset(table, 0, sizeof(MP3SeekTable));
+    if (vbr == NULL || !vbr->has_toc || vbr->frames == 0 || vbr->bytes == 0) return -1;
+
+    if (MP3SeekTable_alloc(table, 101) != 0) return -1;
+    table->sample_rate = vbr->sample_rate;
+
+    // audio begins with the frame after the header frame
+    uint64_t total_samples = (uint64_t) vbr->frames * vbr->samples_per_frame;
+    uint32_t audio_start = vbr->offset + vbr->frame_size;
+    for (uint32_t i = 0; i < 100; i++) {
+        table->samples[i] = total_samples * i / 100;
+        table->offsets[i] = audio_start + (uint32_t)((uint64_t) vbr->toc[i] * vbr->bytes / 256);
+    }
+    table->samples[100] = total_samples;
+    table->offsets[100] = audio_start + vbr->bytes;
+    return 0;
+}
+
+// Index of the last entry at or before sample, binary search
+int MP3SeekTable_lookup(const MP3SeekTable* table, uint64_t sample) {
+    if (table == NULL || table->count == 0) return -1;
+
+    uint32_t lo = 0, hi = table->count;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (table->samples[mid] <= sample) lo = mid;
+        else hi = mid;
+    }
+    return (int) lo;
+}
+
+void MP3SeekTable_free(MP3SeekTable* table) {
+    if (table == NULL) return;
+    free(table->samples); // owns offsets too
+    memset(table, 0, sizeof(MP3SeekTable));
+}
+
+
+// Byte offset of the frame containing ms. With the audio in memory this is frame
+// accurate, otherwise it's interpolated from the Xing TOC or the CBR bitrate.
+int MP3Reader_seekToTime(MP3Reader* reader, uint32_t ms, uint32_t* offset) {
+    if (reader == NULL || offset == NULL) return -1;
+
+    uint32_t start, end;
+    if (MP3Reader_getAudioRange(reader, &start, &end) != 0) return -1;
+    int loaded = end <= reader->head_size;
+
+    if (reader->seek.count == 0) {
+        MP3VBRHeader vbr;
+        if (loaded) {
+            MP3FrameIndex index;
+            if (MP3Reader_buildFrameIndex(reader, &index) != 0) return -1;
+            MP3SeekTable_fromIndex(&reader->seek, &index, MP3_SEEK_INTERVAL);
+            MP3FrameIndex_free(&index);
+        } else if (MP3Reader_getVBRHeader(reader, &vbr) == 0) {
+            MP3SeekTable_fromVBR(&reader->seek, &vbr);
+        }
+    }
+
+    MP3SeekTable* table = &reader->seek;
+    if (table->count == 0) {
+        // CBR estimate
+        uint32_t first;
+        MP3FrameHeader header;
+        if (MP3Reader_findAudioFrame(reader, start, end, &first, &header) != 0) return -1;
+        uint64_t pos = first + (uint64_t) ms * MP3FrameHeader_getBitrate(&header) / 8;
+        *offset = pos < end ? (uint32_t) pos : end;
+        return 0;
+    }
+
+    uint64_t sample = (uint64_t) ms * table->sample_rate / 1000;
+    int i = MP3SeekTable_lookup(table, sample);
+    uint32_t pos = table->offsets[i];
+    uint64_t pos_sample = table->samples[i];
+
+    if (!loaded) {
+        // interpolate between TOC entries
+        if ((uint32_t) i + 1 < table->count && table->offsets[i + 1] > pos) {
+            uint64_t next_sample = table->samples[i + 1];
+            pos += (uint32_t)((uint64_t)(table->offsets[i + 1] - pos) * (sample - pos_sample) / (next_sample - pos_sample));
+        }
+        *offset = pos < end ? pos : end;
+        return 0;
+    }
+
+    // walk at most MP3_SEEK_INTERVAL frames from the entry
+    uint32_t frame_offset, samples, frequency, size;
+    while ((size = MP3_syncFrame(reader->data, pos, end, &frame_offset, &samples, &frequency)) != 0) {
+        if (pos_sample + samples > sample) break;
+        pos_sample += samples;
+        pos = frame_offset + size;
+    }
+    *offset = size != 0 ? frame_offset : end;
+    return 0;
+}
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+/*
+    Stream parser
+*/
+
+enum {
+    MP3_STREAM_STATE_HEADER = 0, // Expecting an ID3v2 tag or audio
+    MP3_STREAM_STATE_EXTHEADER,  // Inside a tag, expecting the extended header
+    MP3_STREAM_STATE_FRAMES,     // Inside a tag, expecting a frame header
+    MP3_STREAM_STATE_PAYLOAD,    // Collecting a requested frame payload
+    MP3_STREAM_STATE_AUDIO       // MPEG audio frames
+};
+
+void MP3StreamParser_init(MP3StreamParser* parser, MP3StreamEventFn on_event, MP3StreamWantFn want_frame, void* user) {
+    memset(parser, 0, sizeof(MP3StreamParser));
+    parser->state = MP3_STREAM_STATE_HEADER;
+    parser->on_event = on_event;
+    parser->want_frame = want_frame;
+    parser->user = user;
+}
+
+void MP3StreamParser_free(MP3StreamParser* parser) {
+    if (parser == NULL) return;
+    free(parser->frame_data);
+    parser->frame_data = NULL;
+    parser->frame_capacity = 0;
+}
+
+static void MP3Stream_drop(MP3StreamParser* parser, uint32_t n) {
+    memmove(parser->window, parser->window + n, parser->window_len - n);
+    parser->window_len -= n;
+    parser->pos += n;
+}
+
+static int MP3Stream_emit(MP3StreamParser* parser, MP3StreamEvent* event) {
+    if (parser->on_event == NULL) return 0;
+    return parser->on_event(parser->user, event) != 0 ? 1 : 0;
+}
+
+// Parse what the window holds. Returns 1 on progress, 0 if more data is needed,
+// 2 if the callback stopped parsing.
+static int MP3Stream_step(MP3StreamParser* parser, int final) {
+    uint8_t* w = parser->window;
+    uint32_t n = parser->window_len;
+    MP3StreamEvent event;
+    memset(&event, 0, sizeof(event));
+
+    if (parser->skip > 0) {
+        uint32_t k = parser->skip < n ? (uint32_t) parser->skip : n;
+        MP3Stream_drop(parser, k);
+        parser->skip -= k;
+        return k > 0;
+    }
+
+    switch (parser->state) {
+    case MP3_STREAM_STATE_HEADER: {
+        if (n < sizeof(ID3v2TagHeader) && !final) return 0;
+        if (n >= sizeof(ID3v2TagHeader) && ID3v2Tag_isValid((const ID3v2TagHeader*) w, "ID3")) {
+            memcpy(&parser->tag, w, sizeof(ID3v2TagHeader));
+            parser->tag_end = parser->pos + sizeof(ID3v2TagHeader) + ID3v2Tag_getTagSize(&parser->tag);
+            if (parser->tag.flags & 0x10) parser->tag_end += sizeof(ID3v2TagHeader); // footer
+
+            event.type = MP3_STREAM_TAG;
+            event.offset = parser->pos;
+            event.tag = &parser->tag;
+            event.size = ID3v2Tag_getTagSize(&parser->tag);
+            MP3Stream_drop(parser, sizeof(ID3v2TagHeader));
+            parser->state = (parser->tag.flags & 0x40) ? MP3_STREAM_STATE_EXTHEADER : MP3_STREAM_STATE_FRAMES;
+            // whole-tag unsynchronisation or v2.2 compression, frames can't be walked in place
+            uint8_t whole_tag = parser->tag.version_major == 2 ? 0xC0 : (parser->tag.version_major == 3 ? 0x80 : 0);
+            if (parser->tag.flags & whole_tag) {
+                parser->skip = parser->tag_end - parser->pos;
+                parser->state = MP3_STREAM_STATE_HEADER;
+            }
+            return MP3Stream_emit(parser, &event) ? 2 : 1;
+        }
+        parser->state = MP3_STREAM_STATE_AUDIO;
+        return 1;
+    }
+
+    case MP3_STREAM_STATE_EXTHEADER: {
+        uint64_t left = parser->tag_end - parser->pos;
+        if (left < 4) {
+            parser->skip = left;
+            parser->state = MP3_STREAM_STATE_HEADER;
+            return 1;
+        }
+        if (n < 4) return 0;
+
+        uint64_t ext_size = parser->tag.version_major == 4 ? size7bitsToNormal(w) : (uint64_t) size8bitsToNormal(w) + 4;
+        parser->skip = ext_size < left ? ext_size : left;
+        parser->state = MP3_STREAM_STATE_FRAMES;
+        return 1;
+    }
+
+    case MP3_STREAM_STATE_FRAMES: {
+        uint64_t left = parser->tag_end - parser->pos;
+        uint32_t header_size = ID3v2Tag_getFrameHeaderSize(&parser->tag);
+        if (left < header_size || (n > 0 && w[0] == 0)) {
+            // padding, footer or truncated frame, then maybe another tag
+            parser->skip = left;
+            parser->state = MP3_STREAM_STATE_HEADER;
+            return 1;
+        }
+        if (n < header_size) return 0;
+
+        memset(&parser->frame, 0, sizeof(ID3v2TagFrameHeader));
+        memcpy(&parser->frame, w, header_size);
+        uint32_t size = ID3v2Tag_getFrameSize(&parser->tag, &parser->frame);
+        if (size > left - header_size) size = (uint32_t)(left - header_size);
+        parser->frame_offset = parser->pos;
+        MP3Stream_drop(parser, header_size);
+
+        if (parser->want_frame != NULL && parser->want_frame(parser->user, &parser->tag, &parser->frame)) {
+            if (size > parser->frame_capacity) {
+                uint8_t* frame_data = (uint8_t*) realloc(parser->frame_data, size);
+                if (frame_data == NULL) return -1;
+                parser->frame_data = frame_data;
+                parser->frame_capacity = size;
+            }
+            parser->frame_len = 0;
+            parser->frame_need = size;
+            parser->state = MP3_STREAM_STATE_PAYLOAD;
+            return 1;
+        }
+
+        event.type = MP3_STREAM_FRAME;
+        event.offset = parser->frame_offset;
+        event.tag = &parser->tag;
+        event.frame = &parser->frame;
+        event.size = size;
+        parser->skip = size;
+        return MP3Stream_emit(parser, &event) ? 2 : 1;
+    }
+
+    case MP3_STREAM_STATE_PAYLOAD: {
+        uint32_t k = parser->frame_need - parser->frame_len;
+        if (k > n) k = n;
+        memcpy(parser->frame_data + parser->frame_len, w, k);
+        parser->frame_len += k;
+        MP3Stream_drop(parser, k);
+        if (parser->frame_len < parser->frame_need) return k > 0;
+
+        event.type = MP3_STREAM_FRAME;
+        event.offset = parser->frame_offset;
+        event.tag = &parser->tag;
+        event.frame = &parser->frame;
+        event.data = parser->frame_data;
+        event.size = parser->frame_len;
+        parser->state = MP3_STREAM_STATE_FRAMES;
+        return MP3Stream_emit(parser, &event) ? 2 : 1;
+    }
+
+    case MP3_STREAM_STATE_AUDIO: {
+        if (n == 0) return 0;
+        if (w[0] != 0xFF) {
+            // resync on the next 0xFF
+            const uint8_t* p = (const uint8_t*) memchr(w, 0xFF, n);
+            MP3Stream_drop(parser, p ? (uint32_t)(p - w) : n);
+            return 1;
+        }
+        if (n < 4) return final ? (MP3Stream_drop(parser, n), 1) : 0;
+
+        uint32_t h = MP3_readBE32(w), samples, frequency;
+        uint32_t size = MP3_decodeFrameHeader(h, &samples, &frequency);
+        if (size != 0) {
+            // need the next header too, unless the stream ends first
+            if (n < size + 4 && !final) return 0;
+            int valid = size <= n;
+            if (valid && size + 4 <= n) {
+                uint32_t next = MP3_readBE32(w + size), next_samples, next_frequency;
+                valid = ((next & 0xFFFE0C00) == (h & 0xFFFE0C00) && MP3_decodeFrameHeader(next, &next_samples, &next_frequency) != 0) ||
+                        memcmp(w + size, "TAG", 3) == 0 || memcmp(w + size, "ID3", 3) == 0;
+            }
+            if (valid) {
+                event.type = MP3_STREAM_AUDIO_FRAME;
+                event.offset = parser->pos;
+                event.size = size;
+                event.samples = samples;
+                parser->skip = size;
+                return MP3Stream_emit(parser, &event) ? 2 : 1;
+            }
+        }
+        MP3Stream_drop(parser, 1);
+        return 1;
+    }
+    }
+    return -1;
+}
+
+// Run step until it needs data, returns 0, 1 if stopped, -1 on error
+static int MP3Stream_run(MP3StreamParser* parser, int final) {
+    int r;
+    while ((r = MP3Stream_step(parser, final)) == 1) {}
+    if (r == 2) return 1;
+    return r;
+}
+
+// Feed the next chunk, returns 0 to continue, 1 if a callback stopped, -1 on error
+int MP3StreamParser_feed(MP3StreamParser* parser, const uint8_t* data, size_t len) {
+    // keep the last bytes for ID3v1
+    if (len >= sizeof(parser->tail)) {
+        memcpy(parser->tail, data + len - sizeof(parser->tail), sizeof(parser->tail));
+    } else {
+        memmove(parser->tail, parser->tail + len, sizeof(parser->tail) - len);
+        memcpy(parser->tail + sizeof(parser->tail) - len, data, len);
+    }
+    parser->total += len;
+
+    while (len > 0) {
+        if (parser->window_len == 0) {
+            // skipped and requested bytes go straight from the input
+            if (parser->skip > 0) {
+                size_t k = parser->skip < len ? (size_t) parser->skip : len;
+                parser->skip -= k;
+                parser->pos += k;
+                data += k;
+                len -= k;
+                continue;
+            }
+            if (parser->state == MP3_STREAM_STATE_PAYLOAD && parser->frame_len < parser->frame_need) {
+                size_t k = parser->frame_need - parser->frame_len;
+                if (k > len) k = len;
+                memcpy(parser->frame_data + parser->frame_len, data, k);
+                parser->frame_len += k;
+                parser->pos += k;
+                data += k;
+                len -= k;
+                if (parser->frame_len < parser->frame_need) continue;
+            }
+        }
+
+        size_t k = MP3_STREAM_WINDOW - parser->window_len;
+        if (k > len) k = len;
+        memcpy(parser->window + parser->window_len, data, k);
+        parser->window_len += k;
+        data += k;
+        len -= k;
+
+        int r = MP3Stream_run(parser, 0);
+        if (r != 0) return r;
+        if (parser->window_len == MP3_STREAM_WINDOW) return -1; // can't make progress
+    }
+
+    // a completed payload may still be waiting for its event
+    return MP3Stream_run(parser, 0);
+}
+
+// End of stream: flush the window and report ID3v1
+int MP3StreamParser_finish(MP3StreamParser* parser) {
+    int r = MP3Stream_run(parser, 1);
+    if (r != 0) return r;
+
+    if (parser->total >= sizeof(ID3v1Tag) && memcmp(parser->tail, "TAG", 3) == 0) {
+        MP3StreamEvent event;
+        memset(&event, 0, sizeof(event));
+        event.type = MP3_STREAM_ID3V1;
+        event.offset = parser->total - sizeof(ID3v1Tag);
+        event.id3v1 = (const ID3v1Tag*) parser->tail;
+        return MP3Stream_emit(parser, &event);
+    }
+    return 0;
+}
+
+
+
+
+
+/*
+    Records and batch scanner
+*/
+
+// Fill record from the first ID3v2 tag, ID3v1 and the audio headers
+int MP3Reader_getRecord(MP3Reader* reader, MP3Record* record) {
+    MP3_STATS_TIME(MP3_STAGE_RECORD);
+    memset(record, 0, sizeof(MP3Record));
+    if (reader == NULL || reader->data == NULL) return -1;
+
+    record->file_size = reader->file_size;
+    record->id3v1 = MP3Reader_getID3v1Tag(reader);
+    MP3Reader_getDuration(reader, &record->duration_ms);
+
+    ID3v2TagIter tags;
+    ID3v2TagIter_init(&tags, reader, MP3_TAGSCAN_SPEC);
+    ID3v2TagHeader* tag = ID3v2TagIter_next(&tags);
+    if (tag == NULL) return 0;
+    record->id3v2 = tag;
+
+    ID3v2FrameIter frames;
+    ID3v2FrameIter_init(&frames, reader, tag);
+    ID3v2TagFrameHeader* frame;
+    while ((frame = ID3v2FrameIter_next(&frames)) != NULL) {
+        MP3_TextData* field = NULL;
+        switch (ID3v2Tag_getFrameId(tag, frame)) {
+            case MP3_FRAME_TIT2: field = &record->title; break;
+            case MP3_FRAME_TPE1: field = &record->artist; break;
+            case MP3_FRAME_TALB: field = &record->album; break;
+            case MP3_FRAME_TYER:
+            case MP3_FRAME_TDRC: field = &record->year; break;
+            case MP3_FRAME_TRCK: field = &record->track; break;
+            case MP3_FRAME_APIC:
+                if (!record->has_picture && MP3Reader_readFramePicture(reader, tag, frame, &record->picture) == 0) {
+                    record->has_picture = 1;
+                    if (record->picture.data >= reader->data && record->picture.data < reader->data + reader->head_size) {
+                        record->picture_offset = record->picture.data - reader->data;
+                    }
+                }
+                break;
+        }
+
+        if (field != NULL && field->len == 0 && MP3Reader_readFrameText(reader, tag, frame, field) != 0) {
+            memset(field, 0, sizeof(MP3_TextData));
+        }
+    }
+    return 0;
+}
+
+
+void MP3ScanOptions_init(MP3ScanOptions* options) {
+    memset(options, 0, sizeof(MP3ScanOptions));
+}
+
+
+#define MP3_XXH_P1 0x9E3779B185EBCA87ULL
+#define MP3_XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define MP3_XXH_P3 0x165667B19E3779F9ULL
+#define MP3_XXH_P4 0x85EBCA77C2B2AE63ULL
+#define MP3_XXH_P5 0x27D4EB2F165667C5ULL
+
+static uint64_t MP3_rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t MP3_readLE64(const uint8_t* p) {
+    uint64_t w = MP3_load64(p);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    w = __builtin_bswap64(w);
+#endif
+    return w;
+}
+
+static uint64_t MP3_xxhRound(uint64_t acc, uint64_t input) {
+    acc += input * MP3_XXH_P2;
+    return MP3_rotl64(acc, 31) * MP3_XXH_P1;
+}
+
+static uint64_t MP3_xxhMerge(uint64_t acc, uint64_t v) {
+    acc ^= MP3_xxhRound(0, v);
+    return acc * MP3_XXH_P1 + MP3_XXH_P4;
+}
+
+void MP3Hash64_init(MP3Hash64* state, uint64_t seed) {
+    state->v[0] = seed + MP3_XXH_P1 + MP3_XXH_P2;
+    state->v[1] = seed + MP3_XXH_P2;
+    state->v[2] = seed;
+    state->v[3] = seed - MP3_XXH_P1;
+    state->seed = seed;
+    state->total = 0;
+    state->tail_size = 0;
+}
+
+// Four independent lanes over 32-byte stripes, returns the bytes consumed
+static size_t MP3Hash64_stripes(MP3Hash64* state, const uint8_t* p, size_t len) {
+    uint64_t v1 = state->v[0], v2 = state->v[1], v3 = state->v[2], v4 = state->v[3];
+    const uint8_t* start = p;
+    const uint8_t* end = p + (len & ~(size_t) 31);
+    while (p < end) {
+        v1 = MP3_xxhRound(v1, MP3_readLE64(p));
+        v2 = MP3_xxhRound(v2, MP3_readLE64(p + 8));
+        v3 = MP3_xxhRound(v3, MP3_readLE64(p + 16));
+        v4 = MP3_xxhRound(v4, MP3_readLE64(p + 24));
+        p += 32;
+    }
+    state->v[0] = v1;
+    state->v[1] = v2;
+    state->v[2] = v3;
+    state->v[3] = v4;
+    return p - start;
+}
+
+void MP3Hash64_update(MP3Hash64* state, const void* data, size_t len) {
+    const uint8_t* p = (const uint8_t*) data;
+    state->total += len;
+
+    // complete a buffered stripe first
+    if (state->tail_size > 0) {
+        size_t fill = 32 - state->tail_size < len ? 32 - state->tail_size : len;
+        memcpy(state->tail + state->tail_size, p, fill);
+        state->tail_size += (uint32_t) fill;
+        p += fill;
+        len -= fill;
+        if (state->tail_size < 32) return;
+        MP3Hash64_stripes(state, state->tail, 32);
+        state->tail_size = 0;
+    }
+
+    size_t done = MP3Hash64_stripes(state, p, len);
+    memcpy(state->tail, p + done, len - done);
+    state->tail_size = (uint32_t)(len - done);
+}
+
+uint64_t MP3Hash64_final(const MP3Hash64* state) {
+    const uint8_t* p = state->tail;
+    const uint8_t* end = p + state->tail_size;
+    uint64_t h;
+
+    if (state->total >= 32) {
+        uint64_t v1 = state->v[0], v2 = state->v[1], v3 = state->v[2], v4 = state->v[3];
+        h = MP3_rotl64(v1, 1) + MP3_rotl64(v2, 7) + MP3_rotl64(v3, 12) + MP3_rotl64(v4, 18);
+        h = MP3_xxhMerge(h, v1);
+        h = MP3_xxhMerge(h, v2);
+        h = MP3_xxhMerge(h, v3);
+        h = MP3_xxhMerge(h, v4);
+    } else {
+        h = state->seed + MP3_XXH_P5;
+    }
+    h += state->total;
+
+    while (p + 8 <= end) {
+        h ^= MP3_xxhRound(0, MP3_readLE64(p));
+        h = MP3_rotl64(h, 27) * MP3_XXH_P1 + MP3_XXH_P4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        uint32_t w = (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+        h ^= (uint64_t) w * MP3_XXH_P1;
+        h = MP3_rotl64(h, 23) * MP3_XXH_P2 + MP3_XXH_P3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (uint64_t)(*p++) * MP3_XXH_P5;
+        h = MP3_rotl64(h, 11) * MP3_XXH_P1;
+    }
+
+    // avalanche
+    h ^= h >> 33;
+    h *= MP3_XXH_P2;
+    h ^= h >> 29;
+    h *= MP3_XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t MP3_hash64(const void* data, size_t len, uint64_t seed) {
+    MP3Hash64 state;
+    MP3Hash64_init(&state, seed);
+    MP3Hash64_update(&state, data, len);
+    return MP3Hash64_final(&state);
+}
+
+
+typedef struct MP3PictureCacheEntry {
+    uint64_t hash;               // 0 marks an empty slot
+    uint32_t size;
+    uint32_t id;
+} MP3PictureCacheEntry;
+
+// Open addressing table, grown at half load
+struct MP3PictureCache {
+    pthread_mutex_t lock;
+    MP3PictureCacheEntry* entries;
+    uint32_t capacity;           // Power of two
+    uint32_t count;
+};
+
+MP3PictureCache* MP3PictureCache_create(void) {
+    MP3PictureCache* cache = (MP3PictureCache*) malloc(sizeof(MP3PictureCache));
+    if (cache == NULL) {
+        printf("Failed to allocate memory for MP3PictureCache\n");
+        return NULL;
+    }
+    cache->capacity = 256;
+    cache->count = 0;
+    cache->entries = (MP3PictureCacheEntry*) calloc(cache->capacity, sizeof(MP3PictureCacheEntry));
+    if (cache->entries == NULL) {
+        printf("Failed to allocate memory for MP3PictureCache\n");
+        free(cache);
+        return NULL;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+void MP3PictureCache_destroy(MP3PictureCache* cache) {
+    if (cache == NULL) return;
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->entries);
+    free(cache);
+}
+
+static MP3PictureCacheEntry* MP3PictureCache_slot(MP3PictureCacheEntry* entries, uint32_t capacity, uint64_t hash, uint32_t size) {
+    uint32_t mask = capacity - 1;
+    uint32_t i = (uint32_t) hash & mask;
+    while (entries[i].hash != 0 && (entries[i].hash != hash || entries[i].size != size)) {
+        i = (i + 1) & mask;
+    }
+    return &entries[i];
+}
+
+static int MP3PictureCache_grow(MP3PictureCache* cache) {
+    uint32_t capacity = cache->capacity * 2;
+    MP3PictureCacheEntry* entries = (MP3PictureCacheEntry*) calloc(capacity, sizeof(MP3PictureCacheEntry));
+    if (entries == NULL) return -1;
+
+    for (uint32_t i = 0; i < cache->capacity; i++) {
+        if (cache->entries[i].hash == 0) continue;
+        *MP3PictureCache_slot(entries, capacity, cache->entries[i].hash, cache->entries[i].size) = cache->entries[i];
+    }
+    free(cache->entries);
+    cache->entries = entries;
+    cache->capacity = capacity;
+    return 0;
+}
+
+// Pictures are identified by hash and size, hashing runs outside the lock
+uint32_t MP3PictureCache_add(MP3PictureCache* cache, const MP3_Picture* picture, uint64_t* hash, int* is_new) {
+    MP3_STATS_TIME(MP3_STAGE_PICTURE);
+    uint64_t h = MP3_hash64(picture->data, picture->size, 0);
+    if (h == 0) h = 1;
+    if (hash != NULL) *hash = h;
+    return MP3PictureCache_addHash(cache, h, picture->size, is_new);
+}
+
+uint32_t MP3PictureCache_addHash(MP3PictureCache* cache, uint64_t h, uint32_t size, int* is_new) {
+    if (is_new != NULL) *is_new = 0;
+
+    pthread_mutex_lock(&cache->lock);
+    MP3PictureCacheEntry* entry = MP3PictureCache_slot(cache->entries, cache->capacity, h, size);
+    if (entry->hash == 0) {
+        if ((cache->count + 1) * 2 > cache->capacity) {
+            if (MP3PictureCache_grow(cache) != 0 && cache->count + 1 >= cache->capacity) {
+                pthread_mutex_unlock(&cache->lock);
+                return 0; // keep one free slot so probing terminates
+            }
+            entry = MP3PictureCache_slot(cache->entries, cache->capacity, h, size);
+        }
+        entry->hash = h;
+        entry->size = size;
+        entry->id = ++cache->count;
+        if (is_new != NULL) *is_new = 1;
+    }
+    uint32_t id = entry->id;
+    pthread_mutex_unlock(&cache->lock);
+    return id;
+}
+
+uint32_t MP3PictureCache_count(MP3PictureCache* cache) {
+    pthread_mutex_lock(&cache->lock);
+    uint32_t count = cache->count;
+    pthread_mutex_unlock(&cache->lock);
+    return count;
+}
+
+
+/*
+    Metadata cache
+    File layout: header, one array per column, string pool. Rows are sorted by (dev, ino)
+    so lookups binary search the two key columns and touch the rest for hits only.
+*/
+
+#define MP3_CACHE_MAGIC "MP3C"
+#define MP3_CACHE_VERSION 1
+
+// Pool strings, text as [encoding][bytes], ID3v1 as the raw 128 bytes
+enum {
+    MP3_CACHE_TITLE = 0,
+    MP3_CACHE_ARTIST,
+    MP3_CACHE_ALBUM,
+    MP3_CACHE_YEAR,
+    MP3_CACHE_TRACK,
+    MP3_CACHE_MIME,
+    MP3_CACHE_ID3V1,
+    MP3_CACHE_STRINGS
+};
+
+// Columns, 8-byte ones first
+enum {
+    MP3_CACHE_COL_DEV = 0,
+    MP3_CACHE_COL_INO,
+    MP3_CACHE_COL_SIZE,
+    MP3_CACHE_COL_MTIME,
+    MP3_CACHE_COL_HASH,                                               // picture_hash
+    MP3_CACHE_COL_DURATION,                                           // 4-byte columns from here
+    MP3_CACHE_COL_FLAGS,                                              // has_picture | picture_type << 8
+    MP3_CACHE_COL_PICTURE_OFFSET,
+    MP3_CACHE_COL_PICTURE_SIZE,
+    MP3_CACHE_COL_STRING,                                             // Pool offset of each string
+    MP3_CACHE_COL_LENGTH = MP3_CACHE_COL_STRING + MP3_CACHE_STRINGS,  // Length of each string, 0 if none
+    MP3_CACHE_COLUMNS = MP3_CACHE_COL_LENGTH + MP3_CACHE_STRINGS
+};
+
+typedef struct MP3CacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t count;                      // Rows
+    uint32_t pool_size;
+    uint64_t columns[MP3_CACHE_COLUMNS]; // File offset of each column
+    uint64_t pool;                       // File offset of the string pool
+} MP3CacheHeader;
+
+// Row collected for the next save, every column widened to 64 bits
+typedef struct MP3CacheRow {
+    uint64_t values[MP3_CACHE_COLUMNS];
+} MP3CacheRow;
+
+struct MP3Cache {
+    char* filename;
+    uint8_t* map;                        // Cache file of the last run, NULL if none
+    size_t map_size;
+    const MP3CacheHeader* header;
+
+    pthread_mutex_t lock;                // Guards rows and pool
+    MP3CacheRow* rows;
+    uint32_t count;
+    uint32_t capacity;
+    uint8_t* pool;
+    uint32_t pool_size;
+    uint32_t pool_capacity;
+};
+
+static uint32_t MP3Cache_width(int column) {
+    return column < MP3_CACHE_COL_DURATION ? 8 : 4;
+}
+
+static uint64_t MP3Cache_get(const MP3Cache* cache, int column, uint32_t row) {
+    const uint8_t* p = cache->map + cache->header->columns[column] + (size_t) row * MP3Cache_width(column);
+    if (MP3Cache_width(column) == 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+MP3Cache* MP3Cache_open(const char* filename) {
+    MP3Cache* cache = (MP3Cache*) calloc(1, sizeof(MP3Cache));
+    size_t len = strlen(filename);
+    if (cache == NULL || (cache->filename = (char*) malloc(len + 1)) == NULL) {
+        printf("Failed to allocate memory for MP3Cache\n");
+        free(cache);
+        return NULL;
+    }
+    memcpy(cache->filename, filename, len + 1);
+    pthread_mutex_init(&cache->lock, NULL);
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return cache; // first run
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(MP3CacheHeader)) {
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+            cache->map = (uint8_t*) map;
+            cache->map_size = st.st_size;
+        }
+    }
+    close(fd);
+    if (cache->map == NULL) return cache;
+
+    // every column and the pool must lie inside the file, checked without overflowing the offsets
+    const MP3CacheHeader* header = (const MP3CacheHeader*) cache->map;
+    uint64_t map_size = cache->map_size;
+    int valid = memcmp(header->magic, MP3_CACHE_MAGIC, 4) == 0 && header->version == MP3_CACHE_VERSION;
+    for (int i = 0; valid && i < MP3_CACHE_COLUMNS; i++) {
+        valid = header->columns[i] % MP3Cache_width(i) == 0 && header->columns[i] <= map_size &&
+                (uint64_t) header->count * MP3Cache_width(i) <= map_size - header->columns[i];
+    }
+    valid = valid && header->pool <= map_size && header->pool_size <= map_size - header->pool;
+    if (!valid) {
+        printf("Ignoring invalid cache file: %s\n", filename);
+        munmap(cache->map, cache->map_size);
+        cache->map = NULL;
+        return cache;
+    }
+    cache->header = header;
+    return cache;
+}
+
+void MP3Cache_close(MP3Cache* cache) {
+    if (cache == NULL) return;
+    if (cache->map != NULL) munmap(cache->map, cache->map_size);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->rows);
+    free(cache->pool);
+    free(cache->filename);
+    free(cache);
+}
+
+static void MP3Cache_statKey(const struct stat* st, MP3CacheKey* key) {
+    key->dev = (uint64_t) st->st_dev;
+    key->ino = (uint64_t) st->st_ino;
+    key->size = (uint64_t) st->st_size;
+#ifdef __APPLE__
+    key->mtime_ns = (int64_t) st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#else
+    key->mtime_ns = (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+int MP3Cache_getKey(const char* path, MP3CacheKey* key) {
+    struct stat st;
+    if (stat(path, &st) != 0) return -1;
+    MP3Cache_statKey(&st, key);
+    return 0;
+}
+
+// Pool bytes of string i in row, NULL if missing or out of range
+static const uint8_t* MP3Cache_string(const MP3Cache* cache, uint32_t row, int i, uint32_t* len) {
+    uint64_t offset = MP3Cache_get(cache, MP3_CACHE_COL_STRING + i, row);
+    *len = (uint32_t) MP3Cache_get(cache, MP3_CACHE_COL_LENGTH + i, row);
+    if (*len == 0 || offset + *len > cache->header->pool_size) return NULL;
+    return cache->map + cache->header->pool + offset;
+}
+
+int MP3Cache_lookup(MP3Cache* cache, const MP3CacheKey* key, MP3Record* record) {
+    if (cache == NULL || cache->header == NULL) return -1;
+
+    // first row with (dev, ino) >= key
+    uint32_t lo = 0, hi = cache->header->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        uint64_t dev = MP3Cache_get(cache, MP3_CACHE_COL_DEV, mid);
+        uint64_t ino = MP3Cache_get(cache, MP3_CACHE_COL_INO, mid);
+        if (dev < key->dev || (dev == key->dev && ino < key->ino)) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == cache->header->count || MP3Cache_get(cache, MP3_CACHE_COL_DEV, lo) != key->dev ||
+        MP3Cache_get(cache, MP3_CACHE_COL_INO, lo) != key->ino || MP3Cache_get(cache, MP3_CACHE_COL_SIZE, lo) != key->size ||
+        (int64_t) MP3Cache_get(cache, MP3_CACHE_COL_MTIME, lo) != key->mtime_ns) {
+        return -1;
+    }
+
+    memset(record, 0, sizeof(MP3Record));
+    record->cached = 1;
+    record->file_size = (uint32_t) key->size;
+    record->duration_ms = (uint32_t) MP3Cache_get(cache, MP3_CACHE_COL_DURATION, lo);
+
+    uint32_t flags = (uint32_t) MP3Cache_get(cache, MP3_CACHE_COL_FLAGS, lo);
+    record->has_picture = flags & 1;
+    record->picture.picture_type = (uint8_t)(flags >> 8);
+    record->picture.size = (uint32_t) MP3Cache_get(cache, MP3_CACHE_COL_PICTURE_SIZE, lo);
+    record->picture_offset = (uint32_t) MP3Cache_get(cache, MP3_CACHE_COL_PICTURE_OFFSET, lo);
+    record->picture_hash = MP3Cache_get(cache, MP3_CACHE_COL_HASH, lo);
+
+    MP3_TextData* fields[5] = { &record->title, &record->artist, &record->album, &record->year, &record->track };
+    for (int i = 0; i < 5; i++) {
+        uint32_t len;
+        const uint8_t* p = MP3Cache_string(cache, lo, MP3_CACHE_TITLE + i, &len);
+        if (p == NULL || len < 2) continue;
+        fields[i]->encoding = p[0];
+        fields[i]->data = (char*)(p + 1);
+        fields[i]->len = len - 1;
+    }
+
+    uint32_t len;
+    const uint8_t* p = MP3Cache_string(cache, lo, MP3_CACHE_MIME, &len);
+    if (p != NULL && len > 1) {
+        if (len > sizeof(record->picture.mime_type)) len = sizeof(record->picture.mime_type);
+        memcpy(record->picture.mime_type, p + 1, len - 1);
+    }
+    p = MP3Cache_string(cache, lo, MP3_CACHE_ID3V1, &len);
+    if (p != NULL && len == sizeof(ID3v1Tag)) record->id3v1 = (const ID3v1Tag*) p;
+    return 0;
+}
+
+// Append a pool string under the lock, sets its offset and length in row
+static int MP3Cache_addString(MP3Cache* cache, MP3CacheRow* row, int i, int encoding, const void* data, uint32_t len) {
+    uint32_t total = len + (encoding >= 0 ? 1 : 0);
+    if (data == NULL || len == 0) return 0;
+    if (cache->pool_size + total > cache->pool_capacity) {
+        uint32_t capacity = cache->pool_capacity ? cache->pool_capacity * 2 : 64 * 1024;
+        while (capacity < cache->pool_size + total) capacity *= 2;
+        uint8_t* pool = (uint8_t*) realloc(cache->pool, capacity);
+        if (pool == NULL) return -1;
+        cache->pool = pool;
+        cache->pool_capacity = capacity;
+    }
+
+    uint8_t* p = cache->pool + cache->pool_size;
+    if (encoding >= 0) *p++ = (uint8_t) encoding;
+    memcpy(p, data, len);
+    row->values[MP3_CACHE_COL_STRING + i] = cache->pool_size;
+    row->values[MP3_CACHE_COL_LENGTH + i] = total;
+    cache->pool_size += total;
+    return 0;
+}
+
+int MP3Cache_add(MP3Cache* cache, const MP3CacheKey* key, const MP3Record* record) {
+    MP3CacheRow row;
+    memset(&row, 0, sizeof(row));
+    row.values[MP3_CACHE_COL_DEV] = key->dev;
+    row.values[MP3_CACHE_COL_INO] = key->ino;
+    row.values[MP3_CACHE_COL_SIZE] = key->size;
+    row.values[MP3_CACHE_COL_MTIME] = (uint64_t) key->mtime_ns;
+    row.values[MP3_CACHE_COL_HASH] = record->picture_hash;
+    row.values[MP3_CACHE_COL_DURATION] = record->duration_ms;
+    row.values[MP3_CACHE_COL_FLAGS] = (record->has_picture ? 1 : 0) | ((uint32_t) record->picture.picture_type << 8);
+    row.values[MP3_CACHE_COL_PICTURE_OFFSET] = record->picture_offset;
+    row.values[MP3_CACHE_COL_PICTURE_SIZE] = record->has_picture ? record->picture.size : 0;
+
+    pthread_mutex_lock(&cache->lock);
+    int result = 0;
+    if (cache->count == cache->capacity) {
+        uint32_t capacity = cache->capacity ? cache->capacity * 2 : 1024;
+        MP3CacheRow* rows = (MP3CacheRow*) realloc(cache->rows, capacity * sizeof(MP3CacheRow));
+        if (rows == NULL) result = -1;
+        else {
+            cache->rows = rows;
+            cache->capacity = capacity;
+        }
+    }
+
+    const MP3_TextData* fields[5] = { &record->title, &record->artist, &record->album, &record->year, &record->track };
+    for (int i = 0; result == 0 && i < 5; i++) {
+        result = MP3Cache_addString(cache, &row, MP3_CACHE_TITLE + i, fields[i]->encoding, fields[i]->data, fields[i]->len);
+    }
+    if (result == 0 && record->has_picture) {
+        result = MP3Cache_addString(cache, &row, MP3_CACHE_MIME, 0, record->picture.mime_type, (uint32_t) strlen((const char*) record->picture.mime_type));
+    }
+    if (result == 0 && record->id3v1 != NULL) {
+        result = MP3Cache_addString(cache, &row, MP3_CACHE_ID3V1, -1, record->id3v1, sizeof(ID3v1Tag));
+    }
+    if (result == 0) cache->rows[cache->count++] = row;
+    pthread_mutex_unlock(&cache->lock);
+    return result;
+}
+
+static int MP3Cache_compareRows(const void* a, const void* b) {
+    const MP3CacheRow* x = (const MP3CacheRow*) a;
+    const MP3CacheRow* y = (const MP3CacheRow*) b;
+    for (int i = MP3_CACHE_COL_DEV; i <= MP3_CACHE_COL_INO; i++) {
+        if (x->values[i] != y->values[i]) return x->values[i] < y->values[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+// Write the collected rows next to the cache file and rename it into place
+int MP3Cache_save(MP3Cache* cache) {
+    if (cache == NULL) return -1;
+    pthread_mutex_lock(&cache->lock);
+    qsort(cache->rows, cache->count, sizeof(MP3CacheRow), MP3Cache_compareRows);
+
+    MP3CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MP3_CACHE_MAGIC, 4);
+    header.version = MP3_CACHE_VERSION;
+    header.count = cache->count;
+    header.pool_size = cache->pool_size;
+    uint64_t offset = sizeof(MP3CacheHeader);
+    for (int i = 0; i < MP3_CACHE_COLUMNS; i++) {
+        header.columns[i] = offset;
+        offset += (uint64_t) cache->count * MP3Cache_width(i);
+    }
+    header.pool = offset;
+
+    size_t len = strlen(cache->filename);
+    char* tmp = (char*) malloc(len + 5);
+    FILE* file = NULL;
+    if (tmp != NULL) {
+        memcpy(tmp, cache->filename, len);
+        memcpy(tmp + len, ".tmp", 5);
+        file = fopen(tmp, "wb");
+    }
+    if (file == NULL) {
+        printf("Failed to write cache file: %s\n", cache->filename);
+        pthread_mutex_unlock(&cache->lock);
+        free(tmp);
+        return -1;
+    }
+
+    // columns are gathered through a small buffer, one fwrite per chunk
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    uint8_t chunk[8 * 1024];
+    for (int i = 0; ok && i < MP3_CACHE_COLUMNS; i++) {
+        uint32_t width = MP3Cache_width(i);
+        uint32_t used = 0;
+        for (uint32_t r = 0; ok && r < cache->count; r++) {
+            if (width == 8) {
+                memcpy(chunk + used, &cache->rows[r].values[i], 8);
+            } else {
+                uint32_t v = (uint32_t) cache->rows[r].values[i];
+                memcpy(chunk + used, &v, 4);
+            }
+            used += width;
+            if (used == sizeof(chunk) || r + 1 == cache->count) {
+                ok = fwrite(chunk, 1, used, file) == used;
+                used = 0;
+            }
+        }
+    }
+    ok = ok && (cache->pool_size == 0 || fwrite(cache->pool, 1, cache->pool_size, file) == cache->pool_size);
+    ok = (fclose(file) == 0) && ok;
+    ok = ok && rename(tmp, cache->filename) == 0;
+    if (!ok) {
+        printf("Failed to write cache file: %s\n", cache->filename);
+        unlink(tmp);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    free(tmp);
+    return ok ? 0 : -1;
+}
+
+
+/*
+    Record writer
+    Fields go straight into a growable per-worker buffer, JSON strings are escaped
+    8 bytes at a time and only words holding a quote, backslash or control byte
+    are looked at byte by byte.
+*/
+
+#ifndef MP3_WRITER_BUFFER_SIZE
+#define MP3_WRITER_BUFFER_SIZE (256 * 1024)
+#endif
+#define MP3_WRITER_MAX_WORKERS 256
+
+typedef struct MP3WriterBuffer {
+    char* data;
+    uint32_t size;
+    uint32_t capacity;
+    char* scratch;      // UTF-8 text before escaping
+    uint32_t scratch_capacity;
+} MP3WriterBuffer;
+
+struct MP3Writer {
+    int fd;
+    int format;
+    int failed;
+    pthread_mutex_t lock; // Serializes writes to fd
+    MP3WriterBuffer* buffers[MP3_WRITER_MAX_WORKERS];
+};
+
+MP3Writer* MP3Writer_create(int fd, int format) {
+    MP3Writer* writer = (MP3Writer*) calloc(1, sizeof(MP3Writer));
+    if (writer == NULL) {
+        printf("Failed to allocate memory for MP3Writer\n");
+        return NULL;
+    }
+    writer->fd = fd;
+    writer->format = format;
+    pthread_mutex_init(&writer->lock, NULL);
+    return writer;
+}
+
+static int MP3Writer_reserve(char** data, uint32_t* capacity, uint32_t size) {
+    if (size <= *capacity) return 0;
+    uint32_t n = *capacity ? *capacity : MP3_WRITER_BUFFER_SIZE;
+    while (n < size) n *= 2;
+    char* p = (char*) realloc(*data, n);
+    if (p == NULL) return -1;
+    *data = p;
+    *capacity = n;
+    return 0;
+}
+
+static int MP3Writer_flushBuffer(MP3Writer* writer, MP3WriterBuffer* buffer) {
+    pthread_mutex_lock(&writer->lock);
+    uint32_t pos = 0;
+    while (pos < buffer->size && !writer->failed) {
+        ssize_t n = write(writer->fd, buffer->data + pos, buffer->size - pos);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) writer->failed = 1;
+        else pos += (uint32_t) n;
+    }
+    int failed = writer->failed;
+    pthread_mutex_unlock(&writer->lock);
+    buffer->size = 0;
+    return failed ? -1 : 0;
+}
+
+int MP3Writer_flush(MP3Writer* writer) {
+    if (writer == NULL) return -1;
+    int result = 0;
+    for (int i = 0; i < MP3_WRITER_MAX_WORKERS; i++) {
+        if (writer->buffers[i] != NULL && writer->buffers[i]->size > 0 && MP3Writer_flushBuffer(writer, writer->buffers[i]) != 0) {
+            result = -1;
+        }
+    }
+    return writer->failed ? -1 : result;
+}
+
+void MP3Writer_destroy(MP3Writer* writer) {
+    if (writer == NULL) return;
+    for (int i = 0; i < MP3_WRITER_MAX_WORKERS; i++) {
+        if (writer->buffers[i] == NULL) continue;
+        free(writer->buffers[i]->data);
+        free(writer->buffers[i]->scratch);
+        free(writer->buffers[i]);
+    }
+    pthread_mutex_destroy(&writer->lock);
+    free(writer);
+}
+
+// Appenders, space is reserved by the caller
+static char* MP3Writer_putBytes(char* out, const void* data, uint32_t len) {
+    memcpy(out, data, len);
+    return out + len;
+}
+
+static char* MP3Writer_putNumber(char* out, uint64_t value) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    while (n > 0) *out++ = digits[--n];
+    return out;
+}
+
+static char* MP3Writer_putU32(char* out, uint32_t value) {
+    memcpy(out, &value, sizeof(value));
+    return out + sizeof(value);
+}
+
+// JSON string contents, at most 6 output bytes per input byte
+static char* MP3Writer_putEscaped(char* out, const char* in, uint32_t len) {
+    static const char hex[] = "0123456789abcdef";
+    const uint64_t ones = 0x0101010101010101ULL, highs = 0x8080808080808080ULL;
+    uint32_t i = 0;
+    while (i < len) {
+        if (i + 8 <= len) {
+            uint64_t x;
+            memcpy(&x, in + i, 8);
+            uint64_t quote = x ^ (ones * '"'), slash = x ^ (ones * '\\');
+            uint64_t special = ((x - ones * 0x20) & ~x) | ((quote - ones) & ~quote) | ((slash - ones) & ~slash);
+            if ((special & highs) == 0) {
+                memcpy(out, in + i, 8);
+                out += 8;
+                i += 8;
+                continue;
+            }
+        }
+
+        // bytes of a word with something to escape, or the tail
+        uint32_t end = i + 8 < len ? i + 8 : len;
+        for (; i < end; i++) {
+            uint8_t c = (uint8_t) in[i];
+            if (c == '"' || c == '\\') {
+                *out++ = '\\';
+                *out++ = (char) c;
+            } else if (c < 0x20) {
+                *out++ = '\\';
+                switch (c) {
+                case '\n': *out++ = 'n'; break;
+                case '\r': *out++ = 'r'; break;
+                case '\t': *out++ = 't'; break;
+                default:
+                    *out++ = 'u'; *out++ = '0'; *out++ = '0';
+                    *out++ = hex[c >> 4];
+                    *out++ = hex[c & 15];
+                }
+            } else {
+                *out++ = (char) c;
+            }
+        }
+    }
+    return out;
+}
+
+// Text field as UTF-8 in the buffer's scratch area, length or 0 if empty
+static uint32_t MP3Writer_utf8(MP3WriterBuffer* buffer, const MP3_TextData* text, const char** utf8) {
+    *utf8 = "";
+    if (text->len == 0) return 0;
+    // ISO-8859-1 doubles at most, UTF-16 grows by half
+    if (MP3Writer_reserve(&buffer->scratch, &buffer->scratch_capacity, text->len * 2 + 1) != 0) return 0;
+    int n = MP3_TextData_toUTF8(text, buffer->scratch, buffer->scratch_capacity);
+    if (n <= 0) return 0;
+    *utf8 = buffer->scratch;
+    return (uint32_t) n;
+}
+
+static const char* const MP3Writer_names[] = { "title", "artist", "album", "year", "track" };
+
+int MP3Writer_write(MP3Writer* writer, int worker, const MP3Record* record) {
+    if (writer == NULL || record == NULL || worker < 0 || worker >= MP3_WRITER_MAX_WORKERS) return -1;
+    MP3WriterBuffer* buffer = writer->buffers[worker];
+    if (buffer == NULL) {
+        buffer = (MP3WriterBuffer*) calloc(1, sizeof(MP3WriterBuffer));
+        if (buffer == NULL) return -1;
+        writer->buffers[worker] = buffer;
+    }
+
+    const MP3_TextData* fields[5] = { &record->title, &record->artist, &record->album, &record->year, &record->track };
+    const char* path = record->path != NULL ? record->path : "";
+    uint32_t path_len = (uint32_t) strlen(path);
+    const char* mime = record->has_picture ? (const char*) record->picture.mime_type : "";
+    uint32_t mime_len = (uint32_t) strnlen(mime, sizeof(record->picture.mime_type));
+
+    // worst case before the text fields: the escaped path plus fixed keys and numbers
+    uint32_t need = path_len * 6 + 256;
+    if (MP3Writer_reserve(&buffer->data, &buffer->capacity, buffer->size + need) != 0) return -1;
+    char* out = buffer->data + buffer->size;
+    char* start = out;
+
+    if (writer->format == MP3_WRITER_JSON) {
+        out = MP3Writer_putBytes(out, "{\"path\":\"", 9);
+        out = MP3Writer_putEscaped(out, path, path_len);
+        *out++ = '"';
+    } else if (writer->format == MP3_WRITER_BINARY) {
+        out += 4; // size, set at the end
+        out = MP3Writer_putU32(out, record->file_size);
+        out = MP3Writer_putU32(out, record->duration_ms);
+        out = MP3Writer_putU32(out, record->has_picture ? record->picture.size : 0);
+        out = MP3Writer_putU32(out, record->picture_offset);
+        out = MP3Writer_putU32(out, record->picture_id);
+        *out++ = (char) (record->has_picture ? record->picture.picture_type : 0);
+        *out++ = (char) (record->cached != 0);
+        *out++ = 0;
+        *out++ = 0;
+        out = MP3Writer_putU32(out, path_len);
+        out = MP3Writer_putBytes(out, path, path_len);
+    } else {
+        out = MP3Writer_putBytes(out, path, path_len);
+    }
+
+    for (int i = 0; i < 5; i++) {
+        const char* utf8;
+        uint32_t len = MP3Writer_utf8(buffer, fields[i], &utf8);
+        uint32_t offset = (uint32_t)(out - buffer->data);
+        if (MP3Writer_reserve(&buffer->data, &buffer->capacity, offset + len * 6 + 256) != 0) return -1;
+        start = buffer->data + buffer->size;
+        out = buffer->data + offset;
+
+        if (writer->format == MP3_WRITER_JSON) {
+            *out++ = ',';
+            *out++ = '"';
+            out = MP3Writer_putBytes(out, MP3Writer_names[i], (uint32_t) strlen(MP3Writer_names[i]));
+            out = MP3Writer_putBytes(out, "\":\"", 3);
+            out = MP3Writer_putEscaped(out, utf8, len);
+            *out++ = '"';
+        } else if (writer->format == MP3_WRITER_BINARY) {
+            out = MP3Writer_putU32(out, len);
+            out = MP3Writer_putBytes(out, utf8, len);
+        } else {
+            *out++ = '\t';
+            out = MP3Writer_putBytes(out, utf8, len);
+        }
+    }
+
+    uint32_t offset = (uint32_t)(out - buffer->data);
+    if (MP3Writer_reserve(&buffer->data, &buffer->capacity, offset + mime_len * 6 + 256) != 0) return -1;
+    start = buffer->data + buffer->size;
+    out = buffer->data + offset;
+    if (writer->format == MP3_WRITER_JSON) {
+        out = MP3Writer_putBytes(out, ",\"duration_ms\":", 15);
+        out = MP3Writer_putNumber(out, record->duration_ms);
+        out = MP3Writer_putBytes(out, ",\"file_size\":", 13);
+        out = MP3Writer_putNumber(out, record->file_size);
+        if (record->has_picture) {
+            // the MIME type is ISO-8859-1 in the frame, JSON text has to be UTF-8
+            char mime_utf8[2 * sizeof(record->picture.mime_type)];
+            int mime_utf8_len = MP3_latin1ToUTF8((const uint8_t*) mime, mime_len, mime_utf8, sizeof(mime_utf8));
+            out = MP3Writer_putBytes(out, ",\"picture\":{\"mime\":\"", 20);
+            out = MP3Writer_putEscaped(out, mime_utf8, mime_utf8_len > 0 ? (uint32_t) mime_utf8_len : 0);
+            out = MP3Writer_putBytes(out, "\",\"type\":", 9);
+            out = MP3Writer_putNumber(out, record->picture.picture_type);
+            out = MP3Writer_putBytes(out, ",\"size\":", 8);
+            out = MP3Writer_putNumber(out, record->picture.size);
+            out = MP3Writer_putBytes(out, ",\"offset\":", 10);
+            out = MP3Writer_putNumber(out, record->picture_offset);
+            out = MP3Writer_putBytes(out, ",\"id\":", 6);
+            out = MP3Writer_putNumber(out, record->picture_id);
+            *out++ = '}';
+        }
+        if (record->cached) out = MP3Writer_putBytes(out, ",\"cached\":true", 14);
+        *out++ = '}';
+        *out++ = '\n';
+    } else if (writer->format == MP3_WRITER_BINARY) {
+        out = MP3Writer_putU32(out, mime_len);
+        out = MP3Writer_putBytes(out, mime, mime_len);
+        MP3Writer_putU32(start, (uint32_t)(out - start - 4));
+    } else {
+        *out++ = '\t';
+        out = MP3Writer_putNumber(out, record->duration_ms);
+        *out++ = '\n';
+    }
+
+    buffer->size = (uint32_t)(out - buffer->data);
+    if (buffer->size >= MP3_WRITER_BUFFER_SIZE) return MP3Writer_flushBuffer(writer, buffer);
+    return writer->failed ? -1 : 0;
+}
+
+
+typedef struct MP3ScanTask {
+    char* path;
+    int is_dir;
+} MP3ScanTask;
+
+// Per-worker deque: the owner pushes and pops at the tail, thieves take from the head
+typedef struct MP3ScanQueue {
+    pthread_mutex_t lock;
+    MP3ScanTask* tasks;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t capacity;
+} MP3ScanQueue;
+
+typedef struct MP3Scanner {
+    const MP3ScanOptions* options;
+    MP3ScanQueue* queues;
+    int threads;
+    long pending;                // Queued or running tasks
+    long files;                  // Files reported
+    int stop;
+} MP3Scanner;
+
+typedef struct MP3ScanWorker {
+    MP3Scanner* scanner;
+    int id;
+    pthread_t thread;
+    MP3Reader* reader;
+    MP3Arena* arena;
+} MP3ScanWorker;
+
+
+static int MP3ScanQueue_push(MP3ScanQueue* q, char* path, int is_dir) {
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == q->capacity) {
+        if (q->head > 0) {
+            // compact before growing
+            memmove(q->tasks, q->tasks + q->head, (q->tail - q->head) * sizeof(MP3ScanTask));
+            q->tail -= q->head;
+            q->head = 0;
+        } else {
+            uint32_t new_cap = q->capacity == 0 ? 64 : q->capacity * 2;
+            MP3ScanTask* tasks = (MP3ScanTask*) realloc(q->tasks, new_cap * sizeof(MP3ScanTask));
+            if (tasks == NULL) {
+                pthread_mutex_unlock(&q->lock);
+                return -1;
+            }
+            q->tasks = tasks;
+            q->capacity = new_cap;
+        }
+    }
+    q->tasks[q->tail].path = path;
+    q->tasks[q->tail].is_dir = is_dir;
+    q->tail++;
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+static int MP3ScanQueue_pop(MP3ScanQueue* q, MP3ScanTask* task, int steal) {
+    int found = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) {
+        *task = steal ? q->tasks[q->head++] : q->tasks[--q->tail];
+        if (q->head == q->tail) q->head = q->tail = 0;
+        found = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+static void MP3Scan_push(MP3Scanner* scanner, int worker, char* path, int is_dir) {
+    __atomic_add_fetch(&scanner->pending, 1, __ATOMIC_SEQ_CST);
+    if (MP3ScanQueue_push(&scanner->queues[worker], path, is_dir) != 0) {
+        free(path);
+        __atomic_sub_fetch(&scanner->pending, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static int MP3Scan_isMP3(const char* name) {
+    size_t len = strlen(name);
+    if (len < 4 || name[len - 4] != '.') return 0;
+    const char* ext = name + len - 3;
+    return (ext[0] | 0x20) == 'm' && (ext[1] | 0x20) == 'p' && ext[2] == '3';
+}
+
+// List a directory, subdirectories and mp3 files go to this worker's queue
+static void MP3Scan_directory(MP3Scanner* scanner, int worker, const char* path) {
+    DIR* dir = opendir(path);
+    if (dir == NULL) return;
+
+    size_t path_len = strlen(path);
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char* name = entry->d_name;
+        if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0))) continue;
+
+        size_t name_len = strlen(name);
+        char* child = (char*) malloc(path_len + name_len + 2);
+        if (child == NULL) break;
+        memcpy(child, path, path_len);
+        child[path_len] = '/';
+        memcpy(child + path_len + 1, name, name_len + 1);
+
+        int is_dir = 0, is_file = 0;
+        if (entry->d_type == DT_DIR) is_dir = 1;
+        else if (entry->d_type == DT_REG) is_file = 1;
+        else if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+            struct stat st;
+            if (stat(child, &st) == 0) {
+                is_dir = S_ISDIR(st.st_mode);
+                is_file = S_ISREG(st.st_mode);
+            }
+        }
+
+        if (is_dir || (is_file && MP3Scan_isMP3(name))) {
+            MP3Scan_push(scanner, worker, child, is_dir);
+        } else {
+            free(child);
+        }
+    }
+    closedir(dir);
+}
+
+// Report a record, loaded or cached, and keep it for the next cache file
+static void MP3Scan_emit(MP3ScanWorker* worker, MP3Record* record, const MP3CacheKey* key) {
+    MP3Scanner* scanner = worker->scanner;
+    const MP3ScanOptions* options = scanner->options;
+    if (record->has_picture && options->pictures != NULL) {
+        if (record->cached) {
+            record->picture_id = MP3PictureCache_addHash(options->pictures, record->picture_hash, record->picture.size, &record->picture_is_new);
+        } else {
+            record->picture_id = MP3PictureCache_add(options->pictures, &record->picture, &record->picture_hash, &record->picture_is_new);
+        }
+    }
+    if (key != NULL && options->cache != NULL) {
+        if (record->has_picture && record->picture_hash == 0) {
+            record->picture_hash = MP3_hash64(record->picture.data, record->picture.size, 0);
+            if (record->picture_hash == 0) record->picture_hash = 1;
+        }
+        MP3Cache_add(options->cache, key, record);
+    }
+    __atomic_add_fetch(&scanner->files, 1, __ATOMIC_RELAXED);
+    MP3_STATS_TIME(MP3_STAGE_OUTPUT);
+    if (options->on_record != NULL && options->on_record(options->user, worker->id, record) != 0) {
+        __atomic_store_n(&scanner->stop, 1, __ATOMIC_RELAXED);
     }
-    picture->mime_type[mime_index] = '\0';
-    data_pos++; // Skip null terminator
+}
 
-    if (mime_index == 0) {
-        strncpy((char*)picture->mime_type, "image/jpeg", 64);
+// Finish a task, files loaded into the worker's reader are reported first
+static void MP3Scan_finish(MP3ScanWorker* worker, char* path, int loaded, const MP3CacheKey* key) {
+    MP3Scanner* scanner = worker->scanner;
+    if (loaded && !__atomic_load_n(&scanner->stop, __ATOMIC_RELAXED)) {
+        MP3Record record;
+        MP3Reader_getRecord(worker->reader, &record);
+        record.path = path;
+        MP3Scan_emit(worker, &record, key);
+        MP3Arena_reset(worker->arena);
     }
+    free(path);
+    __atomic_sub_fetch(&scanner->pending, 1, __ATOMIC_SEQ_CST);
+}
 
-    // picture type byte
-    if (data_pos >= frame_size) {
-        free(picture);
+// Report path from the scan cache if it is unchanged, otherwise fill key for MP3Scan_finish
+static int MP3Scan_cached(MP3ScanWorker* worker, char* path, MP3CacheKey* key) {
+    MP3Cache* cache = worker->scanner->options->cache;
+    if (cache == NULL || MP3Cache_getKey(path, key) != 0) return -1;
+
+    MP3Record record;
+    if (MP3Cache_lookup(cache, key, &record) != 0) return 0;
+    record.path = path;
+    MP3Scan_emit(worker, &record, key);
+    free(path);
+    __atomic_sub_fetch(&worker->scanner->pending, 1, __ATOMIC_SEQ_CST);
+    return 1;
+}
+
+
+#ifdef MP3_READER_URING
+/*
+    io_uring backend: each worker keeps queue_depth files in flight
+    (open -> head + tail reads -> rest of the tag), parsing runs on completion
+*/
+
+// First read from the start of the file, covers most tags in one go
+#ifndef MP3_ASYNC_HEAD_SIZE
+#define MP3_ASYNC_HEAD_SIZE (64 * 1024)
+#endif
+
+enum {
+    MP3_ASYNC_FREE = 0,
+    MP3_ASYNC_OPEN,
+    MP3_ASYNC_READ,     // head and tail
+    MP3_ASYNC_REST      // rest of a large tag
+};
+
+typedef struct MP3AsyncSlot {
+    int state;
+    char* path;
+    int fd;
+    int ops;            // Operations in flight
+    int failed;
+    uint32_t file_size;
+    uint32_t head_size; // Bytes from offset 0
+    uint32_t tail_size;
+    uint32_t expect[3]; // Expected result of head, tail and rest reads
+    uint8_t* buffer;
+    uint32_t capacity;
+    uint8_t tail[sizeof(ID3v1Tag)];
+    MP3CacheKey key;    // Valid if has_key, for the scan cache
+    int has_key;
+} MP3AsyncSlot;
+
+typedef struct MP3Uring {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_ptr;
+    size_t sq_len;
+    void* cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+    unsigned to_submit;
+    MP3AsyncSlot* slots;
+    int depth;
+    int inflight;       // Busy slots
+} MP3Uring;
+
+static void MP3Uring_destroy(MP3Uring* ring) {
+    if (ring == NULL) return;
+    if (ring->sqes != NULL) munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_len);
+    if (ring->sq_ptr != NULL) munmap(ring->sq_ptr, ring->sq_len);
+    if (ring->fd >= 0) close(ring->fd);
+    if (ring->slots != NULL) {
+        for (int i = 0; i < ring->depth; i++) free(ring->slots[i].buffer);
+        free(ring->slots);
+    }
+    free(ring);
+}
+
+// OPENAT and READ arrived in 5.6 with the probe itself, older rings fail every request with -EINVAL
+static int MP3Uring_probe(int fd) {
+    unsigned ops = 256;
+    struct io_uring_probe* probe = (struct io_uring_probe*) calloc(1, sizeof(struct io_uring_probe) + ops * sizeof(struct io_uring_probe_op));
+    if (probe == NULL) return 0;
+    int supported = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, ops) == 0 &&
+                    probe->ops_len > IORING_OP_READ && probe->ops_len > IORING_OP_OPENAT &&
+                    (probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) &&
+                    (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
+}
+
+// NULL if io_uring is not available (old kernel, seccomp)
+static MP3Uring* MP3Uring_create(int depth) {
+    MP3Uring* ring = (MP3Uring*) calloc(1, sizeof(MP3Uring));
+    if (ring == NULL) return NULL;
+    ring->fd = -1;
+    ring->depth = depth;
+    ring->slots = (MP3AsyncSlot*) calloc(depth, sizeof(MP3AsyncSlot));
+    if (ring->slots == NULL) {
+        MP3Uring_destroy(ring);
         return NULL;
     }
 
+    // up to two operations per file at once
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int) syscall(__NR_io_uring_setup, 2 * depth, &params);
+    if (ring->fd < 0 || !MP3Uring_probe(ring->fd)) {
+        MP3Uring_destroy(ring);
+        return NULL;
+    }
 
-    picture->picture_type = frame_data[data_pos++];
+    ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_len > ring->sq_len) ring->sq_len = ring->cq_len;
+    }
 
-    // description skip
-    if (encoding == 0) {
-        // ISO-8859-1
-        while (data_pos < frame_size && frame_data[data_pos] != 0) {
-            data_pos++;
-        }
-        data_pos++; // Skip null terminator
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        ring->sq_ptr = NULL;
+        MP3Uring_destroy(ring);
+        return NULL;
     }
-    else if (encoding == 1 || encoding == 2) {
-        // UTF-16
-        while ((data_pos < frame_size - 1) && !(frame_data[data_pos] == 0 && frame_data[data_pos+1] == 0)) {
-            data_pos += 2;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            ring->cq_ptr = NULL;
+            MP3Uring_destroy(ring);
+            return NULL;
         }
-        data_pos += 2; // Skip null terminator
     }
-    else if (encoding == 3) {
-        // UTF-8
-        while (data_pos < frame_size && frame_data[data_pos] != 0) {
-            data_pos++;
+
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*) mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        MP3Uring_destroy(ring);
+        return NULL;
+    }
+
+    uint8_t* sq = (uint8_t*) ring->sq_ptr;
+    uint8_t* cq = (uint8_t*) ring->cq_ptr;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return ring;
+}
+
+// Queue one operation, user_data is slot index and read kind
+static void MP3Uring_queue(MP3Uring* ring, int op, int fd, const char* path, void* buf, uint32_t len, uint64_t offset, uint64_t user_data) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (uint8_t) op;
+    sqe->user_data = user_data;
+    if (op == IORING_OP_OPENAT) {
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t) path;
+        sqe->open_flags = O_RDONLY;
+    } else {
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t) buf;
+        sqe->len = len;
+        sqe->off = offset;
+    }
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+}
+
+static int MP3Uring_enter(MP3Uring* ring, unsigned min_complete) {
+    MP3_STATS_ADD(syscalls, 1);
+    int r = (int) syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (r >= 0) ring->to_submit -= (unsigned) r < ring->to_submit ? (unsigned) r : ring->to_submit;
+    return r;
+}
+
+static int MP3Uring_grow(MP3AsyncSlot* slot, uint32_t size) {
+    if (size <= slot->capacity) return 0;
+    MP3_STATS_ADD(allocations, 1);
+    uint8_t* buffer = (uint8_t*) realloc(slot->buffer, size);
+    if (buffer == NULL) return -1;
+    slot->buffer = buffer;
+    slot->capacity = size;
+    return 0;
+}
+
+// Slot finished: parse through the worker's reader, or fall back to a blocking load
+static void MP3Uring_finish(MP3Uring* ring, MP3ScanWorker* worker, MP3AsyncSlot* slot) {
+    if (slot->fd >= 0) {
+        close(slot->fd);
+        MP3_STATS_ADD(syscalls, 1);
+    }
+    slot->fd = -1;
+
+    int loaded = 0;
+    if (slot->failed) {
+        loaded = MP3Reader_loadTags(worker->reader, slot->path) == 0;
+    } else if (slot->state != MP3_ASYNC_OPEN) {
+        MP3Reader* reader = worker->reader;
+        MP3Reader_freeData(reader);
+        if (slot->tail_size > 0) memcpy(slot->buffer + slot->head_size, slot->tail, slot->tail_size);
+        reader->data = slot->buffer;
+        reader->size = slot->head_size + slot->tail_size;
+        reader->head_size = slot->head_size;
+        reader->file_size = slot->file_size;
+        reader->storage = MP3_STORAGE_USER;
+        MP3_STATS_ADD(files, 1);
+        loaded = 1;
+    }
+
+    MP3Scan_finish(worker, slot->path, loaded, slot->has_key ? &slot->key : NULL);
+    if (worker->reader->storage == MP3_STORAGE_USER) MP3Reader_freeData(worker->reader);
+    slot->path = NULL;
+    slot->state = MP3_ASYNC_FREE;
+    ring->inflight--;
+}
+
+static void MP3Uring_complete(MP3Uring* ring, MP3ScanWorker* worker, uint64_t user_data, int res) {
+    MP3AsyncSlot* slot = &ring->slots[user_data >> 2];
+    int kind = (int)(user_data & 3);
+    int index = (int)(slot - ring->slots);
+
+    if (slot->state == MP3_ASYNC_OPEN) {
+        struct stat st;
+        if (res < 0) { // can't open, same as a failed blocking load, anything unexpected is retried blocking
+            slot->failed = res != -ENOENT && res != -EACCES && res != -ENOTDIR && res != -ELOOP;
+            MP3Uring_finish(ring, worker, slot);
+            return;
         }
-        data_pos++; // Skip null terminator
+        slot->fd = res;
+        MP3_STATS_ADD(syscalls, 1);
+        if (fstat(slot->fd, &st) != 0 || (uint64_t) st.st_size > UINT32_MAX) { // the blocking load reports it
+            slot->failed = 1;
+            MP3Uring_finish(ring, worker, slot);
+            return;
+        }
+
+        // head guess and ID3v1 tail, whole file if they would overlap
+        slot->file_size = (uint32_t) st.st_size;
+        slot->head_size = MP3_ASYNC_HEAD_SIZE;
+        slot->tail_size = sizeof(ID3v1Tag);
+        if ((uint64_t) slot->head_size + slot->tail_size >= slot->file_size) {
+            slot->head_size = slot->file_size;
+            slot->tail_size = 0;
+        }
+        if (MP3Uring_grow(slot, slot->head_size + sizeof(ID3v1Tag)) != 0) {
+            slot->failed = 1;
+            MP3Uring_finish(ring, worker, slot);
+            return;
+        }
+
+        slot->state = MP3_ASYNC_READ;
+        slot->ops = 0;
+        if (slot->head_size > 0) {
+            slot->expect[0] = slot->head_size;
+            MP3Uring_queue(ring, IORING_OP_READ, slot->fd, NULL, slot->buffer, slot->head_size, 0, ((uint64_t) index << 2) | 0);
+            slot->ops++;
+        }
+        if (slot->tail_size > 0) {
+            slot->expect[1] = slot->tail_size;
+            MP3Uring_queue(ring, IORING_OP_READ, slot->fd, NULL, slot->tail, slot->tail_size, slot->file_size - slot->tail_size, ((uint64_t) index << 2) | 1);
+            slot->ops++;
+        }
+        if (slot->ops == 0) MP3Uring_finish(ring, worker, slot); // empty file
+        return;
     }
-    else {
-        free(picture);
+
+    // short reads and errors are retried with a blocking load
+    if (res > 0) MP3_STATS_ADD(bytes_read, res);
+    if (res < 0 || (uint32_t) res != slot->expect[kind]) slot->failed = 1;
+    if (--slot->ops > 0) return;
+    if (slot->failed || slot->state == MP3_ASYNC_REST) {
+        MP3Uring_finish(ring, worker, slot);
+        return;
+    }
+
+    // same layout as MP3Reader_loadTags: whole tag plus the probe
+    uint32_t needed = 0;
+    ID3v2TagHeader* header = (ID3v2TagHeader*) slot->buffer;
+    if (slot->head_size >= sizeof(ID3v2TagHeader) && strncmp(header->header, "ID3", 3) == 0) {
+        needed = sizeof(ID3v2TagHeader) + ID3v2Tag_getTagSize(header);
+        if (header->flags & 0x10) needed += sizeof(ID3v2TagHeader);
+    }
+    needed += MP3_READER_PROBE_SIZE;
+    if (slot->tail_size > 0 && (uint64_t) needed + slot->tail_size >= slot->file_size) {
+        needed = slot->file_size;
+        slot->tail_size = 0;
+    }
+
+    if (needed <= slot->head_size || (slot->tail_size == 0 && slot->head_size == slot->file_size)) {
+        MP3Uring_finish(ring, worker, slot);
+        return;
+    }
+
+    if (MP3Uring_grow(slot, needed + sizeof(ID3v1Tag)) != 0) {
+        slot->failed = 1;
+        MP3Uring_finish(ring, worker, slot);
+        return;
+    }
+    slot->state = MP3_ASYNC_REST;
+    slot->expect[2] = needed - slot->head_size;
+    MP3Uring_queue(ring, IORING_OP_READ, slot->fd, NULL, slot->buffer + slot->head_size, slot->expect[2], slot->head_size, ((uint64_t) index << 2) | 2);
+    slot->head_size = needed;
+    slot->ops = 1;
+}
+
+// Submit queued operations and process completions, waiting for at least one if wait is set
+static void MP3Uring_reap(MP3Uring* ring, MP3ScanWorker* worker, int wait) {
+    if (MP3Uring_enter(ring, wait && ring->inflight > 0 ? 1 : 0) < 0 && !wait) return;
+
+    unsigned head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        MP3Uring_complete(ring, worker, user_data, res);
+    }
+}
+
+// Start loading path (takes ownership), waits for a free slot if all are busy
+static void MP3Uring_submit(MP3Uring* ring, MP3ScanWorker* worker, char* path, const MP3CacheKey* key) {
+    while (ring->inflight == ring->depth) {
+        MP3Uring_reap(ring, worker, 1);
+    }
+
+    int index = 0;
+    while (ring->slots[index].state != MP3_ASYNC_FREE) index++;
+    MP3AsyncSlot* slot = &ring->slots[index];
+    slot->state = MP3_ASYNC_OPEN;
+    slot->path = path;
+    slot->fd = -1;
+    slot->failed = 0;
+    slot->has_key = key != NULL;
+    if (key != NULL) slot->key = *key;
+    ring->inflight++;
+
+    MP3Uring_queue(ring, IORING_OP_OPENAT, 0, path, NULL, 0, 0, (uint64_t) index << 2);
+    MP3Uring_reap(ring, worker, 0);
+}
+#endif // MP3_READER_URING
+
+
+static void* MP3Scan_worker(void* arg) {
+    MP3ScanWorker* worker = (MP3ScanWorker*) arg;
+    MP3Scanner* scanner = worker->scanner;
+    worker->arena = MP3Arena_create(0);
+    worker->reader = MP3Reader_createWithArena(NULL, worker->arena);
+    if (worker->reader == NULL) {
+        MP3Arena_destroy(worker->arena);
         return NULL;
     }
 
+#ifdef MP3_READER_URING
+    MP3Uring* ring = scanner->options->queue_depth > 1 ? MP3Uring_create(scanner->options->queue_depth) : NULL;
+#endif
+
+    uint32_t victim = worker->id;
+    int idle = 0;
+    for (;;) {
+        MP3ScanTask task;
+        int found = MP3ScanQueue_pop(&scanner->queues[worker->id], &task, 0);
+        // own queue empty, steal from the others
+        for (int i = 1; !found && i < scanner->threads; i++) {
+            victim = (victim + 1) % scanner->threads;
+            if ((int) victim != worker->id) found = MP3ScanQueue_pop(&scanner->queues[victim], &task, 1);
+        }
 
-    if (data_pos >= frame_size) {
-        free(picture);
+        if (!found) {
+#ifdef MP3_READER_URING
+            if (ring != NULL && ring->inflight > 0) {
+                MP3Uring_reap(ring, worker, 1);
+                continue;
+            }
+#endif
+            if (__atomic_load_n(&scanner->pending, __ATOMIC_SEQ_CST) == 0) break;
+            // back off while others are still listing directories
+            if (++idle < 64) {
+                sched_yield();
+            } else {
+                struct timespec delay = { 0, 100 * 1000 };
+                nanosleep(&delay, NULL);
+            }
+            continue;
+        }
+        idle = 0;
+
+        if (__atomic_load_n(&scanner->stop, __ATOMIC_RELAXED)) {
+            MP3Scan_finish(worker, task.path, 0, NULL); // drain
+            continue;
+        } else if (task.is_dir) {
+            MP3Scan_directory(scanner, worker->id, task.path);
+            MP3Scan_finish(worker, task.path, 0, NULL);
+            continue;
+        }
+
+        MP3CacheKey key;
+        int cached = MP3Scan_cached(worker, task.path, &key);
+        if (cached == 1) continue;
+        const MP3CacheKey* miss = cached == 0 ? &key : NULL;
+#ifdef MP3_READER_URING
+        if (ring != NULL) {
+            MP3Uring_submit(ring, worker, task.path, miss);
+            continue;
+        }
+#endif
+        MP3Scan_finish(worker, task.path, MP3Reader_loadTags(worker->reader, task.path) == 0, miss);
+    }
+
+#ifdef MP3_READER_URING
+    MP3Uring_destroy(ring);
+#endif
+    MP3Reader_destroy(worker->reader);
+    MP3Arena_destroy(worker->arena);
+    return NULL;
+}
+
+
+// Scan root recursively with a work-stealing thread pool, returns files reported or -1
+long MP3Scan_run(const char* root, const MP3ScanOptions* options) {
+    if (root == NULL || options == NULL) return -1;
+
+    MP3Scanner scanner;
+    memset(&scanner, 0, sizeof(scanner));
+    scanner.options = options;
+    scanner.threads = options->threads > 0 ? options->threads : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (scanner.threads < 1) scanner.threads = 1;
+
+    // without io_uring, keep the requested reads in flight with more blocking threads
+    if (options->queue_depth > 1) {
+        int async = 0;
+#ifdef MP3_READER_URING
+        MP3Uring* probe = MP3Uring_create(1);
+        async = probe != NULL;
+        MP3Uring_destroy(probe);
+#endif
+        if (!async) {
+            scanner.threads *= options->queue_depth;
+            if (scanner.threads > 256) scanner.threads = 256;
+        }
+    }
+
+    scanner.queues = (MP3ScanQueue*) calloc(scanner.threads, sizeof(MP3ScanQueue));
+    MP3ScanWorker* workers = (MP3ScanWorker*) calloc(scanner.threads, sizeof(MP3ScanWorker));
+    if (scanner.queues == NULL || workers == NULL) {
+        free(scanner.queues);
+        free(workers);
+        return -1;
+    }
+    int queue_count = scanner.threads;
+    for (int i = 0; i < queue_count; i++) {
+        pthread_mutex_init(&scanner.queues[i].lock, NULL);
+    }
+
+    // root may be a single file
+    struct stat st;
+    if (stat(root, &st) == 0) {
+        size_t len = strlen(root);
+        while (len > 1 && root[len - 1] == '/') len--;
+        char* path = (char*) malloc(len + 1);
+        if (path != NULL) {
+            memcpy(path, root, len);
+            path[len] = 0;
+            MP3Scan_push(&scanner, 0, path, S_ISDIR(st.st_mode));
+        }
+    }
+
+    int started = 0;
+    for (int i = 0; i < scanner.threads; i++) {
+        workers[i].scanner = &scanner;
+        workers[i].id = i;
+        if (pthread_create(&workers[i].thread, NULL, MP3Scan_worker, &workers[i]) != 0) break;
+        started++;
+    }
+    if (started == 0) {
+        // no threads available, run inline
+        workers[0].scanner = &scanner;
+        scanner.threads = 1;
+        MP3Scan_worker(&workers[0]);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < queue_count; i++) {
+        pthread_mutex_destroy(&scanner.queues[i].lock);
+        free(scanner.queues[i].tasks);
+    }
+    free(scanner.queues);
+    free(workers);
+    return scanner.files;
+}
+
+
+
+
+/*
+    Query server
+    The thread in MP3Server_run polls the listening socket and every idle connection and
+    queues readable ones for the workers. A worker reads once, answers the complete
+    requests and hands the connection back through the wake pipe, so any number of
+    clients share the workers and a slow one holds a worker for one response at most
+    (bounded by the send timeout). Responses to every request read in one go are
+    collected in the worker's output buffer and written together. LRU entries hold the
+    rendered JSON record and where the picture sits in the file, so hits are a stat and
+    a copy under the lock, covers a sendfile from the descriptor checked against it.
+*/
+
+// poll interval for noticing MP3Server_stop and idle connections
+#define MP3_SERVER_TICK_MS 100
+
+typedef struct MP3ServerEntry {
+    struct MP3ServerEntry* prev;   // LRU list, most recent first
+    struct MP3ServerEntry* next;
+    struct MP3ServerEntry* chain;  // Hash bucket
+    uint64_t hash;                 // MP3_hash64 of the path
+    MP3CacheKey key;
+    char* path;                    // Same allocation as the entry
+    uint32_t path_len;
+    char* json;                    // Record line, same allocation
+    uint32_t json_len;
+    uint32_t picture_size;         // 0 if none
+    uint32_t picture_offset;       // File offset, 0 if the picture bytes are not stored as is
+    char mime[64];
+} MP3ServerEntry;
+
+struct MP3Server {
+    int fd;
+    char* socket_path;
+    MP3ServerOptions options;
+    int stop;
+
+    pthread_mutex_t lock;          // Guards the LRU
+    MP3ServerEntry** buckets;
+    uint32_t bucket_mask;
+    MP3ServerEntry* head;
+    MP3ServerEntry* tail;
+    uint32_t count;
+
+    int wake[2];                   // Pipe, written when a worker hands a connection back
+    pthread_mutex_t queue_lock;    // Guards the queues below
+    pthread_cond_t queue_cond;
+    struct MP3ServerConn* ready;   // Readable connections waiting for a worker, FIFO
+    struct MP3ServerConn* ready_tail;
+    struct MP3ServerConn* done;    // Handed back to the dispatcher
+};
+
+typedef struct MP3ServerConn {
+    struct MP3ServerConn* next;    // Queue link
+    int fd;
+    int closed;                    // Set by the worker, the dispatcher closes it
+    uint64_t active_ms;            // Last handed back, for the idle timeout
+    uint32_t used;                 // Bytes of a partial request in in
+    char in[MP3_SERVER_LINE_MAX];
+} MP3ServerConn;
+
+typedef struct MP3ServerWorker {
+    MP3Server* server;
+    pthread_t thread;
+    MP3Reader* reader;             // Warm reader, its buffer is kept across files
+    MP3Arena* arena;
+    MP3Writer* output;             // Responses for the current connection, buffer 0
+    MP3Writer* render;             // Renders JSON records, never written out
+} MP3ServerWorker;
+
+// Picture location copied out of an entry
+typedef struct MP3ServerPicture {
+    uint32_t size;
+    uint32_t offset;
+    char mime[64];
+} MP3ServerPicture;
+
+void MP3ServerOptions_init(MP3ServerOptions* options) {
+    memset(options, 0, sizeof(MP3ServerOptions));
+    options->idle_timeout_ms = 60 * 1000;
+    options->send_timeout_ms = 5 * 1000;
+}
+
+MP3Server* MP3Server_create(const char* socket_path, const MP3ServerOptions* options) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socket_path == NULL || strlen(socket_path) >= sizeof(addr.sun_path)) {
+        printf("Invalid socket path\n");
         return NULL;
     }
+    strcpy(addr.sun_path, socket_path);
 
-    // image data
-    picture->size = frame_size - data_pos;
-    picture->data = frame_data + data_pos;
-    return picture;
+    MP3Server* server = (MP3Server*) calloc(1, sizeof(MP3Server));
+    if (server == NULL) {
+        printf("Failed to allocate memory for MP3Server\n");
+        return NULL;
+    }
+    if (options != NULL) server->options = *options;
+    else MP3ServerOptions_init(&server->options);
+    if (server->options.cache_entries == 0) server->options.cache_entries = MP3_SERVER_CACHE_ENTRIES;
+    if (server->options.max_connections == 0) server->options.max_connections = MP3_SERVER_MAX_CONNECTIONS;
+    server->fd = -1;
+    server->wake[0] = server->wake[1] = -1;
+
+    // buckets for a load factor of at most 1/2
+    uint32_t buckets = 16;
+    while (buckets < server->options.cache_entries * 2 && buckets < (1u << 30)) buckets *= 2;
+    server->buckets = (MP3ServerEntry**) calloc(buckets, sizeof(MP3ServerEntry*));
+    server->bucket_mask = buckets - 1;
+    server->socket_path = strdup(socket_path);
+    if (server->buckets == NULL || server->socket_path == NULL) {
+        printf("Failed to allocate memory for MP3Server\n");
+        free(server->buckets);
+        free(server->socket_path);
+        free(server);
+        return NULL;
+    }
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_mutex_init(&server->queue_lock, NULL);
+    pthread_cond_init(&server->queue_cond, NULL);
+
+    // a left-over socket of an earlier run, anything else stays
+    struct stat st;
+    if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(socket_path);
+
+    server->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server->fd < 0 || bind(server->fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(server->fd, SOMAXCONN) != 0) {
+        printf("Failed to listen on %s: %s\n", socket_path, strerror(errno));
+        if (server->fd >= 0) close(server->fd);
+        server->fd = -1;
+        MP3Server_destroy(server);
+        return NULL;
+    }
+    if (pipe(server->wake) != 0) {
+        printf("Failed to create pipe: %s\n", strerror(errno));
+        MP3Server_destroy(server);
+        return NULL;
+    }
+    // accepted until EAGAIN, the wake pipe is drained the same way and never blocks a worker
+    fcntl(server->fd, F_SETFL, fcntl(server->fd, F_GETFL) | O_NONBLOCK);
+    fcntl(server->wake[0], F_SETFL, fcntl(server->wake[0], F_GETFL) | O_NONBLOCK);
+    fcntl(server->wake[1], F_SETFL, fcntl(server->wake[1], F_GETFL) | O_NONBLOCK);
+    return server;
 }
 
-void MP3_Picture_free(MP3_Picture* picture) {
-    free(picture);
+void MP3Server_stop(MP3Server* server) {
+    if (server != NULL) __atomic_store_n(&server->stop, 1, __ATOMIC_RELEASE);
+}
+
+static int MP3Server_stopped(MP3Server* server) {
+    return __atomic_load_n(&server->stop, __ATOMIC_ACQUIRE);
+}
+
+void MP3Server_destroy(MP3Server* server) {
+    if (server == NULL) return;
+    if (server->fd >= 0) {
+        close(server->fd);
+        unlink(server->socket_path);
+    }
+    if (server->wake[0] >= 0) close(server->wake[0]);
+    if (server->wake[1] >= 0) close(server->wake[1]);
+    MP3ServerEntry* entry = server->head;
+    while (entry != NULL) {
+        MP3ServerEntry* next = entry->next;
+        free(entry);
+        entry = next;
+    }
+    pthread_mutex_destroy(&server->lock);
+    pthread_mutex_destroy(&server->queue_lock);
+    pthread_cond_destroy(&server->queue_cond);
+    free(server->buckets);
+    free(server->socket_path);
+    free(server);
+}
+
+
+/*
+    LRU, callers hold the lock
+*/
+
+static void MP3Server_unlink(MP3Server* server, MP3ServerEntry* entry) {
+    if (entry->prev != NULL) entry->prev->next = entry->next;
+    else server->head = entry->next;
+    if (entry->next != NULL) entry->next->prev = entry->prev;
+    else server->tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+static void MP3Server_pushFront(MP3Server* server, MP3ServerEntry* entry) {
+    entry->prev = NULL;
+    entry->next = server->head;
+    if (server->head != NULL) server->head->prev = entry;
+    else server->tail = entry;
+    server->head = entry;
+}
+
+// Take entry out of its bucket and the list and free it
+static void MP3Server_remove(MP3Server* server, MP3ServerEntry* entry) {
+    MP3ServerEntry** p = &server->buckets[entry->hash & server->bucket_mask];
+    while (*p != entry) p = &(*p)->chain;
+    *p = entry->chain;
+    MP3Server_unlink(server, entry);
+    server->count--;
+    free(entry);
+}
+
+static MP3ServerEntry* MP3Server_find(MP3Server* server, uint64_t hash, const char* path, uint32_t path_len) {
+    MP3ServerEntry* entry = server->buckets[hash & server->bucket_mask];
+    while (entry != NULL && (entry->hash != hash || entry->path_len != path_len || memcmp(entry->path, path, path_len) != 0)) {
+        entry = entry->chain;
+    }
+    return entry;
+}
+
+static int MP3Server_sameKey(const MP3CacheKey* a, const MP3CacheKey* b) {
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size && a->mtime_ns == b->mtime_ns;
+}
+
+// Replaces an entry for the same path, evicts the least recently used one when full
+static void MP3Server_insert(MP3Server* server, MP3ServerEntry* entry) {
+    pthread_mutex_lock(&server->lock);
+    MP3ServerEntry* old = MP3Server_find(server, entry->hash, entry->path, entry->path_len);
+    if (old != NULL) MP3Server_remove(server, old);
+
+    MP3ServerEntry** bucket = &server->buckets[entry->hash & server->bucket_mask];
+    entry->chain = *bucket;
+    *bucket = entry;
+    MP3Server_pushFront(server, entry);
+    server->count++;
+    if (server->count > server->options.cache_entries) MP3Server_remove(server, server->tail);
+    pthread_mutex_unlock(&server->lock);
+}
+
+
+/*
+    Responses
+*/
+
+// Append to the output buffer, flushed after the current batch of requests
+static int MP3Server_put(MP3ServerWorker* worker, const void* data, uint32_t len) {
+    MP3WriterBuffer* buffer = worker->output->buffers[0];
+    if (MP3Writer_reserve(&buffer->data, &buffer->capacity, buffer->size + len) != 0) return -1;
+    memcpy(buffer->data + buffer->size, data, len);
+    buffer->size += len;
+    return 0;
+}
+
+static int MP3Server_flush(MP3ServerWorker* worker) {
+    MP3WriterBuffer* buffer = worker->output->buffers[0];
+    if (buffer->size == 0) return worker->output->failed ? -1 : 0;
+    return MP3Writer_flushBuffer(worker->output, buffer);
+}
+
+static int MP3Server_error(MP3ServerWorker* worker, const char* message) {
+    char line[128];
+    int n = snprintf(line, sizeof(line), "ERR %s\n", message);
+    return MP3Server_put(worker, line, (uint32_t) n);
+}
+
+// Response header, then the record line for INFO
+static int MP3Server_putInfo(MP3ServerWorker* worker, const char* json, uint32_t len) {
+    char line[32];
+    int n = snprintf(line, sizeof(line), "OK %u\n", len);
+    if (MP3Server_put(worker, line, (uint32_t) n) != 0) return -1;
+    return MP3Server_put(worker, json, len);
+}
+
+// Header and picture bytes, from file_fd when they are stored as is, else from data
+static int MP3Server_putPicture(MP3ServerWorker* worker, const MP3ServerPicture* picture, int file_fd, const uint8_t* data) {
+    char line[128];
+    int n = snprintf(line, sizeof(line), "OK %u %s\n", picture->size, picture->mime[0] ? picture->mime : "application/octet-stream");
+    // earlier responses go first, the picture bypasses the buffer
+    if (MP3Server_put(worker, line, (uint32_t) n) != 0 || MP3Server_flush(worker) != 0) return -1;
+    if (data != NULL) return MP3_writeFull(worker->output->fd, data, picture->size, -1);
+    return MP3_copyTail(file_fd, picture->offset, worker->output->fd, picture->size);
+}
+
+// Parse path with the worker's reader, cache it and answer from the fresh record,
+// keyed by the file that was read in case path was replaced since the caller's stat
+static int MP3Server_miss(MP3ServerWorker* worker, int picture, const char* path, uint32_t path_len, uint64_t hash) {
+    MP3Reader* reader = worker->reader;
+    MP3Arena_reset(worker->arena);
+    MP3Record record;
+    struct stat st;
+    if (MP3Reader_loadTags(reader, path) != 0 || fstat(reader->fd, &st) != 0 || MP3Reader_getRecord(reader, &record) != 0) {
+        return MP3Server_error(worker, "failed to read file");
+    }
+    record.path = path;
+
+    if (MP3Writer_write(worker->render, 0, &record) != 0) {
+        worker->render->failed = 0; // records past MP3_WRITER_BUFFER_SIZE
+        return MP3Server_error(worker, "record too large");
+    }
+    MP3WriterBuffer* rendered = worker->render->buffers[0];
+
+    MP3ServerEntry* entry = (MP3ServerEntry*) malloc(sizeof(MP3ServerEntry) + path_len + 1 + rendered->size);
+    if (entry == NULL) {
+        rendered->size = 0;
+        return MP3Server_error(worker, "out of memory");
+    }
+    memset(entry, 0, sizeof(MP3ServerEntry));
+    entry->hash = hash;
+    MP3Cache_statKey(&st, &entry->key);
+    entry->path = (char*)(entry + 1);
+    entry->path_len = path_len;
+    memcpy(entry->path, path, path_len + 1);
+    entry->json = entry->path + path_len + 1;
+    entry->json_len = rendered->size;
+    memcpy(entry->json, rendered->data, rendered->size);
+    rendered->size = 0;
+    if (record.has_picture) {
+        entry->picture_size = record.picture.size;
+        entry->picture_offset = record.picture_offset;
+        memcpy(entry->mime, record.picture.mime_type, sizeof(entry->mime));
+        entry->mime[sizeof(entry->mime) - 1] = 0;
+    }
+
+    MP3ServerPicture found = { entry->picture_size, entry->picture_offset, { 0 } };
+    memcpy(found.mime, entry->mime, sizeof(found.mime));
+    int result;
+    if (!picture) result = MP3Server_putInfo(worker, entry->json, entry->json_len);
+    else if (!record.has_picture) result = MP3Server_error(worker, "no picture");
+    else result = MP3Server_putPicture(worker, &found, reader->fd, found.offset != 0 ? NULL : record.picture.data);
+    MP3Server_insert(worker->server, entry); // after the last use, it may be evicted right away
+    return result;
+}
+
+static int MP3Server_answer(MP3ServerWorker* worker, int picture, const char* path, uint32_t path_len) {
+    MP3Server* server = worker->server;
+    struct stat st;
+    if (stat(path, &st) != 0) return MP3Server_error(worker, "not found");
+    if (!S_ISREG(st.st_mode)) return MP3Server_error(worker, "not a file");
+    MP3CacheKey key;
+    MP3Cache_statKey(&st, &key);
+    uint64_t hash = MP3_hash64(path, path_len, 0);
+
+    // hits are answered from the entry under the lock, covers are sent after it
+    MP3ServerPicture found;
+    int hit = 0, result = 0;
+    pthread_mutex_lock(&server->lock);
+    MP3ServerEntry* entry = MP3Server_find(server, hash, path, path_len);
+    if (entry != NULL && MP3Server_sameKey(&entry->key, &key) && (!picture || entry->picture_size == 0 || entry->picture_offset != 0)) {
+        hit = 1;
+        MP3Server_unlink(server, entry);
+        MP3Server_pushFront(server, entry);
+        if (!picture) {
+            result = MP3Server_putInfo(worker, entry->json, entry->json_len);
+        } else {
+            found.size = entry->picture_size;
+            found.offset = entry->picture_offset;
+            memcpy(found.mime, entry->mime, sizeof(found.mime));
+        }
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    if (!hit) return MP3Server_miss(worker, picture, path, path_len, hash);
+    if (!picture) return result;
+    if (found.size == 0) return MP3Server_error(worker, "no picture");
+
+    // the cached offset is only good for the file the entry was made from
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return MP3Server_error(worker, "not found");
+    MP3CacheKey opened;
+    if (fstat(fd, &st) != 0) memset(&opened, 0, sizeof(opened));
+    else MP3Cache_statKey(&st, &opened);
+    if (!MP3Server_sameKey(&opened, &key)) {
+        close(fd);
+        return MP3Server_miss(worker, picture, path, path_len, hash);
+    }
+    result = MP3Server_putPicture(worker, &found, fd, NULL);
+    close(fd);
+    return result;
+}
+
+// One request line without the newline, nonzero closes the connection
+static int MP3Server_request(MP3ServerWorker* worker, const char* line, uint32_t len) {
+    if (len == 4 && memcmp(line, "PING", 4) == 0) return MP3Server_put(worker, "OK 0\n", 5);
+    if (len > 5 && memcmp(line, "INFO ", 5) == 0) return MP3Server_answer(worker, 0, line + 5, len - 5);
+    if (len > 8 && memcmp(line, "PICTURE ", 8) == 0) return MP3Server_answer(worker, 1, line + 8, len - 8);
+    return MP3Server_error(worker, "unknown request");
+}
+
+// Answer the complete requests of one read, conn->closed is set when the connection is done
+static void MP3Server_serve(MP3ServerWorker* worker, MP3ServerConn* conn) {
+    worker->output->fd = conn->fd;
+    worker->output->failed = 0;
+
+    // the dispatcher saw it readable, never wait on a client here
+    ssize_t n;
+    do {
+        n = recv(conn->fd, conn->in + conn->used, MP3_SERVER_LINE_MAX - conn->used, MSG_DONTWAIT);
+    } while (n < 0 && errno == EINTR);
+    MP3_STATS_ADD(syscalls, 1);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    if (n <= 0) {
+        conn->closed = 1;
+        return;
+    }
+    conn->used += (uint32_t) n;
+
+    // every complete line, the responses go out in one write
+    uint32_t pos = 0;
+    int failed = 0;
+    const char* newline;
+    while (!failed && (newline = (const char*) memchr(conn->in + pos, '\n', conn->used - pos)) != NULL) {
+        uint32_t end = (uint32_t)(newline - conn->in);
+        uint32_t len = end - pos;
+        if (len > 0 && conn->in[end - 1] == '\r') len--;
+        conn->in[pos + len] = 0;
+        failed = MP3Server_request(worker, conn->in + pos, len) != 0;
+        pos = end + 1;
+    }
+    memmove(conn->in, conn->in + pos, conn->used - pos);
+    conn->used -= pos;
+    if (!failed && conn->used == MP3_SERVER_LINE_MAX) {
+        MP3Server_error(worker, "request too long");
+        failed = 1;
+    }
+    if (MP3Server_flush(worker) != 0 || failed) conn->closed = 1;
+    worker->output->buffers[0]->size = 0;
+}
+
+static void* MP3Server_worker(void* arg) {
+    MP3ServerWorker* worker = (MP3ServerWorker*) arg;
+    MP3Server* server = worker->server;
+    for (;;) {
+        pthread_mutex_lock(&server->queue_lock);
+        while (server->ready == NULL && !MP3Server_stopped(server)) pthread_cond_wait(&server->queue_cond, &server->queue_lock);
+        MP3ServerConn* conn = MP3Server_stopped(server) ? NULL : server->ready;
+        if (conn != NULL) {
+            server->ready = conn->next;
+            if (server->ready == NULL) server->ready_tail = NULL;
+        }
+        pthread_mutex_unlock(&server->queue_lock);
+        if (conn == NULL) break;
+
+        MP3Server_serve(worker, conn);
+
+        pthread_mutex_lock(&server->queue_lock);
+        conn->next = server->done;
+        server->done = conn;
+        pthread_mutex_unlock(&server->queue_lock);
+        // fails only when the pipe is full, a wake-up is pending then
+        ssize_t woken = write(server->wake[1], "", 1);
+        (void) woken;
+        MP3_STATS_ADD(syscalls, 1);
+    }
+    return NULL;
+}
+
+static uint64_t MP3Server_nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void MP3Server_close(MP3ServerConn* conn) {
+    close(conn->fd);
+    free(conn);
+}
+
+static void MP3Server_closeAll(MP3ServerConn* conn) {
+    while (conn != NULL) {
+        MP3ServerConn* next = conn->next;
+        MP3Server_close(conn);
+        conn = next;
+    }
+}
+
+// Take new connections until the backlog is empty, past the limit they are told and closed
+static void MP3Server_accept(MP3Server* server, MP3ServerConn** idle, uint32_t* idle_count, uint32_t* open, uint64_t now) {
+    for (;;) {
+        int fd = accept(server->fd, NULL, NULL);
+        MP3_STATS_ADD(syscalls, 1);
+        if (fd < 0 && errno == EINTR) continue;
+        if (fd < 0) return;
+
+        MP3ServerConn* conn = *open < server->options.max_connections ? (MP3ServerConn*) malloc(sizeof(MP3ServerConn)) : NULL;
+        if (conn == NULL) {
+            const char* message = "ERR too many connections\n";
+            ssize_t sent = send(fd, message, strlen(message), MSG_DONTWAIT | MSG_NOSIGNAL);
+            (void) sent;
+            close(fd);
+            continue;
+        }
+        if (server->options.send_timeout_ms > 0) {
+            struct timeval timeout = { server->options.send_timeout_ms / 1000, (server->options.send_timeout_ms % 1000) * 1000 };
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        }
+        conn->next = NULL;
+        conn->fd = fd;
+        conn->closed = 0;
+        conn->active_ms = now;
+        conn->used = 0;
+        idle[(*idle_count)++] = conn;
+        (*open)++;
+    }
+}
+
+// Poll loop of MP3Server_run, hands readable connections to the workers until MP3Server_stop
+static int MP3Server_dispatch(MP3Server* server) {
+    uint32_t max = server->options.max_connections;
+    MP3ServerConn** idle = (MP3ServerConn**) malloc(max * sizeof(MP3ServerConn*));
+    struct pollfd* polls = (struct pollfd*) malloc((max + 2) * sizeof(struct pollfd));
+    if (idle == NULL || polls == NULL) {
+        printf("Failed to allocate memory for MP3Server\n");
+        free(idle);
+        free(polls);
+        return -1;
+    }
+
+    uint32_t idle_count = 0;
+    uint32_t open = 0;
+    int result = 0;
+    while (!MP3Server_stopped(server)) {
+        polls[0].fd = server->wake[0];
+        polls[1].fd = server->fd;
+        for (uint32_t i = 0; i < idle_count; i++) polls[2 + i].fd = idle[i]->fd;
+        for (uint32_t i = 0; i < idle_count + 2; i++) {
+            polls[i].events = POLLIN;
+            polls[i].revents = 0;
+        }
+        int ready = poll(polls, idle_count + 2, MP3_SERVER_TICK_MS);
+        MP3_STATS_ADD(syscalls, 1);
+        if (ready < 0 && errno != EINTR) {
+            result = -1;
+            break;
+        }
+        uint64_t now = MP3Server_nowMs();
+
+        // readable (or hung up) connections go to the workers in poll order, idle ones time out
+        uint32_t kept = 0;
+        MP3ServerConn* queue = NULL;
+        MP3ServerConn* queue_tail = NULL;
+        for (uint32_t i = 0; i < idle_count; i++) {
+            MP3ServerConn* conn = idle[i];
+            if (polls[2 + i].revents != 0) {
+                conn->next = NULL;
+                if (queue_tail != NULL) queue_tail->next = conn;
+                else queue = conn;
+                queue_tail = conn;
+            } else if (server->options.idle_timeout_ms > 0 && now - conn->active_ms >= (uint64_t) server->options.idle_timeout_ms) {
+                MP3Server_close(conn);
+                open--;
+            } else {
+                idle[kept++] = conn;
+            }
+        }
+        idle_count = kept;
+
+        char drain[64];
+        if (polls[0].revents & POLLIN) {
+            while (read(server->wake[0], drain, sizeof(drain)) > 0) MP3_STATS_ADD(syscalls, 1);
+        }
+        pthread_mutex_lock(&server->queue_lock);
+        MP3ServerConn* done = server->done;
+        server->done = NULL;
+        if (queue != NULL) {
+            if (server->ready_tail != NULL) server->ready_tail->next = queue;
+            else server->ready = queue;
+            server->ready_tail = queue_tail;
+            pthread_cond_broadcast(&server->queue_cond);
+        }
+        pthread_mutex_unlock(&server->queue_lock);
+
+        // back from the workers, polled again unless they are finished
+        while (done != NULL) {
+            MP3ServerConn* next = done->next;
+            if (done->closed) {
+                MP3Server_close(done);
+                open--;
+            } else {
+                done->active_ms = now;
+                idle[idle_count++] = done;
+            }
+            done = next;
+        }
+
+        if (polls[1].revents & POLLIN) MP3Server_accept(server, idle, &idle_count, &open, now);
+    }
+
+    for (uint32_t i = 0; i < idle_count; i++) MP3Server_close(idle[i]);
+    free(idle);
+    free(polls);
+    return result;
+}
+
+int MP3Server_run(MP3Server* server) {
+    if (server == NULL) return -1;
+    int threads = server->options.threads > 0 ? server->options.threads : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    MP3ServerWorker* workers = (MP3ServerWorker*) calloc(threads, sizeof(MP3ServerWorker));
+    if (workers == NULL) return -1;
+
+    // a client closing early must not kill the process, workers inherit the mask
+    sigset_t pipe_signal, old_mask;
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_signal, &old_mask);
+
+    int started = 0;
+    for (int i = 0; i < threads; i++) {
+        MP3ServerWorker* worker = &workers[i];
+        worker->server = server;
+        worker->arena = MP3Arena_create(0);
+        worker->reader = MP3Reader_createWithArena(NULL, worker->arena);
+        worker->output = MP3Writer_create(-1, MP3_WRITER_JSON);
+        worker->render = MP3Writer_create(-1, MP3_WRITER_JSON);
+        if (worker->output != NULL) worker->output->buffers[0] = (MP3WriterBuffer*) calloc(1, sizeof(MP3WriterBuffer));
+        if (worker->reader == NULL || worker->output == NULL || worker->output->buffers[0] == NULL || worker->render == NULL ||
+            pthread_create(&worker->thread, NULL, MP3Server_worker, worker) != 0) {
+            break;
+        }
+        started++;
+    }
+    int result = -1;
+    if (started < threads) {
+        printf("Failed to start server workers\n");
+        MP3Server_stop(server);
+    } else {
+        result = MP3Server_dispatch(server);
+        MP3Server_stop(server);
+    }
+
+    // wake the workers, connections still queued are closed once they are gone
+    pthread_mutex_lock(&server->queue_lock);
+    pthread_cond_broadcast(&server->queue_cond);
+    pthread_mutex_unlock(&server->queue_lock);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    MP3Server_closeAll(server->ready);
+    MP3Server_closeAll(server->done);
+    server->ready = server->ready_tail = server->done = NULL;
+    for (int i = 0; i < threads && workers[i].server != NULL; i++) {
+        MP3Reader_destroy(workers[i].reader);
+        MP3Arena_destroy(workers[i].arena);
+        MP3Writer_destroy(workers[i].output);
+        MP3Writer_destroy(workers[i].render);
+    }
+    free(workers);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    return result;
 }
 
 
 
 
 
+/*
+    ARENA
+*/
+#define MP3_ARENA_ALIGN 16
+// block header padded so block data stays aligned
+#define MP3_ARENA_HEADER ((sizeof(MP3ArenaBlock) + MP3_ARENA_ALIGN - 1) & ~(size_t)(MP3_ARENA_ALIGN - 1))
+
+MP3Arena* MP3Arena_create(size_t block_size) {
+    MP3Arena* arena = (MP3Arena*) malloc(sizeof(MP3Arena));
+    if (arena == NULL) return NULL;
+
+    arena->block_size = block_size > 0 ? block_size : 64 * 1024;
+    arena->first = NULL;
+    arena->current = NULL;
+    return arena;
+}
+
+void MP3Arena_destroy(MP3Arena* arena) {
+    if (arena == NULL) return;
+
+    MP3ArenaBlock* block = arena->first;
+    while (block != NULL) {
+        MP3ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    free(arena);
+}
 
+void* MP3Arena_alloc(MP3Arena* arena, size_t size) {
+    if (arena == NULL) return NULL;
+    size = (size + MP3_ARENA_ALIGN - 1) & ~(size_t)(MP3_ARENA_ALIGN - 1);
 
+    // current block, then blocks kept from before the last reset
+    MP3ArenaBlock* block = arena->current;
+    while (block != NULL && block->used + size > block->size) {
+        block = block->next;
+        if (block != NULL) block->used = 0;
+    }
 
+    if (block == NULL) {
+        size_t block_size = size > arena->block_size ? size : arena->block_size;
+        MP3_STATS_ADD(allocations, 1);
+        block = (MP3ArenaBlock*) malloc(MP3_ARENA_HEADER + block_size);
+        if (block == NULL) return NULL;
+        block->size = block_size;
+        block->used = 0;
+
+        // link after current block
+        if (arena->current != NULL) {
+            block->next = arena->current->next;
+            arena->current->next = block;
+        } else {
+            block->next = NULL;
+            arena->first = block;
+        }
+    }
 
+    arena->current = block;
+    void* p = (uint8_t*) block + MP3_ARENA_HEADER + block->used;
+    block->used += size;
+    return p;
+}
 
+// Release all allocations, blocks are kept for reuse
+void MP3Arena_reset(MP3Arena* arena) {
+    if (arena == NULL || arena->first == NULL) return;
+    arena->first->used = 0;
+    arena->current = arena->first;
+}
 
 
 
@@ -484,17 +5808,24 @@ void MP3_Picture_free(MP3_Picture* picture) {
     VECTOR
 */
 vector* vector_create() {
-    vector* v = (vector*) malloc(sizeof(vector));
+    return vector_create_arena(NULL);
+}
+
+vector* vector_create_arena(MP3Arena* arena) {
+    if (arena == NULL) MP3_STATS_ADD(allocations, 1);
+    vector* v = (vector*) (arena ? MP3Arena_alloc(arena, sizeof(vector)) : malloc(sizeof(vector)));
     if (v == NULL) return NULL;
 
     v->data = NULL;
     v->size = 0;
     v->capacity = 0;
+    v->arena = arena;
     return v;
 }
 
 void vector_destroy(vector* v) {
-    if (v != NULL) {
+    // arena vectors go away with MP3Arena_reset
+    if (v != NULL && v->arena == NULL) {
         free(v->data);
         free(v);
     }
@@ -510,7 +5841,14 @@ int vector_push_back(vector* v, void *item) {
 
     if (v->size == v->capacity) {
         int new_cap = v->capacity == 0 ? 1 : v->capacity * 2;
-        void **new_data = (void**) realloc(v->data, new_cap * sizeof(void*));
+        void **new_data;
+        if (v->arena != NULL) {
+            new_data = (void**) MP3Arena_alloc(v->arena, new_cap * sizeof(void*));
+            if (new_data != NULL && v->size > 0) memcpy(new_data, v->data, v->size * sizeof(void*));
+        } else {
+            MP3_STATS_ADD(allocations, 1);
+            new_data = (void**) realloc(v->data, new_cap * sizeof(void*));
+        }
         if (new_data == NULL) return -1;
 
         v->data = new_data;
@@ -535,6 +5873,10 @@ void* vector_index(vector* v, int index) {
 
 
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif // MP3_READER_IMPLEMENTATION
 
 #endif // MP3_READER_H
\ No newline at end of file
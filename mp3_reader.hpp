@@ -0,0 +1,356 @@
+#ifndef MP3_READER_HPP
+#define MP3_READER_HPP
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <utility>
+
+#include "mp3_reader.h"
+
+// C++20 wrapper over mp3_reader.h. Everything is a view into the reader's data: nothing
+// here allocates, values stay valid until the next load or the reader is destroyed.
+// Define MP3_READER_IMPLEMENTATION in one translation unit before including this header,
+// or link libmp3reader.
+namespace mp3 {
+
+
+/*
+    Tables
+*/
+
+inline constexpr int bitratesMPEG1[3][16] = {
+    {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 0}, // Layer I
+    {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 0},    // Layer II
+    {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0}      // Layer III
+};
+
+inline constexpr int bitratesMPEG2[3][16] = {
+    {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256, 0}, // Layer I
+    {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},      // Layer II
+    {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},      // Layer III
+};
+
+inline constexpr int frequencies[4][4] = {
+    {44100, 48000, 32000, 0},  // MPEG-1
+    {22050, 24000, 16000, 0},  // MPEG-2
+    {0,     0,     0,     0},  // Reserved
+    {11025, 12000, 8000,  0}   // MPEG-2.5
+};
+
+// Decoded 32-bit MPEG audio frame header, size 0 if it isn't a valid header
+struct FrameInfo {
+    uint32_t size = 0;       // Frame length in bytes
+    uint32_t samples = 0;    // Samples per frame
+    uint32_t frequency = 0;  // Sample rate
+    uint32_t bitrate = 0;    // kbit/s
+};
+
+// Same rules as MP3FrameHeader_getFrameSize, folds to a constant for constant input
+constexpr FrameInfo frameInfo(uint32_t h) {
+    uint32_t version = (h >> 19) & 3;
+    uint32_t layer = (h >> 17) & 3;
+    uint32_t bitrate_index = (h >> 12) & 15;
+    uint32_t frequency_index = (h >> 10) & 3;
+    uint32_t padding = (h >> 9) & 1;
+
+    FrameInfo info;
+    if ((h >> 21) != 0x7FF || version == 1 || layer == 0) return info;
+    if (bitrate_index == 0 || bitrate_index == 15 || frequency_index == 3) return info; // free format unsupported
+    if ((h & 3) == 2) return info; // reserved emphasis
+
+    info.bitrate = (version == 3 ? bitratesMPEG1 : bitratesMPEG2)[3 - layer][bitrate_index];
+    info.frequency = frequencies[3 - version][frequency_index];
+    uint32_t bitrate = info.bitrate * 1000;
+
+    if (layer == 3) { // Layer I
+        info.samples = 384;
+        info.size = (12 * bitrate / info.frequency + padding) * 4;
+    } else if (layer == 1 && version != 3) { // Layer III, MPEG-2/2.5
+        info.samples = 576;
+        info.size = 72 * bitrate / info.frequency + padding;
+    } else {
+        info.samples = 1152;
+        info.size = 144 * bitrate / info.frequency + padding;
+    }
+    return info;
+}
+
+constexpr FrameInfo frameInfo(std::span<const std::byte, 4> data) {
+    return frameInfo((uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) | (uint32_t(data[2]) << 8) | uint32_t(data[3]));
+}
+
+static_assert(frameInfo(0xFFFB9064).size == 417, "MPEG-1 Layer III 128 kbit/s 44.1 kHz");
+
+
+/*
+    Frames
+*/
+
+inline std::span<const std::byte> bytes(const void* data, size_t size) {
+    return {static_cast<const std::byte*>(data), size};
+}
+
+// Text frame content, encoding is one of the ID3v2 text encodings (0-3)
+class Text {
+public:
+    Text() = default;
+    explicit Text(const MP3_TextData& text) : text_(text) {}
+
+    uint8_t encoding() const { return text_.encoding; }
+    std::span<const std::byte> bytes() const { return mp3::bytes(text_.data, text_.len); }
+    // Raw text up to the first terminator, meaningful for ISO-8859-1 and UTF-8 text
+    std::string_view raw() const {
+        std::string_view s(text_.data, text_.len);
+        return s.substr(0, s.find('\0'));
+    }
+    // Convert into buf, result views buf
+    std::string_view utf8(std::span<char> buf) const {
+        int n = MP3_TextData_toUTF8(&text_, buf.data(), (uint32_t) buf.size());
+        return n > 0 ? std::string_view(buf.data(), (size_t) n) : std::string_view();
+    }
+    const MP3_TextData& get() const { return text_; }
+
+private:
+    MP3_TextData text_{};
+};
+
+class Picture {
+public:
+    Picture() = default;
+    explicit Picture(const MP3_Picture& picture) : picture_(picture) {}
+
+    std::string_view mime() const { return reinterpret_cast<const char*>(picture_.mime_type); }
+    uint8_t type() const { return picture_.picture_type; }
+    std::span<const std::byte> bytes() const { return mp3::bytes(picture_.data, picture_.size); }
+    const MP3_Picture& get() const { return picture_; }
+
+private:
+    MP3_Picture picture_{};
+};
+
+class Frame {
+public:
+    Frame() = default;
+    Frame(MP3Reader* reader, ID3v2TagHeader* tag, ID3v2TagFrameHeader* frame) : reader_(reader), tag_(tag), frame_(frame) {}
+
+    explicit operator bool() const { return frame_ != nullptr; }
+    int id() const { return ID3v2Tag_getFrameId(tag_, frame_); } // MP3_FRAME_*
+    std::string_view name() const { return {frame_->header, tag_->version_major == 2 ? 3u : 4u}; }
+    uint32_t size() const { return ID3v2Tag_getFrameSize(tag_, frame_); }
+
+    // Content after flags, decoded when the frame is unsynchronised or compressed
+    std::span<const std::byte> data() const {
+        uint8_t* data;
+        uint32_t size;
+        if (MP3Reader_getFrameData(reader_, tag_, frame_, &data, &size) != 0) return {};
+        return mp3::bytes(data, size);
+    }
+    std::optional<Text> text() const {
+        MP3_TextData text;
+        if (MP3Reader_readFrameText(reader_, tag_, frame_, &text) != 0) return std::nullopt;
+        return Text(text);
+    }
+    std::optional<Picture> picture() const {
+        MP3_Picture picture;
+        if (MP3Reader_readFramePicture(reader_, tag_, frame_, &picture) != 0) return std::nullopt;
+        return Picture(picture);
+    }
+
+    ID3v2TagFrameHeader* get() const { return frame_; }
+
+private:
+    MP3Reader* reader_ = nullptr;
+    ID3v2TagHeader* tag_ = nullptr;
+    ID3v2TagFrameHeader* frame_ = nullptr;
+};
+
+// All frames of a tag, in order
+class FrameRange {
+public:
+    class iterator {
+    public:
+        using value_type = Frame;
+        using difference_type = std::ptrdiff_t;
+
+        iterator() = default;
+        iterator(MP3Reader* reader, ID3v2TagHeader* tag) : reader_(reader) {
+            ID3v2FrameIter_init(&it_, reader, tag);
+            ++*this;
+        }
+        Frame operator*() const { return Frame(reader_, it_.tag, frame_); }
+        iterator& operator++() {
+            frame_ = ID3v2FrameIter_next(&it_);
+            return *this;
+        }
+        void operator++(int) { ++*this; }
+        bool operator==(std::default_sentinel_t) const { return frame_ == nullptr; }
+
+    private:
+        MP3Reader* reader_ = nullptr;
+        ID3v2FrameIter it_{};
+        ID3v2TagFrameHeader* frame_ = nullptr;
+    };
+
+    FrameRange(MP3Reader* reader, ID3v2TagHeader* tag) : reader_(reader), tag_(tag) {}
+    iterator begin() const { return iterator(reader_, tag_); }
+    std::default_sentinel_t end() const { return {}; }
+
+private:
+    MP3Reader* reader_;
+    ID3v2TagHeader* tag_;
+};
+
+// Frames of one MP3_FRAME_* ID through the frame directory (TXXX, COMM, APIC...)
+class FrameIdRange {
+public:
+    class iterator {
+    public:
+        using value_type = Frame;
+        using difference_type = std::ptrdiff_t;
+
+        iterator() = default;
+        iterator(MP3Reader* reader, ID3v2TagHeader* tag, int id)
+            : reader_(reader), tag_(tag), frame_(MP3Reader_findFrame(reader, tag, id)) {}
+        Frame operator*() const { return Frame(reader_, tag_, frame_); }
+        iterator& operator++() {
+            frame_ = MP3Reader_findNextFrame(reader_, tag_, frame_);
+            return *this;
+        }
+        void operator++(int) { ++*this; }
+        bool operator==(std::default_sentinel_t) const { return frame_ == nullptr; }
+
+    private:
+        MP3Reader* reader_ = nullptr;
+        ID3v2TagHeader* tag_ = nullptr;
+        ID3v2TagFrameHeader* frame_ = nullptr;
+    };
+
+    FrameIdRange(MP3Reader* reader, ID3v2TagHeader* tag, int id) : reader_(reader), tag_(tag), id_(id) {}
+    iterator begin() const { return iterator(reader_, tag_, id_); }
+    std::default_sentinel_t end() const { return {}; }
+
+private:
+    MP3Reader* reader_;
+    ID3v2TagHeader* tag_;
+    int id_;
+};
+
+
+/*
+    Tags
+*/
+
+class Tag {
+public:
+    Tag() = default;
+    Tag(MP3Reader* reader, ID3v2TagHeader* tag) : reader_(reader), tag_(tag) {}
+
+    explicit operator bool() const { return tag_ != nullptr; }
+    int version() const { return tag_->version_major; }
+    uint32_t size() const { return ID3v2Tag_getTagSize(tag_); }
+
+    FrameRange frames() const { return FrameRange(reader_, tag_); }
+    FrameIdRange frames(int id) const { return FrameIdRange(reader_, tag_, id); }
+    Frame find(int id) const { return Frame(reader_, tag_, MP3Reader_findFrame(reader_, tag_, id)); }
+    std::optional<Text> text(int id) const {
+        Frame frame = find(id);
+        return frame ? frame.text() : std::nullopt;
+    }
+
+    ID3v2TagHeader* get() const { return tag_; }
+
+private:
+    MP3Reader* reader_ = nullptr;
+    ID3v2TagHeader* tag_ = nullptr;
+};
+
+class TagRange {
+public:
+    class iterator {
+    public:
+        using value_type = Tag;
+        using difference_type = std::ptrdiff_t;
+
+        iterator() = default;
+        iterator(MP3Reader* reader, int mode) {
+            ID3v2TagIter_init(&it_, reader, mode);
+            ++*this;
+        }
+        Tag operator*() const { return Tag(it_.reader, tag_); }
+        iterator& operator++() {
+            tag_ = ID3v2TagIter_next(&it_);
+            return *this;
+        }
+        void operator++(int) { ++*this; }
+        bool operator==(std::default_sentinel_t) const { return tag_ == nullptr; }
+
+    private:
+        ID3v2TagIter it_{};
+        ID3v2TagHeader* tag_ = nullptr;
+    };
+
+    TagRange(MP3Reader* reader, int mode) : reader_(reader), mode_(mode) {}
+    iterator begin() const { return iterator(reader_, mode_); }
+    std::default_sentinel_t end() const { return {}; }
+
+private:
+    MP3Reader* reader_;
+    int mode_;
+};
+
+
+/*
+    Reader
+*/
+
+class Reader {
+public:
+    Reader() : reader_(MP3Reader_create(nullptr)) {}
+    explicit Reader(MP3Arena* arena) : reader_(MP3Reader_createWithArena(nullptr, arena)) {}
+    ~Reader() { MP3Reader_destroy(reader_); }
+
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+    Reader(Reader&& other) noexcept : reader_(std::exchange(other.reader_, nullptr)) {}
+    Reader& operator=(Reader&& other) noexcept {
+        std::swap(reader_, other.reader_);
+        return *this;
+    }
+
+    explicit operator bool() const { return reader_ != nullptr; }
+
+    // Return true on success, the buffer is reused across loads
+    bool load(const char* filename) { return reader_ && MP3Reader_load(reader_, filename) == 0; }
+    bool loadMmap(const char* filename) { return reader_ && MP3Reader_loadMmap(reader_, filename) == 0; }
+    bool loadTags(const char* filename) { return reader_ && MP3Reader_loadTags(reader_, filename) == 0; }
+
+    std::span<const std::byte> data() const { return reader_ ? bytes(reader_->data, reader_->size) : std::span<const std::byte>(); }
+    uint32_t fileSize() const { return reader_ ? reader_->file_size : 0; }
+
+    TagRange tags(int mode = MP3_TAGSCAN_SPEC) const { return TagRange(reader_, mode); }
+    Tag firstTag() const { return *tags().begin(); }
+    const ID3v1Tag* id3v1() const { return MP3Reader_getID3v1Tag(reader_); }
+
+    std::optional<uint32_t> durationMs() const {
+        uint32_t ms;
+        if (MP3Reader_getDuration(reader_, &ms) != 0) return std::nullopt;
+        return ms;
+    }
+    std::optional<uint32_t> seek(uint32_t ms) const {
+        uint32_t offset;
+        if (MP3Reader_seekToTime(reader_, ms, &offset) != 0) return std::nullopt;
+        return offset;
+    }
+
+    MP3Reader* get() const { return reader_; }
+
+private:
+    MP3Reader* reader_;
+};
+
+} // namespace mp3
+
+#endif // MP3_READER_HPP